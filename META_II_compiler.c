@@ -6,6 +6,13 @@
     when invoked with a compiled version of META II (META_II.m2a). Note that
     this is not a fundamental requirement and that we could instead emit any
     code as long as it implements what the syntax equations demand.
+
+    It's meant to keep up with machine-generated grammars of many thousands
+    of rules: tokens are told apart by table lookups and keywords by a
+    perfect hash, the output is buffered, expressions nest as deep as memory
+    allows and an error doesn't stop the checking of the rules after it.
+
+    --stats[=json] reports where the time goes (see stats.h).
 */
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,6 +20,8 @@
 #include <assert.h>
 #include <string.h>
 #include <stdarg.h>
+#include <setjmp.h>
+#include "stats.h"
 
 enum {
     TOK_KW_SYNTAX,
@@ -23,6 +32,8 @@ enum {
     TOK_KW_EMPTY,
     TOK_KW_OUT,
     TOK_KW_LABEL,
+    TOK_KW_CLASS,
+    TOK_KW_TOKEN,
     TOK_ID,
     TOK_STR,
     TOK_STAR,
@@ -34,16 +45,52 @@ enum {
     TOK_EQ,
     TOK_SEMI,
     TOK_SLASH,
+    TOK_HASH,
     TOK_EOF,
+    TOK_NONE,       /* char that isn't a token by itself */
+};
+
+/* char classes */
+enum {
+    C_SPACE = 1,
+    C_ALPHA = 2,
+    C_DIGIT = 4,
+};
+
+#define OUTBUFSIZ   65536
+#define MAXERRORS   20
+
+/*
+    Keywords, at the slot given by KWHASH(), which is a perfect hash for
+    this set: the sum of the first and the last letter.
+*/
+#define KWHASH(s, n)    (((s)[0]+(s)[(n)-1]) & 15)
+
+static struct {
+    char *name;
+    int tok;
+} keywords[16];
+
+static char *keyword_names[] = {
+    "SYNTAX", "END", "ID", "NUMBER", "STRING", "EMPTY", "OUT", "LABEL", "CLASS", "TOKEN",
 };
 
+static unsigned char char_class[256];
+static unsigned char char_tok[256];
+
 char *prog_name;
 char *input_path;
 char *curr;
 int LA;
 int line_counter = 1;
-char token_string[512];
+char *token_string;     /* the text of LA in the input; not NUL-terminated */
+int token_len;
 int label_counter = 1;
+int nerrors;
+jmp_buf *recover;       /* where err() goes on to the next rule, if set */
+
+char outbuf[OUTBUFSIZ];
+int outpos;
 
 void err(char *fmt, ...)
 {
@@ -54,90 +101,177 @@ void err(char *fmt, ...)
     vfprintf(stderr, fmt, args);
     va_end(args);
     fprintf(stderr, "\n");
-    exit(EXIT_FAILURE);
+    if (recover==NULL || ++nerrors==MAXERRORS)
+        exit(EXIT_FAILURE);
+    longjmp(*recover, 1);
+}
+
+void flush_out(void)
+{
+    fwrite(outbuf, 1, outpos, stdout);
+    stats_add(ST_BYTES_OUT, (unsigned long long)outpos);
+    outpos = 0;
 }
 
-void skip_white(void)
+/* write generated code to stdout; nothing is written once there are errors */
+void out(char *s, int n)
 {
-    while (isspace(*curr)) {
-        if (*curr == '\n')
-            ++line_counter;
-        ++curr;
+    if (nerrors > 0)
+        return;
+    if (outpos+n > OUTBUFSIZ) {
+        flush_out();
+        if (n > OUTBUFSIZ) {
+            fwrite(s, 1, n, stdout);
+            stats_add(ST_BYTES_OUT, (unsigned long long)n);
+            return;
+        }
+    }
+    memcpy(outbuf+outpos, s, n);
+    outpos += n;
+}
+
+void out_label(int lab)
+{
+    char buf[16], *p;
+
+    p = buf+sizeof(buf);
+    do
+        *--p = (char)('0'+lab%10);
+    while ((lab/=10) > 0);
+    *--p = 'L';
+    out(p, (int)(buf+sizeof(buf)-p));
+}
+
+/* emit "\t<op>\n" */
+void emit(char *op)
+{
+    out("\t", 1);
+    out(op, (int)strlen(op));
+    out("\n", 1);
+}
+
+/* emit "\t<op> <the current token>\n" */
+void emit_tok(char *op)
+{
+    out("\t", 1);
+    out(op, (int)strlen(op));
+    out(" ", 1);
+    out(token_string, token_len);
+    out("\n", 1);
+}
+
+/* emit "\t<op> L<lab>\n" */
+void emit_lab(char *op, int lab)
+{
+    out("\t", 1);
+    out(op, (int)strlen(op));
+    out(" ", 1);
+    out_label(lab);
+    out("\n", 1);
+}
+
+/* emit a label definition */
+void define_lab(int lab)
+{
+    out_label(lab);
+    out("\n", 1);
+}
+
+/* emit the current token as a label definition */
+void define_tok(void)
+{
+    out(token_string, token_len);
+    out("\n", 1);
+}
+
+void lex_init(void)
+{
+    int c, i;
+
+    for (c = 0; c < 256; c++) {
+        char_class[c] = (unsigned char)((isspace(c)?C_SPACE:0) | (isalpha(c)?C_ALPHA:0)
+                                        | (isdigit(c)?C_DIGIT:0));
+        char_tok[c] = TOK_NONE;
+    }
+    char_tok['$'] = TOK_DOLLAR;
+    char_tok['('] = TOK_LPAREN;
+    char_tok[')'] = TOK_RPAREN;
+    char_tok['='] = TOK_EQ;
+    char_tok['/'] = TOK_SLASH;
+    char_tok['#'] = TOK_HASH;
+    for (i = 0; i < (int)(sizeof(keyword_names)/sizeof(keyword_names[0])); i++) {
+        c = KWHASH(keyword_names[i], (int)strlen(keyword_names[i]));
+        assert(keywords[c].name == NULL);
+        keywords[c].name = keyword_names[i];
+        keywords[c].tok = TOK_KW_SYNTAX+i;
     }
 }
 
 int get_token(void)
 {
+    int n, tok;
     char *p;
 
     for (;;) {
-        skip_white();
-        p = token_string;
-        if (*curr == '.') {
-            *p++ = *curr++;
+        while (char_class[(unsigned char)*curr] & C_SPACE) {
+            if (*curr == '\n')
+                ++line_counter;
+            ++curr;
+        }
+        token_string = p = curr;
+        if ((tok=char_tok[(unsigned char)*curr]) != TOK_NONE) {
+            ++curr;
+            token_len = 1;
+            return tok;
+        }
+        if (char_class[(unsigned char)*curr] & C_ALPHA) {
+            do
+                ++curr;
+            while (char_class[(unsigned char)*curr] & (C_ALPHA|C_DIGIT));
+            token_len = (int)(curr-p);
+            return TOK_ID;
+        }
+        switch (*curr++) {
+        case '\0':
+            --curr;
+            token_len = 0;
+            return TOK_EOF;
+        case '.':
             if (*curr == ',') {
-                *p++ = *curr++;
-                *p = '\0';
+                ++curr;
+                token_len = 2;
                 return TOK_SEMI;
-            } else if (isalpha(*curr)) {
-                int n;
-#define TEST_KW(s)                              \
-    if (strncmp(curr, #s, n=strlen(#s)) == 0) { \
-        strncpy(p, curr, n);                    \
-        p[n] = '\0';                            \
-        curr += n;                              \
-        return TOK_KW_##s;                      \
-    }
-                TEST_KW(SYNTAX);
-                TEST_KW(END);
-                TEST_KW(ID);
-                TEST_KW(NUMBER);
-                TEST_KW(STRING);
-                TEST_KW(EMPTY);
-                TEST_KW(OUT);
-                TEST_KW(LABEL);
-#undef TEST_KW
             }
-            continue;
-        } else if (isalpha(*curr)) {
-            do
-                *p++ = *curr++;
-            while (isalnum(*curr));
-            *p = '\0';
-            return TOK_ID;
-        } else if (*curr == '\'') {
+            if (!(char_class[(unsigned char)*curr] & C_ALPHA))
+                continue;
             do
-                *p++ = *curr++;
-            while (*curr!='\0' && *curr!='\'' && *curr!='\n');
+                ++curr;
+            while (char_class[(unsigned char)*curr] & (C_ALPHA|C_DIGIT));
+            token_len = (int)(curr-p);
+            n = token_len-1;
+            tok = KWHASH(p+1, n);
+            if (keywords[tok].name!=NULL && strncmp(keywords[tok].name, p+1, n)==0
+            && keywords[tok].name[n]=='\0')
+                return keywords[tok].tok;
+            err("unknown keyword `%.*s'", token_len, p);
+            continue;
+        case '\'':
+            while (*curr!='\0' && *curr!='\'' && *curr!='\n')
+                ++curr;
             if (*curr != '\'')
                 err("unterminated string literal");
-            *p++ = *curr++;
-            *p = '\0';
+            ++curr;
+            token_len = (int)(curr-p);
             return TOK_STR;
-        } else {
-            switch (*p++ = *curr++) {
-            case '\0': --curr; return TOK_EOF;
-            case '*':
-                if (*curr == '1') {
-                    *p++ = *curr++;
-                    *p = '\0';
-                    return TOK_STAR1;
-                } else if (*curr == '2') {
-                    *p++ = *curr++;
-                    *p = '\0';
-                    return TOK_STAR2;
-                } else {
-                    *p = '\0';
-                    return TOK_STAR;
-                }
-            case '$': *p = '\0'; return TOK_DOLLAR;
-            case '(': *p = '\0'; return TOK_LPAREN;
-            case ')': *p = '\0'; return TOK_RPAREN;
-            case '=': *p = '\0'; return TOK_EQ;
-            case '/': *p = '\0'; return TOK_SLASH;
-            default:
-                continue;
+        case '*':
+            if (*curr=='1' || *curr=='2') {
+                token_len = 2;
+                return *curr++=='1' ? TOK_STAR1 : TOK_STAR2;
             }
+            token_len = 1;
+            return TOK_STAR;
+        default:
+            continue;
         }
     }
 }
@@ -146,33 +280,39 @@ void match(int expected)
 {
     if (LA == expected)
         LA = get_token();
+    else if (LA == TOK_EOF)
+        err("unexpected end of file");
     else
-        err("unexpected `%s'", token_string);
+        err("unexpected `%.*s'", token_len, token_string);
 }
 
 /*
     OUT1 = '*1'    .OUT('GN1')  /
            '*2'    .OUT('GN2')  /
            '*'     .OUT('CI')   /
-           .STRING .OUT('CL '*) .,
+           .STRING .OUT('CL '*) /
+           '#'     .OUT('POS')  .,
 */
 void out1(void)
 {
     switch (LA) {
     case TOK_STAR1:
-        printf("\tGN1\n");
+        emit("GN1");
         break;
     case TOK_STAR2:
-        printf("\tGN2\n");
+        emit("GN2");
         break;
     case TOK_STAR:
-        printf("\tCI\n");
+        emit("CI");
         break;
     case TOK_STR:
-        printf("\tCL %s\n", token_string);
+        emit_tok("CL");
+        break;
+    case TOK_HASH:
+        emit("POS");
         break;
     default:
-        err("out1(): unexpected `%s'", token_string);
+        match(TOK_STR);
         break;
     }
     match(LA);
@@ -193,15 +333,20 @@ void output(void)
         match(TOK_RPAREN);
     } else {
         match(TOK_KW_LABEL);
-        printf("\tLB\n");
+        emit("LB");
         out1();
     }
-    printf("\tOUT\n");
+    emit("OUT");
 }
 
-void ex1(void);
-
 /*
+    EX1 = .OUT('ALT ' *1) EX2 $('/' .OUT('BT ' *1) .OUT('ALT ' *1) EX2)
+          .LABEL *1 .,
+
+    EX2 = (EX3 .OUT('BF ' *1) / OUTPUT)
+          $(EX3 .OUT('BE') / OUTPUT)
+          .LABEL *1 .,
+
     EX3 = .ID       .OUT('CLL ' *) /
           .STRING   .OUT('TST ' *) /
           '.ID'     .OUT('ID')     /
@@ -210,130 +355,249 @@ void ex1(void);
           '(' EX1 ')'              /
           '.EMPTY'  .OUT('SET')    /
           '$' .LABEL *1 EX3 .OUT('BT ' *1) .OUT('SET') .,
+
+    The three rules nest without limit through '(' and '$', so instead of
+    calling each other they're run from a stack of work: each entry is a
+    rule that waits for the one it started to be done, together with its
+    *1 label (-1 while not made yet).
 */
-void ex3(void)
-{
-    int lab1;
+enum {
+    W_EX1,          /* waiting for EX2 */
+    W_EX2_FIRST,    /* waiting for the first EX3 */
+    W_EX2,          /* waiting for a later EX3 */
+    W_PAREN,        /* waiting for EX1 before ')' */
+    W_DOLLAR,       /* waiting for EX3 */
+};
 
-    switch (LA) {
-    case TOK_ID:
-        printf("\tCLL %s\n", token_string);
-        match(TOK_ID);
-        break;
-    case TOK_STR:
-        printf("\tTST %s\n", token_string);
-        match(TOK_STR);
-        break;
-    case TOK_KW_ID:
-        printf("\tID\n");
-        match(TOK_KW_ID);
-        break;
-    case TOK_KW_NUMBER:
-        printf("\tNUM\n");
-        match(TOK_KW_NUMBER);
-        break;
-    case TOK_KW_STRING:
-        printf("\tSR\n");
-        match(TOK_KW_STRING);
-        break;
-    case TOK_KW_EMPTY:
-        printf("\tSET\n");
-        match(TOK_KW_EMPTY);
-        break;
-    case TOK_DOLLAR:
-        match(TOK_DOLLAR);
-        lab1 = label_counter++;
-        printf("L%d\n", lab1);
-        ex3();
-        printf("\tBT L%d\n", lab1);
-        printf("\tSET\n");
-        break;
-    case TOK_LPAREN:
-        match(TOK_LPAREN);
-        ex1();
-        match(TOK_RPAREN);
-        break;
-    default:
-        err("ex3(): unexpected `%s'", token_string);
-        break;
+typedef struct Work Work;
+struct Work {
+    int kind, lab;
+};
+
+Work *work;
+int nwork, maxwork;
+
+void push_work(int kind, int lab)
+{
+    if (nwork == maxwork) {
+        maxwork = maxwork ? 2*maxwork : 64;
+        work = realloc(work, sizeof(work[0])*maxwork);
     }
+    work[nwork].kind = kind;
+    work[nwork].lab = lab;
+    nwork++;
 }
 
-/*
-    EX2 = (EX3 .OUT('BF ' *1) / OUTPUT)
-          $(EX3 .OUT('BE') / OUTPUT)
-          .LABEL *1 .,
-*/
-void ex2(void)
+void ex1(void)
 {
-    int lab1;
+    enum { START_EX1, START_EX2, START_EX3, MORE_EX2, DONE } next;
+    int base, lab;
+    Work *w;
 
-    lab1 = -1;
-    if (LA==TOK_KW_OUT || LA==TOK_KW_LABEL) {
-        output();
-    } else {
-        ex3();
-        lab1 = label_counter++;
-        printf("\tBF L%d\n", lab1);
-    }
-    while (LA!=TOK_SLASH && LA!=TOK_SEMI && LA!=TOK_RPAREN) {
-        if (LA==TOK_KW_OUT || LA==TOK_KW_LABEL) {
-            output();
-        } else {
-            ex3();
-            printf("\tBE\n");
+    base = nwork;
+    next = START_EX1;
+    for (;;) {
+        switch (next) {
+        case START_EX1:
+            lab = label_counter++;
+            emit_lab("ALT", lab);
+            push_work(W_EX1, lab);
+            next = START_EX2;
+            break;
+        case START_EX2:
+            if (LA==TOK_KW_OUT || LA==TOK_KW_LABEL) {
+                output();
+                push_work(W_EX2, -1);
+                next = MORE_EX2;
+            } else {
+                push_work(W_EX2_FIRST, -1);
+                next = START_EX3;
+            }
+            break;
+        case MORE_EX2:
+            while (LA==TOK_KW_OUT || LA==TOK_KW_LABEL)
+                output();
+            if (LA==TOK_SLASH || LA==TOK_SEMI || LA==TOK_RPAREN) {
+                w = &work[--nwork];
+                define_lab(w->lab!=-1 ? w->lab : label_counter++);
+                next = DONE;
+            } else {
+                next = START_EX3;
+            }
+            break;
+        case START_EX3:
+            next = DONE;
+            switch (LA) {
+            case TOK_ID:
+                emit_tok("CLL");
+                break;
+            case TOK_STR:
+                emit_tok("TST");
+                break;
+            case TOK_KW_ID:
+                emit("ID");
+                break;
+            case TOK_KW_NUMBER:
+                emit("NUM");
+                break;
+            case TOK_KW_STRING:
+                emit("SR");
+                break;
+            case TOK_KW_EMPTY:
+                emit("SET");
+                break;
+            case TOK_DOLLAR:
+                lab = label_counter++;
+                define_lab(lab);
+                push_work(W_DOLLAR, lab);
+                next = START_EX3;
+                break;
+            case TOK_LPAREN:
+                push_work(W_PAREN, -1);
+                next = START_EX1;
+                break;
+            default:
+                if (LA == TOK_EOF)
+                    err("unexpected end of file");
+                err("unexpected `%.*s'", token_len, token_string);
+                break;
+            }
+            match(LA);
+            break;
+        case DONE:
+            if (nwork == base)
+                return;
+            w = &work[nwork-1];
+            switch (w->kind) {
+            case W_EX1:
+                if (LA == TOK_SLASH) {
+                    match(TOK_SLASH);
+                    emit_lab("BT", w->lab);
+                    emit_lab("ALT", w->lab);
+                    next = START_EX2;
+                } else {
+                    define_lab(w->lab);
+                    --nwork;
+                }
+                break;
+            case W_EX2_FIRST:
+                w->lab = label_counter++;
+                w->kind = W_EX2;
+                emit_lab("BF", w->lab);
+                next = MORE_EX2;
+                break;
+            case W_EX2:
+                emit("BE");
+                next = MORE_EX2;
+                break;
+            case W_PAREN:
+                --nwork;
+                match(TOK_RPAREN);
+                break;
+            case W_DOLLAR:
+                emit_lab("BT", w->lab);
+                emit("SET");
+                --nwork;
+                break;
+            }
+            break;
         }
     }
-    printf("L%d\n", (lab1!=-1)?lab1:label_counter++);
 }
 
 /*
-    EX1 = EX2 $('/' .OUT('BT ' *1) EX2)
-          .LABEL *1 .,
+    ST = .ID .LABEL * '=' EX1 '.,' .OUT('R') .,
 */
-void ex1(void)
+void st(void)
+{
+    if (LA == TOK_ID)
+        define_tok();
+    match(TOK_ID);
+    match(TOK_EQ);
+    ex1();
+    match(TOK_SEMI);
+    emit("R");
+}
+
+/*
+    CLASS = '.CLASS' .ID .LABEL * '=' $(.STRING .OUT('CLS ' *)) '.,' .,
+*/
+void class(void)
 {
-    int lab1;
-
-    ex2();
-    lab1 = label_counter++;
-    while (LA == TOK_SLASH) {
-        match(TOK_SLASH);
-        printf("\tBT L%d\n", lab1);
-        ex2();
+    match(TOK_KW_CLASS);
+    if (LA == TOK_ID)
+        define_tok();
+    match(TOK_ID);
+    match(TOK_EQ);
+    while (LA == TOK_STR) {
+        emit_tok("CLS");
+        match(TOK_STR);
     }
-    printf("L%d\n", lab1);
+    match(TOK_SEMI);
 }
 
 /*
-    ST = .ID .LABEL * '=' EX1 '.,' .OUT('R') .,
+    TOKEN = '.TOKEN' .ID .LABEL * '=' .ID .OUT('SCN ' *)
+            ('$' .ID .OUT('SCR ' *) / .EMPTY) '.,' .OUT('R') .,
 */
-void st(void)
+void token(void)
 {
+    match(TOK_KW_TOKEN);
     if (LA == TOK_ID)
-        printf("%s\n", token_string);
+        define_tok();
     match(TOK_ID);
     match(TOK_EQ);
-    ex1();
+    if (LA == TOK_ID)
+        emit_tok("SCN");
+    match(TOK_ID);
+    if (LA == TOK_DOLLAR) {
+        match(TOK_DOLLAR);
+        if (LA == TOK_ID)
+            emit_tok("SCR");
+        match(TOK_ID);
+    }
     match(TOK_SEMI);
-    printf("\tR\n");
+    emit("R");
 }
 
 /*
     PROGRAM = '.SYNTAX' .ID .OUT('ADR ' *)
-              $ ST
+              $(ST / CLASS / TOKEN)
               '.END' .OUT('END') .,
+
+    An error in a rule is reported and the rest of the rule skipped, up to
+    its '.,', so that the rules after it are checked too. The output stops
+    at the first error.
 */
 void program(void)
 {
+    jmp_buf env;
+
     match(TOK_KW_SYNTAX);
     if (LA == TOK_ID)
-        printf("\tADR %s\n", token_string);
+        emit_tok("ADR");
     match(TOK_ID);
-    while (LA != TOK_KW_END)
-        st();
+    if (setjmp(env)) {
+        nwork = 0;
+        while (LA!=TOK_SEMI && LA!=TOK_KW_END && LA!=TOK_EOF)
+            LA = get_token();
+        if (LA == TOK_EOF)
+            return;
+        if (LA == TOK_SEMI)
+            LA = get_token();
+    }
+    recover = &env;
+    while (LA!=TOK_KW_END && LA!=TOK_EOF) {
+        if (LA == TOK_KW_CLASS)
+            class();
+        else if (LA == TOK_KW_TOKEN)
+            token();
+        else
+            st();
+    }
+    recover = NULL;
     match(TOK_KW_END);
-    printf("\tEND\n");
+    emit("END");
     match(TOK_EOF);
 }
 
@@ -344,10 +608,13 @@ int main(int argc, char *argv[])
     unsigned len;
 
     prog_name = argv[0];
+    for (; argc>1 && stats_option(argv[1]); --argc, ++argv)
+        ;
     if (argc < 2) {
-        fprintf(stderr, "usage: %s <program>\n", prog_name);
+        fprintf(stderr, "usage: %s [ --stats[=json] ] <program>\n", prog_name);
         exit(EXIT_SUCCESS);
     }
+    stats_start(PH_INPUT);
     input_path = argv[1];
     if ((fp=fopen(input_path, "rb")) == NULL) {
         fprintf(stderr, "%s: cannot read file `%s'\n", prog_name, input_path);
@@ -360,10 +627,19 @@ int main(int argc, char *argv[])
     len = fread(buf, 1, len, fp);
     buf[len] = '\0';
     fclose(fp);
+    stats_add(ST_BYTES_IN, len);
+    stats_phase(PH_EXEC);
+    lex_init();
     curr = buf;
     LA = get_token();
     program();
     free(buf);
+    free(work);
+    stats_phase(PH_OUTPUT);
+    if (nerrors == 0)
+        flush_out();
+    fflush(stdout);
+    stats_report();
 
-    return 0;
+    return nerrors>0 ? EXIT_FAILURE : 0;
 }
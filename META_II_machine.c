@@ -1,267 +1,305 @@
 /*
     META II machine.
     Load and execute a compiled META II program.
-*/
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdarg.h>
-#include <assert.h>
-#include <ctype.h>
-#include "asm.h"
 
-#define MAXFRAMES   64  /* max # of stacked frames (CLL) at one given time */
+    With -b the output is a binary event stream (see events.h) instead of
+    text; meta_events turns it back into text.
 
-enum {
-    OP_TST, OP_ID, OP_NUM,
-    OP_SR, OP_CLL, OP_R,
-    OP_SET, OP_B, OP_BT,
-    OP_BF, OP_BE, OP_CL,
-    OP_CI, OP_GN1, OP_GN2,
-    OP_LB, OP_OUT, OP_ADR,
-    OP_END,
-};
+    With -p the input is read and passed to the machine in pieces of the
+    given size (see meta_feed()) instead of all at once.
 
-static IDescr opcode_table[] = {
-    { "TST", OP_TST, ARG_STR  },
-    { "ID",  OP_ID,  ARG_NONE },
-    { "NUM", OP_NUM, ARG_NONE },
-    { "SR",  OP_SR,  ARG_NONE },
-    { "CLL", OP_CLL, ARG_ID   },
-    { "R",   OP_R,   ARG_NONE },
-    { "SET", OP_SET, ARG_NONE },
-    { "B",   OP_B,   ARG_ID   },
-    { "BT",  OP_BT,  ARG_ID   },
-    { "BF",  OP_BF,  ARG_ID   },
-    { "BE",  OP_BE,  ARG_NONE },
-    { "CL",  OP_CL,  ARG_STR  },
-    { "CI",  OP_CI,  ARG_NONE },
-    { "GN1", OP_GN1, ARG_NONE },
-    { "GN2", OP_GN2, ARG_NONE },
-    { "LB",  OP_LB,  ARG_NONE },
-    { "OUT", OP_OUT, ARG_NONE },
-    { "ADR", OP_ADR, ARG_ID   },
-    { "END", OP_END, ARG_NONE },
-    { NULL,  0,      0        },
-};
+    With -a the output is written by a separate thread (see writer.h).
 
-char *prog_name;
-static char *file_path;
-static IRec *instructions;
-static int instr_counter;
-static int line_counter = 1;
+    With -w the program is written to a file in the binary code format, which
+    loads faster than assembly text; meta_load() accepts either. Assembly
+    text is assembled by as many threads as there are CPUs, or as -A says.
 
-static char *skip_white(char *s)
-{
-    while (*s!='\0' && isspace(*s)) {
-        if (*s == '\n')
-            ++line_counter;
-        ++s;
-    }
-    return s;
-}
+    The code may also be a META II grammar (.m2), which is compiled with the
+    compiler code given with -C (META_II.m2a by default) and kept compiled
+    in the cache directory given with -K (by default $XDG_CACHE_HOME/meta_ii
+    or ~/.cache/meta_ii; -K '' turns the cache off), so that the next run
+    with the same grammar and compiler just loads it; see meta_open().
 
-static void execute(char *pos)
-{
-    int i, res;
-    IRec *ip, *lim;
-    char *s, *t;
-    char lastbuf[256];
-    int labcnt;
-    int indent;
-    struct {
-        int lab1, lab2;
-        int ret_addr;
-    } frames[MAXFRAMES];
-    int top_frame;
+    With -j the input is also split after occurrences of a separator (-s) and
+    the pieces are parsed in parallel starting from a rule (-r); see
+    meta_execute_parallel().
 
-    ip = &instructions[instructions[0].arg.loc];
-    lim = &instructions[instr_counter];
-    labcnt = 1;
-    indent = 1;
+    With -i calls of rules of at most the given # of instructions are
+    replaced by copies of the rules, and calls right before a return reuse
+    the caller's frame (see meta_inline()). The output is the same, but
+    with -b there are no rule enter/exit events for the calls that are gone.
 
-    res = 1;
-    top_frame = 0;
-    frames[top_frame].lab1 = -1;
-    frames[top_frame].lab2 = -1;
+    With -o the program is run over each of several inputs and the output
+    of each goes to a file named as the input followed by the given suffix.
+    The inputs are read ahead and the outputs written behind with io_uring,
+    or a thread pool with -P, with at most -q files in flight each way (see
+    batch.h); -q 0 reads and writes each file in turn.
 
-    while (ip < lim) {
-        switch (ip->opcode) {
-        case OP_TST:
-            i = 0;
-            pos = skip_white(pos);
-            for (s=pos, t=ip->arg.str; *t!='\0' && *s==*t; s++, t++)
-                lastbuf[i++] = *t;
-            if (*t == '\0') {
-                pos = s;
-                res = 1;
-            } else {
-                res = 0;
-            }
-            lastbuf[i] = '\0';
-            break;
-        case OP_ID:
-            i = 0;
-            s = pos = skip_white(pos);
-            if (isalpha(*s)) {
-                lastbuf[i++] = *s++;
-                while (isalnum(*s))
-                    lastbuf[i++] = *s++;
-                pos = s;
-                res = 1;
-            } else {
-                res = 0;
-            }
-            lastbuf[i] = '\0';
-            break;
-        case OP_NUM:
-            i = 0;
-            s = pos = skip_white(pos);
-            if (isdigit(*s)) {
-                lastbuf[i++] = *s++;
-                while (isdigit(*s))
-                    lastbuf[i++] = *s++;
-                pos = s;
-                res = 1;
-            } else {
-                res = 0;
-            }
-            lastbuf[i] = '\0';
-            break;
-        case OP_SR:
-            i = 0;
-            s = pos = skip_white(pos);
-            if (*s == '\'') {
-                lastbuf[i++] = *s++;
-                while (*s!='\'' && *s!='\0' && *s!='\n')
-                    lastbuf[i++] = *s++;
-            }
-            if (*s == '\'') {
-                lastbuf[i++] = *s++;
-                pos = s;
-                res = 1;
-            } else {
-                res = 0;
-            }
-            lastbuf[i] = '\0';
-            break;
-        case OP_CLL:
-            ++top_frame;
-            frames[top_frame].ret_addr = (ip-instructions)+1;
-            frames[top_frame].lab1 = -1;
-            frames[top_frame].lab2 = -1;
-            ip = &instructions[ip->arg.loc];
-            continue;
-        case OP_R:
-            if (top_frame == 0)
-                return;
-            ip = &instructions[frames[top_frame].ret_addr];
-            --top_frame;
-            continue;
-        case OP_SET:
-            res = 1;
-            break;
-        case OP_B:
-            ip = &instructions[ip->arg.loc];
+    With -c the input is only checked: the output instructions are taken
+    out of the program (see meta_strip()) and nothing is written but, upon
+    a syntax error, its line and offset. The exit status is then META_OK
+    if the input is accepted and META_SYNTAX_ERROR if not.
+
+    With --profile the # of times each instruction is executed and each
+    branch taken are added to a profile file; --layout writes the code laid
+    out by such a profile (see meta_layout()) as assembly text, hot rules
+    together and hot paths falling through, for this machine to run.
+    --lines adds the counts of a profile up by the source line each
+    instruction came from, for code with marks (see asm.c), such as a
+    grammar compiled with META_II_MAP.m2a; given the grammar it shows the
+    lines too.
+
+    --stats reports where the time goes (see stats.h); --stats=json does so
+    in JSON.
+
+    -I, -T, -O and -D limit the # of instructions executed, the run time in
+    milliseconds, the # of output bytes and the rule nesting depth (see
+    MetaLimits). A run stopped by a limit exits with the status META_*_LIMIT
+    or META_TOO_DEEP.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "meta.h"
+#include "batch.h"
+#include "stats.h"
+
+char *prog_name;
+
+/* run the program over each input; return the first failure */
+static int run_batch(MetaProg *prog, char **paths, int n, char *suffix, int depth, int mode,
+                     int events, int rule, char *sep, int nthreads)
+{
+    int status, st, line_counter, len;
+    char *path;
+    Batch *b;
+    BatchIn *in;
+    MetaOut out;
+
+    status = META_OK;
+    path = NULL;
+    stats_phase(PH_INPUT);
+    b = batch_open(paths, n, depth, mode);
+    while ((in=batch_next(b)) != NULL) {
+        if (in->err != 0) {
+            fprintf(stderr, "%s: cannot read input file `%s'\n", prog_name, in->path);
+            if (status == META_OK)
+                status = EXIT_FAILURE;
             continue;
-        case OP_BT:
-            if (res) {
-                ip = &instructions[ip->arg.loc];
-                continue;
-            }
-            break;
-        case OP_BF:
-            if (!res) {
-                ip = &instructions[ip->arg.loc];
-                continue;
-            }
-            break;
-        case OP_BE:
-            if (!res) {
-                printf("%s: %s:%d: syntax error\n", prog_name, file_path, line_counter);
-                return;
+        }
+        stats_add(ST_BYTES_IN, (unsigned long long)in->len);
+        meta_out_init(&out, NULL);
+        out.events = events;
+        stats_phase(PH_EXEC);
+        if (rule != -1)
+            st = meta_execute_parallel(prog, in->buf, &out, &line_counter, rule, sep, nthreads);
+        else
+            st = meta_execute(prog, in->buf, &out, &line_counter);
+        stats_phase(PH_OUTPUT);
+        if (st == META_SYNTAX_ERROR) {
+            if (!events) {
+                len = snprintf(NULL, 0, "%s: %s:%d: syntax error\n", prog_name, in->path, line_counter);
+                out.buf = realloc(out.buf, out.pos+len+1);
+                sprintf(out.buf+out.pos, "%s: %s:%d: syntax error\n", prog_name, in->path, line_counter);
+                out.pos += len;
             }
-            break;
-        case OP_CL:
-            if (indent)
-                printf("\t");
-            printf("%s", ip->arg.str);
-            indent = 0;
-            break;
-        case OP_CI:
-            if (indent)
-                printf("\t");
-            printf("%s", lastbuf);
-            indent = 0;
-            break;
-        case OP_GN1:
-            if (indent)
-                printf("\t");
-            if (frames[top_frame].lab1 == -1)
-                frames[top_frame].lab1 = labcnt++;
-            printf("L%d", frames[top_frame].lab1);
-            indent = 0;
-            break;
-        case OP_GN2:
-            if (indent)
-                printf("\t");
-            if (frames[top_frame].lab2 == -1)
-                frames[top_frame].lab2 = labcnt++;
-            printf("L%d", frames[top_frame].lab2);
-            indent = 0;
-            break;
-        case OP_LB:
-            indent = 0;
-            break;
-        case OP_OUT:
-            printf("\n");
-            indent = 1;
-            break;
-        case OP_END:
-        case OP_ADR:
-        default:
-            assert(0);
+        } else if (st != META_OK) {
+            fprintf(stderr, "%s: %s:%d: %s\n", prog_name, in->path, line_counter, meta_strerror(st));
+            if (status == META_OK)
+                status = st;
         }
-        ++ip;
+        path = realloc(path, strlen(in->path)+strlen(suffix)+1);
+        sprintf(path, "%s%s", in->path, suffix);
+        stats_add(ST_BYTES_OUT, (unsigned long long)out.pos);
+        batch_write(b, path, out.buf, out.pos);
+        stats_phase(PH_INPUT);
     }
+    stats_phase(PH_OUTPUT);
+    if (batch_close(b)>0 && status==META_OK)
+        status = EXIT_FAILURE;
+    free(path);
+    return status;
 }
 
 int main(int argc, char *argv[])
 {
     char *inbuf;
+    char *file_path;
     unsigned len;
     FILE *fp;
+    MetaProg prog;
+    MetaOut out;
+    int status, line_counter, offset, events, async, check;
+    int nthreads, rule, piece, inline_size, depth, mode, written;
+    char *rule_name, *sep, *bin_path, *suffix, *compiler, *cache_dir, *prof_path, *layout_path, *lines_path;
+    MetaLimits limits;
 
     prog_name = argv[0];
-    if (argc < 3) {
-        fprintf(stderr, "usage: %s <code> <input>\n", prog_name);
+    events = async = check = 0;
+    nthreads = 1;
+    rule_name = "ST";
+    sep = ".,";
+    bin_path = suffix = prof_path = layout_path = lines_path = NULL;
+    compiler = "META_II.m2a";
+    cache_dir = meta_cache_dir();
+    depth = 32;
+    mode = BATCH_URING;
+    piece = inline_size = 0;
+    memset(&limits, 0, sizeof(limits));
+    for (; argc>1 && argv[1][0]=='-'; --argc, ++argv) {
+        if (strcmp(argv[1], "-b") == 0) {
+            events = 1;
+        } else if (strcmp(argv[1], "-a") == 0) {
+            async = 1;
+        } else if (strcmp(argv[1], "-c") == 0) {
+            check = 1;
+        } else if (strcmp(argv[1], "-p")==0 && argc>2) {
+            piece = atoi(argv[2]);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-i")==0 && argc>2) {
+            inline_size = atoi(argv[2]);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-o")==0 && argc>2) {
+            suffix = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-q")==0 && argc>2) {
+            depth = atoi(argv[2]);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-P") == 0) {
+            mode = BATCH_THREADS;
+        } else if (strcmp(argv[1], "--profile")==0 && argc>2) {
+            prof_path = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "--layout")==0 && argc>2) {
+            layout_path = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "--lines")==0 && argc>2) {
+            lines_path = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-w")==0 && argc>2) {
+            bin_path = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-C")==0 && argc>2) {
+            compiler = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-K")==0 && argc>2) {
+            cache_dir = argv[2][0]!='\0' ? argv[2] : NULL;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-A")==0 && argc>2) {
+            asm_threads(atoi(argv[2]));
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-j")==0 && argc>2) {
+            nthreads = atoi(argv[2]);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-r")==0 && argc>2) {
+            rule_name = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-s")==0 && argc>2) {
+            sep = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-I")==0 && argc>2) {
+            limits.steps = strtoull(argv[2], NULL, 10);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-T")==0 && argc>2) {
+            limits.msecs = atol(argv[2]);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-O")==0 && argc>2) {
+            limits.output = atoll(argv[2]);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-D")==0 && argc>2) {
+            limits.depth = atoi(argv[2]);
+            --argc, ++argv;
+        } else if (!stats_option(argv[1])) {
+            argc = 0;
+            break;
+        }
+    }
+    if (argc<3 && !((bin_path!=NULL || layout_path!=NULL || lines_path!=NULL) && argc==2)
+    || lines_path!=NULL && argc>3
+    || check && (events || piece>0 || nthreads>1 || suffix!=NULL || bin_path!=NULL || argc!=3)
+    || prof_path!=NULL && (check || piece>0 || nthreads>1 || inline_size>0)) {
+        fprintf(stderr, "usage: %s [ -a ] [ -b ] [ -i <size> ] [ -p <size> | -j <threads> [ -r <rule> ] [ -s <separator> ] ]\n"
+                        "           [ -I <instructions> ] [ -T <msecs> ] [ -O <bytes> ] [ -D <depth> ]\n"
+                        "           [ -C <compiler code> ] [ -K <cache dir> ] [ --stats[=json] ] <code> <input>\n"
+                        "       %s [ options ] -o <suffix> [ -q <files> ] [ -P ] <code> <input>...\n"
+                        "       %s -c [ -i <size> ] [ limits ] [ -C <compiler code> ] [ -K <cache dir> ] [ --stats[=json] ] <code> <input>\n"
+                        "       %s [ -A <threads> ] -w <binary> <code>\n"
+                        "       %s --layout <profile> <code>\n"
+                        "       %s --lines <profile> <code> [ <source> ]\n",
+                prog_name, prog_name, prog_name, prog_name, prog_name, prog_name);
         exit(EXIT_SUCCESS);
     }
     file_path = argv[1];
-    if ((instructions=read_program(file_path, opcode_table, &instr_counter)) == NULL)
+    if (layout_path != NULL)
+        exit(meta_layout(file_path, layout_path, stdout)?EXIT_SUCCESS:EXIT_FAILURE);
+    if (lines_path != NULL)
+        exit(meta_lines(file_path, lines_path, argc>2?argv[2]:NULL, stdout)?EXIT_SUCCESS:EXIT_FAILURE);
+    stats_start(PH_LOAD);
+    if (!meta_open(&prog, file_path, compiler, cache_dir))
         exit(EXIT_FAILURE);
-    if (instructions[0].opcode != OP_ADR) {
-        fprintf(stderr, "%s: code file `%s' does not begin with ADR instruction\n",
-        prog_name, file_path);
+    prog.limits = limits;
+    if (bin_path != NULL) {
+        stats_phase(PH_OUTPUT);
+        status = meta_save(&prog, bin_path);
+        meta_free(&prog);
+        stats_report();
+        exit(status?EXIT_SUCCESS:EXIT_FAILURE);
+    }
+    rule = -1;
+    if (nthreads>1 && (rule=meta_rule(&prog, rule_name))==-1) {
+        fprintf(stderr, "%s: code file `%s' has no rule `%s'\n", prog_name, file_path, rule_name);
         exit(EXIT_FAILURE);
     }
-
-#if 0
-    {
-        int i;
-        for (i = 0; i < instr_counter; i++) {
-            IRec *ir;
-
-            ir = &instructions[i];
-            printf("(%d) ", i);
-            print_instr(ir);
+    if (inline_size > 0) {
+        if (!meta_inline(&prog, inline_size, rule)) {
+            fprintf(stderr, "%s: code file `%s' too large to inline\n", prog_name, file_path);
+            exit(EXIT_FAILURE);
         }
+        if (rule != -1)
+            rule = meta_rule(&prog, rule_name);
+    }
+    if (check)
+        meta_strip(&prog);
+    if (prof_path != NULL)
+        meta_profile(&prog);    /* by the addresses of the code file: ALTs and all */
+    else
+        meta_drop_alts(&prog);
+    if (suffix != NULL) {
+        status = run_batch(&prog, argv+2, argc-2, suffix, depth, mode, events, rule, sep, nthreads);
+        if (prof_path!=NULL && !meta_profile_save(&prog, prof_path) && status==META_OK)
+            status = EXIT_FAILURE;
+        meta_free(&prog);
+        stats_report();
+        return status;
     }
-#endif
 
+    stats_phase(PH_INPUT);
     file_path = argv[2];
     if ((fp=fopen(file_path, "rb")) == NULL)
         fprintf(stderr, "%s: cannot read input file `%s'\n", prog_name, file_path);
+    meta_out_init(&out, stdout);
+    out.events = events;
+    if (async)
+        out.w = writer_open(fileno(stdout));
+    if (piece > 0) {
+        MetaParser *p;
+
+        inbuf = malloc(piece);
+        p = meta_parser_new(&prog, &out);
+        while ((len=(unsigned)fread(inbuf, 1, piece, fp)) > 0) {
+            stats_add(ST_BYTES_IN, len);
+            stats_phase(PH_EXEC);
+            status = meta_feed(p, inbuf, (int)len);
+            stats_phase(PH_INPUT);
+            if (status != META_MORE)
+                break;
+        }
+        stats_phase(PH_EXEC);
+        status = meta_finish(p, &line_counter);
+        meta_parser_free(p);
+        fclose(fp);
+        goto done;
+    }
     fseek(fp, 0, SEEK_END);
     len = ftell(fp);
     rewind(fp);
@@ -269,8 +307,39 @@ int main(int argc, char *argv[])
     len = fread(inbuf, 1, len, fp);
     inbuf[len] = '\0';
     fclose(fp);
-    execute(inbuf);
+    stats_add(ST_BYTES_IN, len);
+
+    stats_phase(PH_EXEC);
+    if (check)
+        status = meta_check(&prog, inbuf, &line_counter, &offset);
+    else if (rule != -1)
+        status = meta_execute_parallel(&prog, inbuf, &out, &line_counter, rule, sep, nthreads);
+    else
+        status = meta_execute(&prog, inbuf, &out, &line_counter);
+done:
+    meta_flush(&out);
+    stats_phase(PH_OUTPUT);
+    written = out.w==NULL || writer_close(out.w);
+    if (status==META_SYNTAX_ERROR && check) {
+        printf("%s: %s:%d: syntax error at offset %d\n", prog_name, file_path, line_counter, offset);
+    } else if (status == META_SYNTAX_ERROR) {
+        if (!events)
+            printf("%s: %s:%d: syntax error\n", prog_name, file_path, line_counter);
+        status = META_OK;
+    } else if (status != META_OK) {
+        fprintf(stderr, "%s: %s:%d: %s\n", prog_name, file_path, line_counter, meta_strerror(status));
+    }
+    if (!written) {
+        fprintf(stderr, "%s: cannot write output\n", prog_name);
+        if (status == META_OK)
+            status = EXIT_FAILURE;
+    }
+    if (prof_path!=NULL && !meta_profile_save(&prog, prof_path) && status==META_OK)
+        status = EXIT_FAILURE;
     free(inbuf);
+    free(out.buf);
+    meta_free(&prog);
+    stats_report();
 
-    return 0;
+    return status;
 }
@@ -3,340 +3,181 @@
     Load and execute a compiled META II program.
 
     This version implements backtracking as explained at the end of Schorre's
-    paper ("Backup vs. No Backup").
+    paper ("Backup vs. No Backup"); see meta_bt_new().
 
-    Backtracking is done with rule granularity. That is, when a syntax error
-    occurs the whole current rule fails and returns.
-*/
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdarg.h>
-#include <assert.h>
-#include <ctype.h>
-#include "asm.h"
+    Backtracking is done with alternative granularity. ALT, emitted before
+    each alternative, saves the state; when a syntax error occurs the state
+    is restored and the next alternative of the same choice is tried, or the
+    choice fails if it was the last one. An error outside of any alternative
+    still makes the whole current rule fail and return.
 
-#define MAXFRAMES   64  /* max # of stacked frames (CLL) at one given time */
+    Incremental mode (-e): the result of every rule invocation is kept in a
+    table indexed by input offset, together with the number of input chars
+    the rule examined. After an edit only the entries whose examined range
+    overlaps the edit are discarded; the rest are shifted and replayed by CLL
+    instead of re-executing the rule. The output is that of the last run.
 
-enum {
-    OP_TST, OP_ID, OP_NUM,
-    OP_SR, OP_CLL, OP_R,
-    OP_SET, OP_B, OP_BT,
-    OP_BF, OP_BE, OP_CL,
-    OP_CI, OP_GN1, OP_GN2,
-    OP_LB, OP_OUT, OP_ADR,
-    OP_END,
-};
+    Outside of incremental mode, output that can't be taken back any more
+    is written out as it accumulates; with -a that's done by a separate
+    thread (see writer.h).
 
-static IDescr opcode_table[] = {
-    { "TST", OP_TST, ARG_STR  },
-    { "ID",  OP_ID,  ARG_NONE },
-    { "NUM", OP_NUM, ARG_NONE },
-    { "SR",  OP_SR,  ARG_NONE },
-    { "CLL", OP_CLL, ARG_ID   },
-    { "R",   OP_R,   ARG_NONE },
-    { "SET", OP_SET, ARG_NONE },
-    { "B",   OP_B,   ARG_ID   },
-    { "BT",  OP_BT,  ARG_ID   },
-    { "BF",  OP_BF,  ARG_ID   },
-    { "BE",  OP_BE,  ARG_NONE },
-    { "CL",  OP_CL,  ARG_STR  },
-    { "CI",  OP_CI,  ARG_NONE },
-    { "GN1", OP_GN1, ARG_NONE },
-    { "GN2", OP_GN2, ARG_NONE },
-    { "LB",  OP_LB,  ARG_NONE },
-    { "OUT", OP_OUT, ARG_NONE },
-    { "ADR", OP_ADR, ARG_ID   },
-    { "END", OP_END, ARG_NONE },
-    { NULL,  0,      0        },
-};
+    Token cache (-l): what the scanners find at an input offset is kept, so
+    that going back over the input doesn't scan it again; -L fills the cache
+    for the whole input before the first run instead of as the runs go.
+    Scanning is cheap next to the rest of a backtracking step, so this only
+    pays when long tokens or runs of white space get scanned again and
+    again; --stats tells how many chars the cache saved.
 
-char *prog_name;
-static char *file_path;
-static IRec *instructions;
-static int instr_counter;
-static int line_counter = 1;
+    Trace mode (-t): every rule failure is recorded in a trace file (see
+    trace.h) for meta_trace to tell where the backtracking time goes.
 
-static struct {
-    char *buf;
-    int pos, siz;
-} output_buffer;
+    Checkpoints (-k): every -n seconds (60 by default) the state of the run
+    is saved to a file, at the first point after that where no pending
+    alternative can take the run back. After a crash the run picks up
+    from there with --resume, given the same code, input and checkpoint
+    file and the output appended to what was written (>>); the output is
+    cut back to where it stood at the checkpoint. The file is removed when
+    the run is done. Not with -e or -a.
 
-static void outbuf_write(char *s)
-{
-    int n;
+    Check mode (-c): as for meta_machine, the input is only checked, with
+    a program that has no output instructions and frames and choices that
+    don't save any output state. Not with -e or -k.
 
-    n = strlen(s);
-    if (output_buffer.pos+n > output_buffer.siz) {
-        output_buffer.siz = output_buffer.siz*2+n;
-        output_buffer.buf = realloc(output_buffer.buf, output_buffer.siz);
-        assert(output_buffer.buf != NULL);
-    }
-    memcpy(output_buffer.buf+output_buffer.pos, s, n);
-    output_buffer.pos += n;
-}
+    Alternatives run ahead (-j <threads> -r <rule>...): when a rule given
+    with -r is entered, the alternatives of its body after the first are
+    started on other threads while this one tries the first; a later one
+    whose turn comes in the state it was started from, as when the ones
+    before it failed by backtracking, isn't run again but taken over. This
+    pays for rules whose alternatives fail only after a lot of work. The
+    output is the same. Not with -e, -c, -t or -k.
 
-static void outbuf_flush(void)
-{
-    if (output_buffer.pos == 0)
-        return;
-    fwrite(output_buffer.buf, 1, output_buffer.pos, stdout);
-    output_buffer.pos = 0;
-}
+    --stats[=json] reports where the time goes as for meta_machine.
 
-static void outbuf_set_pos(int pos)
-{
-    assert(pos>=0 && pos<=output_buffer.siz);
-    output_buffer.pos = pos;
-}
-
-static char *skip_white(char *s)
-{
-    while (*s!='\0' && isspace(*s)) {
-        if (*s == '\n')
-            ++line_counter;
-        ++s;
-    }
-    return s;
-}
+    The code may be a META II grammar (.m2), compiled and cached as for
+    meta_machine with -C and -K.
 
-static void execute(char *pos)
-{
-    int i, res;
-    IRec *ip, *lim;
-    char *s, *t;
-    char lastbuf[256], labbuf[32];
-    int labcnt;
-    int indent;
-    struct {
-        int lab1, lab2;
-        int ret_addr;
-        /* state upon entry to subroutine */
-        char *in_pos;
-        int out_pos;
-        char lastbuf[256];
-        int line_counter, labcnt, indent;
-    } frames[MAXFRAMES];
-    int top_frame;
-
-#define SAVE_STATE()                                    \
-    do {                                                \
-        frames[top_frame].in_pos = pos;                 \
-        frames[top_frame].out_pos = output_buffer.pos;  \
-        strcpy(frames[top_frame].lastbuf, lastbuf);     \
-        frames[top_frame].line_counter = line_counter;  \
-        frames[top_frame].labcnt = labcnt;              \
-        frames[top_frame].indent = indent;              \
-    } while (0)
-#define RESTORE_STATE()                                 \
-    do {                                                \
-        pos = frames[top_frame].in_pos;                 \
-        outbuf_set_pos(frames[top_frame].out_pos);      \
-        strcpy(lastbuf, frames[top_frame].lastbuf);     \
-        line_counter = frames[top_frame].line_counter;  \
-        labcnt = frames[top_frame].labcnt;              \
-        indent = frames[top_frame].indent;              \
-    } while (0)
-
-    ip = &instructions[instructions[0].arg.loc];
-    lim = &instructions[instr_counter];
-    labcnt = 1;
-    indent = 1;
+    -I, -T, -O and -D limit each run as for meta_machine; with -e, the output
+    limit applies to each run's output.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "meta.h"
+#include "stats.h"
 
-    res = 1;
-    top_frame = 0;
-    frames[top_frame].lab1 = -1;
-    frames[top_frame].lab2 = -1;
+char *prog_name;
 
-    while (ip < lim) {
-        switch (ip->opcode) {
-        case OP_TST:
-            i = 0;
-            pos = skip_white(pos);
-            for (s=pos, t=ip->arg.str; *t!='\0' && *s==*t; s++, t++)
-                lastbuf[i++] = *t;
-            if (*t == '\0') {
-                pos = s;
-                res = 1;
-            } else {
-                res = 0;
-            }
-            lastbuf[i] = '\0';
-            break;
-        case OP_ID:
-            i = 0;
-            s = pos = skip_white(pos);
-            if (isalpha(*s)) {
-                lastbuf[i++] = *s++;
-                while (isalnum(*s))
-                    lastbuf[i++] = *s++;
-                pos = s;
-                res = 1;
-            } else {
-                res = 0;
-            }
-            lastbuf[i] = '\0';
-            break;
-        case OP_NUM:
-            i = 0;
-            s = pos = skip_white(pos);
-            if (isdigit(*s)) {
-                lastbuf[i++] = *s++;
-                while (isdigit(*s))
-                    lastbuf[i++] = *s++;
-                pos = s;
-                res = 1;
-            } else {
-                res = 0;
-            }
-            lastbuf[i] = '\0';
-            break;
-        case OP_SR:
-            i = 0;
-            s = pos = skip_white(pos);
-            if (*s == '\'') {
-                lastbuf[i++] = *s++;
-                while (*s!='\'' && *s!='\0' && *s!='\n')
-                    lastbuf[i++] = *s++;
-            }
-            if (*s == '\'') {
-                lastbuf[i++] = *s++;
-                pos = s;
-                res = 1;
-            } else {
-                res = 0;
-            }
-            lastbuf[i] = '\0';
-            break;
-        case OP_CLL:
-            ++top_frame;
-            frames[top_frame].ret_addr = (ip-instructions)+1;
-            frames[top_frame].lab1 = -1;
-            frames[top_frame].lab2 = -1;
-            SAVE_STATE();
-            ip = &instructions[ip->arg.loc];
-            continue;
-        case OP_R:
-            if (top_frame == 0)
-                goto done;
-            ip = &instructions[frames[top_frame].ret_addr];
-            --top_frame;
-            continue;
-        case OP_SET:
-            res = 1;
-            break;
-        case OP_B:
-            ip = &instructions[ip->arg.loc];
-            continue;
-        case OP_BT:
-            if (res) {
-                ip = &instructions[ip->arg.loc];
-                continue;
-            }
-            break;
-        case OP_BF:
-            if (!res) {
-                ip = &instructions[ip->arg.loc];
-                continue;
-            }
-            break;
-        case OP_BE:
-            if (!res) {
-                if (top_frame == 0) {
-                    outbuf_flush();
-                    printf("%s: %s:%d: syntax error\n", prog_name, file_path, line_counter);
-                    goto done;
-                }
-                RESTORE_STATE();
-                ip = &instructions[frames[top_frame].ret_addr];
-                --top_frame;
-                res = 0;
-                continue;
-            }
-            break;
-        case OP_CL:
-            if (indent)
-                outbuf_write("\t");
-            outbuf_write(ip->arg.str);
-            indent = 0;
-            break;
-        case OP_CI:
-            if (indent)
-                outbuf_write("\t");
-            outbuf_write(lastbuf);
-            indent = 0;
-            break;
-        case OP_GN1:
-            if (indent)
-                outbuf_write("\t");
-            if (frames[top_frame].lab1 == -1)
-                frames[top_frame].lab1 = labcnt++;
-            sprintf(labbuf, "L%d", frames[top_frame].lab1);
-            outbuf_write(labbuf);
-            indent = 0;
-            break;
-        case OP_GN2:
-            if (indent)
-                outbuf_write("\t");
-            if (frames[top_frame].lab2 == -1)
-                frames[top_frame].lab2 = labcnt++;
-            sprintf(labbuf, "L%d", frames[top_frame].lab2);
-            outbuf_write(labbuf);
-            indent = 0;
-            break;
-        case OP_LB:
-            indent = 0;
-            break;
-        case OP_OUT:
-            outbuf_write("\n");
-            indent = 1;
-            break;
-        case OP_END:
-        case OP_ADR:
-        default:
-            assert(0);
-        }
-        ++ip;
+/*
+    Edit script: a sequence of
+        <offset> <# of chars to delete> <# of chars to insert>\n<chars to insert>
+*/
+static int read_edit(FILE *fp, int *off, int *del, char **ins, int *nins)
+{
+    if (fscanf(fp, " %d %d %d", off, del, nins) != 3)
+        return 0;
+    if (fgetc(fp) != '\n')
+        return 0;
+    *ins = malloc(*nins+1);
+    if (fread(*ins, 1, *nins, fp) != (size_t)*nins) {
+        free(*ins);
+        return 0;
     }
-done:
-    outbuf_flush();
-#undef SAVE_STATE
-#undef RESTORE_STATE
+    return 1;
 }
 
 int main(int argc, char *argv[])
 {
     char *inbuf;
+    char *file_path, *edit_path, *trace_path, *compiler, *cache_dir, *ckpt_path;
     unsigned len;
     FILE *fp;
+    MetaProg prog;
+    MetaOut out;
+    MetaBt *bt;
+    int status, line_counter, offset, async, lex, resume, check;
+    int i, rule, nthreads, nrules, written;
+    char **rule_names;
+    long ckpt_secs;
+    MetaLimits limits;
 
     prog_name = argv[0];
-    if (argc < 3) {
-        fprintf(stderr, "usage: %s <code> <input>\n", prog_name);
+    edit_path = trace_path = ckpt_path = NULL;
+    ckpt_secs = 60;
+    resume = 0;
+    compiler = "META_II.m2a";
+    cache_dir = meta_cache_dir();
+    async = check = 0;
+    lex = -1;
+    nthreads = 1;
+    nrules = 0;
+    rule_names = malloc(sizeof(char *)*argc);
+    memset(&limits, 0, sizeof(limits));
+    for (; argc>2 && argv[1][0]=='-'; --argc, ++argv) {
+        if (strcmp(argv[1], "-a") == 0) {
+            async = 1;
+            continue;
+        }
+        if (strcmp(argv[1], "-c") == 0) {
+            check = 1;
+            continue;
+        }
+        if (strcmp(argv[1], "-l")==0 || strcmp(argv[1], "-L")==0) {
+            lex = argv[1][1] == 'L';
+            continue;
+        }
+        if (strcmp(argv[1], "--resume") == 0) {
+            resume = 1;
+            continue;
+        }
+        if (stats_option(argv[1]))
+            continue;
+        if (strcmp(argv[1], "-e") == 0)
+            edit_path = argv[2];
+        else if (strcmp(argv[1], "-t") == 0)
+            trace_path = argv[2];
+        else if (strcmp(argv[1], "-k") == 0)
+            ckpt_path = argv[2];
+        else if (strcmp(argv[1], "-j") == 0)
+            nthreads = atoi(argv[2]);
+        else if (strcmp(argv[1], "-r") == 0)
+            rule_names[nrules++] = argv[2];
+        else if (strcmp(argv[1], "-n") == 0)
+            ckpt_secs = atol(argv[2]);
+        else if (strcmp(argv[1], "-C") == 0)
+            compiler = argv[2];
+        else if (strcmp(argv[1], "-K") == 0)
+            cache_dir = argv[2][0]!='\0' ? argv[2] : NULL;
+        else if (strcmp(argv[1], "-I") == 0)
+            limits.steps = strtoull(argv[2], NULL, 10);
+        else if (strcmp(argv[1], "-T") == 0)
+            limits.msecs = atol(argv[2]);
+        else if (strcmp(argv[1], "-O") == 0)
+            limits.output = atoll(argv[2]);
+        else if (strcmp(argv[1], "-D") == 0)
+            limits.depth = atoi(argv[2]);
+        else
+            break;
+        --argc, ++argv;
+    }
+    if (argc!=3 || ckpt_path!=NULL && (edit_path!=NULL || async) || resume && ckpt_path==NULL
+    || check && (edit_path!=NULL || ckpt_path!=NULL || async)
+    || nthreads>1 && (nrules==0 || check || edit_path!=NULL || trace_path!=NULL || ckpt_path!=NULL)) {
+        fprintf(stderr, "usage: %s [ -a | -c ] [ -l | -L ] [ -e <edits> ] [ -t <trace> ] [ -k <checkpoint> [ -n <secs> ] [ --resume ] ]\n"
+                        "           [ -j <threads> -r <rule>... ] [ -I <instructions> ] [ -T <msecs> ] [ -O <bytes> ] [ -D <depth> ]\n"
+                        "           [ -C <compiler code> ] [ -K <cache dir> ] [ --stats[=json] ] <code> <input>\n",
+                prog_name);
         exit(EXIT_SUCCESS);
     }
     file_path = argv[1];
-    if ((instructions=read_program(file_path, opcode_table, &instr_counter)) == NULL)
-        exit(EXIT_FAILURE);
-    if (instructions[0].opcode != OP_ADR) {
-        fprintf(stderr, "%s: code file `%s' does not begin with ADR instruction\n",
-        prog_name, file_path);
+    stats_start(PH_LOAD);
+    if (!meta_open(&prog, file_path, compiler, cache_dir))
         exit(EXIT_FAILURE);
-    }
-
-#if 0
-    {
-        int i;
-        for (i = 0; i < instr_counter; i++) {
-            IRec *ir;
-
-            ir = &instructions[i];
-            printf("(%d) ", i);
-            print_instr(ir);
-        }
-    }
-#endif
+    prog.limits = limits;
+    if (check)
+        meta_strip(&prog);
 
+    stats_phase(PH_INPUT);
     file_path = argv[2];
     if ((fp=fopen(file_path, "rb")) == NULL)
         fprintf(stderr, "%s: cannot read input file `%s'\n", prog_name, file_path);
@@ -347,13 +188,81 @@ int main(int argc, char *argv[])
     len = fread(inbuf, 1, len, fp);
     inbuf[len] = '\0';
     fclose(fp);
+    stats_add(ST_BYTES_IN, len);
+
+    meta_out_init(&out, stdout);
+    if (async)
+        out.w = writer_open(fileno(stdout));
+    bt = meta_bt_new(&prog, &out, inbuf, (int)len, edit_path!=NULL);
+    if (trace_path!=NULL && !meta_bt_trace(bt, trace_path))
+        exit(EXIT_FAILURE);
+    for (i = 0; nthreads>1 && i<nrules; i++) {
+        if ((rule=meta_rule(&prog, rule_names[i])) == -1) {
+            fprintf(stderr, "%s: code file `%s' has no rule `%s'\n", prog_name, argv[1], rule_names[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (!meta_bt_spec(bt, rule, nthreads)) {
+            fprintf(stderr, "%s: rule `%s' has a single alternative\n", prog_name, rule_names[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (ckpt_path != NULL) {
+        meta_bt_checkpoint(bt, ckpt_path, ckpt_secs);
+        if (resume && !meta_bt_resume(bt, ckpt_path))
+            exit(EXIT_FAILURE);
+    }
+    stats_phase(PH_EXEC);
+    if (lex != -1)
+        meta_bt_lex(bt, lex);
+    if (edit_path != NULL) {
+        int off, del, nins;
+        char *ins;
 
-    output_buffer.siz = 256;
-    output_buffer.buf = malloc(output_buffer.siz);
-    output_buffer.pos = 0;
-    execute(inbuf);
+        if ((fp=fopen(edit_path, "rb")) == NULL) {
+            fprintf(stderr, "%s: cannot read edit file `%s'\n", prog_name, edit_path);
+            exit(EXIT_FAILURE);
+        }
+        status = meta_bt_run(bt, &line_counter);
+        while (read_edit(fp, &off, &del, &ins, &nins)) {
+            if (!meta_bt_edit(bt, off, del, ins, nins)) {
+                fprintf(stderr, "%s: %s: edit out of range\n", prog_name, edit_path);
+                exit(EXIT_FAILURE);
+            }
+            free(ins);
+            out.pos = 0;
+            status = meta_bt_run(bt, &line_counter);
+        }
+        fclose(fp);
+    } else if (check) {
+        status = meta_bt_check(bt, &line_counter, &offset);
+    } else {
+        status = meta_bt_run(bt, &line_counter);
+    }
+    meta_flush(&out);
+    stats_phase(PH_OUTPUT);
+    written = out.w==NULL || writer_close(out.w);
+    if (ckpt_path!=NULL && (status==META_OK || status==META_SYNTAX_ERROR))
+        unlink(ckpt_path);
+    if (!meta_bt_free(bt))
+        fprintf(stderr, "%s: cannot write trace file `%s'\n", prog_name, trace_path);
+    if (status==META_SYNTAX_ERROR && check) {
+        printf("%s: %s:%d: syntax error at offset %d\n", prog_name, file_path, line_counter, offset);
+    } else if (status == META_SYNTAX_ERROR) {
+        printf("%s: %s:%d: syntax error\n", prog_name, file_path, line_counter);
+        status = META_OK;
+    } else if (status != META_OK) {
+        fprintf(stderr, "%s: %s:%d: %s\n", prog_name, file_path, line_counter, meta_strerror(status));
+    }
+    if (!written) {
+        fprintf(stderr, "%s: cannot write output\n", prog_name);
+        if (status == META_OK)
+            status = EXIT_FAILURE;
+    }
     free(inbuf);
-    free(output_buffer.buf);
+    free(out.buf);
+    free(rule_names);
+    meta_free(&prog);
+    stats_report();
 
-    return 0;
+    return status;
 }
@@ -1,5 +1,24 @@
 /*
     VALGOL I machine.
+
+    With -a the output is written by a separate thread (see writer.h).
+
+    -I, -T, -O and -D limit the # of instructions executed, the run time in
+    milliseconds, the # of output bytes and the depth of the stack. A run
+    stopped by a limit exits with the same status as meta_machine's.
+
+    With -g the argument is VALGOL source instead of code: it's compiled by
+    running the META II machine with the given compiler code (VALGOL_I.m2a)
+    and the code it writes is assembled as it comes, then run. --stats times
+    the steps apart.
+
+    --stats[=json] reports where the time goes (see stats.h).
+
+    --sample writes a profile of the run to a file: where the program was
+    every millisecond of CPU time, added up by the VALGOL source line the
+    code came from. The marks that say which line that is are put in the
+    code by VALGOL_I.m2a (see asm.c); with -g the report shows the lines.
+    The kernel may take samples less often than asked for.
 */
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,37 +26,54 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
 #include "asm.h"
+#include "meta.h"
+#include "writer.h"
+#include "stats.h"
 
 #define STACK_MAX     64
 #define PNT_AREA_SIZ  128
+#define CHECKSTEPS    1024  /* # of instructions between time limit checks */
+#define SAMPLE_USECS  1000  /* CPU time between samples */
 
+/* exit status (see META_TOO_DEEP etc. in meta.h) */
 enum {
-    OP_LD, OP_LDL, OP_ST,
-    OP_ADD, OP_SUB, OP_MLT,
-    OP_EQU, OP_B, OP_BFP,
-    OP_BTP, OP_EDT, OP_PNT,
-    OP_HLT, OP_SP, OP_BLK,
-    OP_END,
+    EXIT_TOO_DEEP = 2,
+    EXIT_STEP_LIMIT = 4,
+    EXIT_TIME_LIMIT,
+    EXIT_OUTPUT_LIMIT,
+};
+
+enum {
+    VOP_LD, VOP_LDL, VOP_ST,
+    VOP_ADD, VOP_SUB, VOP_MLT,
+    VOP_EQU, VOP_B, VOP_BFP,
+    VOP_BTP, VOP_EDT, VOP_PNT,
+    VOP_HLT, VOP_SP, VOP_BLK,
+    VOP_END,
 };
 
 static IDescr opcode_table[] = {
-    { "LD",  OP_LD,  ARG_ID   },
-    { "LDL", OP_LDL, ARG_NUM  },
-    { "ST",  OP_ST,  ARG_ID   },
-    { "ADD", OP_ADD, ARG_NONE },
-    { "SUB", OP_SUB, ARG_NONE },
-    { "MLT", OP_MLT, ARG_NONE },
-    { "EQU", OP_EQU, ARG_NONE },
-    { "B",   OP_B,   ARG_ID   },
-    { "BFP", OP_BFP, ARG_ID   },
-    { "BTP", OP_BTP, ARG_ID   },
-    { "EDT", OP_EDT, ARG_STR  },
-    { "PNT", OP_PNT, ARG_NONE },
-    { "HLT", OP_HLT, ARG_NONE },
-    { "SP",  OP_SP,  ARG_NUM  },
-    { "BLK", OP_BLK, ARG_NBLK },
-    { "END", OP_END, ARG_NONE },
+    { "LD",  VOP_LD,  ARG_ID   },
+    { "LDL", VOP_LDL, ARG_NUM  },
+    { "ST",  VOP_ST,  ARG_ID   },
+    { "ADD", VOP_ADD, ARG_NONE },
+    { "SUB", VOP_SUB, ARG_NONE },
+    { "MLT", VOP_MLT, ARG_NONE },
+    { "EQU", VOP_EQU, ARG_NONE },
+    { "B",   VOP_B,   ARG_ID   },
+    { "BFP", VOP_BFP, ARG_ID   },
+    { "BTP", VOP_BTP, ARG_ID   },
+    { "EDT", VOP_EDT, ARG_STR  },
+    { "PNT", VOP_PNT, ARG_NONE },
+    { "HLT", VOP_HLT, ARG_NONE },
+    { "SP",  VOP_SP,  ARG_NUM  },
+    { "BLK", VOP_BLK, ARG_NBLK },
+    { "END", VOP_END, ARG_NONE },
     { NULL,  0,      0        },
 };
 
@@ -45,94 +81,318 @@ char *prog_name;
 static char *file_path;
 static IRec *instructions;
 static int instr_counter;
+static Writer *writer;
+static unsigned long long max_steps;
+static long max_msecs;
+static long long max_output;
+static int max_depth = STACK_MAX;
+static unsigned long long *samples; /* per instruction */
+static IRec *volatile lim;          /* where execute() stops; see on_tick() */
+
+static void print_line(char *s)
+{
+    int n, phase;
+
+    phase = stats_phase(PH_OUTPUT);
+    n = (int)strlen(s);
+    stats_add(ST_BYTES_OUT, (unsigned long long)n+1);
+    if (writer == NULL) {
+        printf("%s\n", s);
+    } else {
+        s[n] = '\n';
+        writer_write(writer, s, n+1);
+        s[n] = '\0';
+    }
+    stats_phase(phase);
+}
 
-static void execute(void)
+static int past(struct timespec *deadline)
 {
-    int i;
-    IRec *ip, *lim;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec>deadline->tv_sec
+        || now.tv_sec==deadline->tv_sec && now.tv_nsec>=deadline->tv_nsec;
+}
+
+/* run the program; return 0 or the EXIT_* status of the limit hit */
+static int execute(void)
+{
+    int i, status;
+    IRec *ip, *end, *dest;
     int stack[STACK_MAX], tos;
     char pntar[PNT_AREA_SIZ];
+    unsigned long long icount, check_at;
+    long long nout;
+    struct timespec deadline;
+
+    icount = 0;
+    check_at = max_msecs>0 ? CHECKSTEPS : ULLONG_MAX;
+    if (max_steps>0 && max_steps<check_at)
+        check_at = max_steps+1;
+    if (max_msecs > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += max_msecs/1000;
+        deadline.tv_nsec += max_msecs%1000*1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_nsec -= 1000000000;
+            ++deadline.tv_sec;
+        }
+    }
+    nout = 0;
+
+#define STOP(s)     do { status = (s); goto done; } while (0)
+/* checked at backward branches, where loops spin */
+#define BRANCH()                                                    \
+    do {                                                            \
+        dest = &instructions[ip->arg.loc];                          \
+        if (dest<=ip && icount>=check_at) {                         \
+            if (max_steps>0 && icount>max_steps)                    \
+                STOP(EXIT_STEP_LIMIT);                              \
+            if (max_msecs>0 && past(&deadline))                     \
+                STOP(EXIT_TIME_LIMIT);                              \
+            check_at = max_msecs>0 ? icount+CHECKSTEPS : ULLONG_MAX; \
+            if (max_steps>0 && max_steps<check_at)                  \
+                check_at = max_steps+1;                             \
+        }                                                           \
+        ip = dest;                                                  \
+    } while (0)
 
     ip = &instructions[instructions[0].arg.loc];
-    lim = &instructions[instr_counter];
+    lim = end = &instructions[instr_counter];
     tos = -1;
     for (i = 0; i < PNT_AREA_SIZ-1; i++)
         pntar[i] = ' ';
     pntar[i] = '\0';
 
+run:
     while (ip < lim) {
+        ++icount;
         switch (ip->opcode) {
-        case OP_LD:
+        case VOP_LD:
+            if (tos+1 == max_depth)
+                STOP(EXIT_TOO_DEEP);
             stack[++tos] = *(int *)&instructions[ip->arg.loc];
             break;
-        case OP_LDL:
+        case VOP_LDL:
+            if (tos+1 == max_depth)
+                STOP(EXIT_TOO_DEEP);
             stack[++tos] = ip->arg.val;
             break;
-        case OP_ST:
+        case VOP_ST:
             *(int *)&instructions[ip->arg.loc] = stack[tos--];
             break;
-        case OP_ADD:
+        case VOP_ADD:
             stack[tos-1] += stack[tos];
             --tos;
             break;
-        case OP_SUB:
+        case VOP_SUB:
             stack[tos-1] -= stack[tos];
             --tos;
             break;
-        case OP_MLT:
+        case VOP_MLT:
             stack[tos-1] *= stack[tos];
             --tos;
             break;
-        case OP_EQU:
+        case VOP_EQU:
             stack[tos-1] = stack[tos-1]==stack[tos];
             --tos;
             break;
-        case OP_B:
-            ip = &instructions[ip->arg.loc];
+        case VOP_B:
+            BRANCH();
             continue;
-        case OP_BFP:
+        case VOP_BFP:
             if (stack[tos--] == 0) {
-                ip = &instructions[ip->arg.loc];
+                BRANCH();
                 continue;
             }
             break;
-        case OP_BTP:
+        case VOP_BTP:
             if (stack[tos--] != 0) {
-                ip = &instructions[ip->arg.loc];
+                BRANCH();
                 continue;
             }
             break;
-        case OP_EDT:
+        case VOP_EDT:
             memcpy(pntar+stack[tos], ip->arg.str, strlen(ip->arg.str));
             --tos;
             break;
-        case OP_PNT:
-            printf("%s\n", pntar);
+        case VOP_PNT:
+            nout += PNT_AREA_SIZ;
+            if (max_output>0 && nout>max_output)
+                STOP(EXIT_OUTPUT_LIMIT);
+            print_line(pntar);
             for (i = 0; i < PNT_AREA_SIZ-1; i++)
                 pntar[i] = ' ';
             pntar[i] = '\0';
             break;
-        case OP_HLT:
-            return;
-        case OP_SP:
-        case OP_BLK:
-        case OP_END:
+        case VOP_HLT:
+            STOP(0);
+        case VOP_SP:
+        case VOP_BLK:
+        case VOP_END:
         default:
             assert(0);
         }
         ++ip;
     }
+    if (ip < end) {     /* stopped to take a sample */
+        ++samples[ip-instructions];
+        lim = end;
+        goto run;
+    }
+    status = 0;
+done:
+    stats_add(ST_STEPS, icount);
+    return status;
+#undef STOP
+#undef BRANCH
+}
+
+static void put_code(void *arg, char *s, int n)
+{
+    asm_feed(arg, s, n);
+}
+
+/*
+    Take a sample: stop execute() before the next instruction, which it
+    then counts. Moving its end costs it nothing as it checks for the end
+    before every instruction anyway.
+*/
+static void on_tick(int sig)
+{
+    (void)sig;
+    lim = instructions;
+}
+
+/* start or, with on 0, stop taking samples */
+static void sample_timer(int on)
+{
+    struct sigaction sa;
+    struct itimerval it;
+
+    if (on) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_tick;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, NULL);
+    }
+    memset(&it, 0, sizeof(it));
+    it.it_interval.tv_usec = on ? SAMPLE_USECS : 0;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+}
+
+/*
+    Compile the VALGOL source at file_path with the compiler code at
+    grammar; the source is left in *srcp and, if map is not NULL, the
+    position of each instruction in it in *map.
+*/
+static IRec *compile(char *grammar, int *instr_counter, char **srcp, SrcPos **map)
+{
+    int status, line_counter;
+    long len;
+    char *src;
+    FILE *fp;
+    MetaProg prog;
+    MetaOut out;
+    Asm *a;
+    IRec *code;
+
+    if (!meta_load(&prog, grammar))
+        return NULL;
+    meta_drop_alts(&prog);
+    stats_phase(PH_INPUT);
+    if ((fp=fopen(file_path, "rb")) == NULL) {
+        fprintf(stderr, "%s: cannot read input file `%s'\n", prog_name, file_path);
+        meta_free(&prog);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    src = malloc(len+1);
+    len = (long)fread(src, 1, len, fp);
+    src[len] = '\0';
+    fclose(fp);
+    stats_add(ST_BYTES_IN, (unsigned long long)len);
+
+    stats_phase(PH_COMPILE);
+    a = asm_open(file_path, opcode_table);
+    meta_out_init(&out, NULL);
+    out.put = put_code;
+    out.arg = a;
+    status = meta_execute(&prog, src, &out, &line_counter);
+    meta_flush(&out);
+    if (status != META_OK) {
+        fprintf(stderr, "%s: %s:%d: %s\n", prog_name, file_path, line_counter,
+                status==META_SYNTAX_ERROR?"syntax error":meta_strerror(status));
+        asm_free(a);
+        code = NULL;
+    } else {
+        code = asm_close(a, instr_counter, NULL, NULL, map);
+    }
+    free(out.buf);
+    *srcp = src;
+    meta_free(&prog);
+    return code;
 }
 
 int main(int argc, char *argv[])
 {
+    int async, status;
+    char *grammar, *sample_path, *src;
+    SrcPos *map;
+    FILE *fp;
+
     prog_name = argv[0];
+    async = 0;
+    grammar = sample_path = src = NULL;
+    map = NULL;
+    for (; argc>1 && argv[1][0]=='-'; --argc, ++argv) {
+        if (strcmp(argv[1], "-a") == 0) {
+            async = 1;
+        } else if (strcmp(argv[1], "-g")==0 && argc>2) {
+            grammar = argv[2];
+            --argc, ++argv;
+        } else if (stats_option(argv[1])) {
+            ;
+        } else if (strcmp(argv[1], "--sample")==0 && argc>2) {
+            sample_path = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-I")==0 && argc>2) {
+            max_steps = strtoull(argv[2], NULL, 10);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-T")==0 && argc>2) {
+            max_msecs = atol(argv[2]);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-O")==0 && argc>2) {
+            max_output = atoll(argv[2]);
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-D")==0 && argc>2) {
+            max_depth = atoi(argv[2]);
+            if (max_depth<=0 || max_depth>STACK_MAX)
+                max_depth = STACK_MAX;
+            --argc, ++argv;
+        } else {
+            argc = 0;
+            break;
+        }
+    }
     if (argc < 2) {
-        fprintf(stderr, "usage: %s <code>\n", prog_name);
+        fprintf(stderr, "usage: %s [ -a ] [ -I <instructions> ] [ -T <msecs> ] [ -O <bytes> ] [ -D <depth> ]\n"
+                        "           [ --stats[=json] ] [ --sample <report> ] <code> | -g <compiler code> <source>\n", prog_name);
         exit(EXIT_SUCCESS);
     }
     file_path = argv[1];
-    if ((instructions=read_program(file_path, opcode_table, &instr_counter)) == NULL)
+    stats_start(PH_LOAD);
+    if (grammar != NULL)
+        instructions = compile(grammar, &instr_counter, &src, sample_path!=NULL?&map:NULL);
+    else
+        instructions = read_program_symbols(file_path, opcode_table, &instr_counter, NULL, NULL,
+                                            sample_path!=NULL?&map:NULL);
+    if (instructions == NULL)
         exit(EXIT_FAILURE);
 
 #if 0
@@ -151,7 +411,45 @@ int main(int argc, char *argv[])
     }
 #endif
 
-    execute();
+    if (async)
+        writer = writer_open(fileno(stdout));
+    if (sample_path != NULL) {
+        samples = calloc(instr_counter?instr_counter:1, sizeof(samples[0]));
+        sample_timer(1);
+    }
+    stats_phase(PH_EXEC);
+    status = execute();
+    stats_phase(PH_OUTPUT);
+    if (sample_path != NULL) {
+        sample_timer(0);
+        if ((fp=fopen(sample_path, "w")) == NULL) {
+            fprintf(stderr, "%s: cannot write report `%s'\n", prog_name, sample_path);
+        } else {
+            if (map == NULL)
+                fprintf(stderr, "%s: %s: code has no marks: counting by address\n", prog_name, file_path);
+            print_by_line(fp, map, instr_counter, samples, "samples", src);
+            fclose(fp);
+        }
+    }
+    if (writer!=NULL && !writer_close(writer)) {
+        fprintf(stderr, "%s: cannot write output\n", prog_name);
+        if (status == EXIT_SUCCESS)
+            status = EXIT_FAILURE;
+    } else if (writer == NULL) {
+        fflush(stdout);
+    }
+    if (status == EXIT_TOO_DEEP)
+        fprintf(stderr, "%s: %s: stack overflow\n", prog_name, file_path);
+    else if (status == EXIT_STEP_LIMIT)
+        fprintf(stderr, "%s: %s: instruction limit reached\n", prog_name, file_path);
+    else if (status == EXIT_TIME_LIMIT)
+        fprintf(stderr, "%s: %s: time limit reached\n", prog_name, file_path);
+    else if (status == EXIT_OUTPUT_LIMIT)
+        fprintf(stderr, "%s: %s: output limit reached\n", prog_name, file_path);
+    stats_report();
+    free(samples);
+    free(map);
+    free(src);
 
-    return 0;
+    return status;
 }
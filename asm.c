@@ -1,3 +1,23 @@
+/*
+    The assembler. A code file is mapped into memory and cut at line ends
+    into parts, which are assembled by as many threads: each part gets its
+    own instructions, labels and references to labels, with line #'s
+    counted from the start of the part. The labels are then put in one
+    table, split by hash so that each thread fills a slice of it going
+    over the labels in order, and a label met again is redefined; and
+    every part resolves its references against the table, again on its
+    own thread. Of all the errors found the one with the lowest line # is
+    reported, which is the one a single pass over the file stops at.
+
+    asm_feed() assembles a program as it comes, a line at a time, in one
+    part that reports a redefined label as soon as it sees it.
+
+    A mark line, `#<line>[:<column>]' with or without blanks in front,
+    makes no code: it says where in the source the code that follows came
+    from. If a program has marks each part keeps the position of each of
+    its instructions, and the ones before the first mark of a part get the
+    last mark of the part before.
+*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,271 +25,851 @@
 #include <assert.h>
 #include <ctype.h>
 #include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "asm.h"
 
-#define LINEBUFSIZ  1024
-#define LABTABSIZ   511
+#define MINPART     (1<<18) /* don't cut a file in parts smaller than this */
+#define MAXPARTS    64
 
-typedef struct LabSym LabSym;
-typedef struct FixUp FixUp;
+typedef struct Label Label;
+typedef struct Ref Ref;
+typedef struct LabTab LabTab;
+typedef struct Link Link;
+typedef struct Part Part;
 
-static struct LabSym {
-    char *id;
+struct Label {
+    char *id;               /* not '\0' terminated */
+    int len;
+    unsigned h;
     int val;
-    LabSym *next;
-} *label_table[LABTABSIZ];
+    int line;
+};
 
-static struct FixUp {
+/* an ID operand to resolve */
+struct Ref {
     int loc;
-    FixUp *next;
-} *fixup_list;
+    char *id;
+    int len;
+    unsigned h;
+};
+
+/* open addressing on label #'s + 1 */
+struct LabTab {
+    int *slot;
+    int siz, n;
+};
+
+/* a run of whole lines and what came out of it */
+struct Part {
+    IDescr *opcode_table;
+    char *s, *end;
+    int copy;               /* ids are in a buffer that changes: copy them */
+    int line_counter;       /* from 1 at the start of the part */
+    IRec *instructions;
+    int instr_counter, instr_max;
+    Label *labels;
+    int nlabels, max_labels;
+    LabTab *seen;           /* if not NULL, to report a redefined label right away */
+    Ref *refs;
+    int nrefs, max_refs;
+    char *msg;              /* the error that stopped it */
+    int err_line;
+    int base, line_base;    /* # of instructions and lines before it */
+    int slice;              /* the slice of the label table it fills */
+    int dup;                /* first label found in it again, or -1 */
+    int undef;              /* last ref that couldn't be resolved, or -1 */
+    SrcPos *map;            /* one per instruction once there's a mark; line -1: before it */
+    SrcPos mark;            /* the last one */
+    Link *l;
+    jmp_buf env;
+};
+
+/* the parts put together */
+struct Link {
+    Label *labels;          /* all of them, in order */
+    int nlabels;
+    LabTab tab[MAXPARTS];
+    int nslices;
+    IRec *instructions;
+};
 
 /* USER PROVIDED */
 extern char *prog_name;
-static IDescr *opcode_table;
-static char *file_path;
 /* ------------- */
 
-static int line_counter = 1;
-static IRec *instructions;
-static int instr_counter, instr_max;
-static jmp_buf env;
+/* assembler state for asm_feed(); one per program */
+struct Asm {
+    Part p;
+    LabTab seen;
+    char *file_path;
+    char *line;             /* the line being fed */
+    int len, max;
+    int failed;
+};
 
-static void err(char *fmt, ...)
+static IDescr *last_opcode_table; /* for print_instr() */
+static int nthreads;
+
+static void err(Part *p, char *fmt, ...)
 {
     va_list args;
+    int n;
 
-    fprintf(stderr, "%s: %s:%d: error: ", prog_name, file_path, line_counter);
     va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
+    n = vsnprintf(NULL, 0, fmt, args);
     va_end(args);
-    fprintf(stderr, "\n");
-    longjmp(env, 1);
+    p->msg = malloc(n+1);
+    va_start(args, fmt);
+    vsnprintf(p->msg, n+1, fmt, args);
+    va_end(args);
+    p->err_line = p->line_counter;
+    longjmp(p->env, 1);
 }
 
-static unsigned hash(char *s)
+static void report(char *file_path, int line, char *msg)
+{
+    fprintf(stderr, "%s: %s:%d: error: %s\n", prog_name, file_path, line, msg);
+}
+
+static unsigned hash(char *s, int len)
 {
     unsigned hash_val;
 
-    for (hash_val = 0; *s != '\0'; s++)
+    for (hash_val = 0; len > 0; s++, len--)
         hash_val = (unsigned)*s + 31*hash_val;
-    return hash_val;
+    hash_val ^= hash_val>>16;
+    hash_val *= 0x45d9f3b;
+    return hash_val ^ hash_val>>16;
 }
 
-static int label_value(char *s)
+static int tab_find(LabTab *t, Label *labels, char *id, int len, unsigned h)
 {
-    LabSym *np;
-    unsigned h;
+    int i, k;
 
-    h = hash(s)%LABTABSIZ;
-    for (np = label_table[h]; np != NULL; np = np->next)
-        if (strcmp(np->id, s) == 0)
-            return np->val;
+    if (t->siz == 0)
+        return -1;
+    for (i = h&(t->siz-1); (k=t->slot[i]) != 0; i = (i+1)&(t->siz-1))
+        if (labels[k-1].h==h && labels[k-1].len==len && memcmp(labels[k-1].id, id, len)==0)
+            return k-1;
     return -1;
 }
 
-static char *get_identifier(char *s, char *buf)
+static void tab_add(LabTab *t, Label *labels, int k)
+{
+    int i, j, *old, oldsiz;
+
+    if (2*(t->n+1) > t->siz) {
+        old = t->slot;
+        oldsiz = t->siz;
+        t->siz = t->siz ? t->siz*2 : 64;
+        t->slot = calloc(t->siz, sizeof(int));
+        for (j = 0; j < oldsiz; j++) {
+            if (old[j] == 0)
+                continue;
+            for (i = labels[old[j]-1].h&(t->siz-1); t->slot[i] != 0; i = (i+1)&(t->siz-1))
+                ;
+            t->slot[i] = old[j];
+        }
+        free(old);
+    }
+    for (i = labels[k].h&(t->siz-1); t->slot[i] != 0; i = (i+1)&(t->siz-1))
+        ;
+    t->slot[i] = k+1;
+    ++t->n;
+}
+
+static char *skip_blanks(char *s, char *e)
 {
-    while (isblank(*s))
+    while (s<e && isblank((unsigned char)*s))
         ++s;
-    if (!isalpha(*s))
-        return NULL;
-    *buf++ = *s++;
-    while (isalnum(*s))
-        *buf++ = *s++;
-    *buf = '\0';
     return s;
 }
 
-static char *get_string(char *s, char *buf)
+/* the ID at s goes from *id to the pointer returned */
+static char *get_identifier(char *s, char *e, char **id)
 {
-    while (isblank(*s))
+    s = skip_blanks(s, e);
+    if (s==e || !isalpha((unsigned char)*s))
+        return NULL;
+    *id = s++;
+    while (s<e && isalnum((unsigned char)*s))
         ++s;
-    if (*s!='\'' || *(s+1)=='\'')
+    return s;
+}
+
+static char *get_string(char *s, char *e, char **str)
+{
+    s = skip_blanks(s, e);
+    if (s==e || *s!='\'' || s+1<e && *(s+1)=='\'')
         return NULL;
-    ++s;
-    while (*s!='\'' && *s!='\0')
-        *buf++ = *s++;
-    if (*s != '\'')
+    *str = ++s;
+    while (s<e && *s!='\'')
+        ++s;
+    if (s == e)
         return NULL;
-    ++s;
-    *buf = '\0';
     return s;
 }
 
-static char *get_number(char *s, char *buf)
+static char *get_number(char *s, char *e, int *val)
 {
-    while (isblank(*s))
-        ++s;
-    if (!isdigit(*s))
+    long n;
+
+    s = skip_blanks(s, e);
+    if (s==e || !isdigit((unsigned char)*s))
         return NULL;
-    *buf++ = *s++;
-    while (isdigit(*s))
-        *buf++ = *s++;
-    *buf = '\0';
+    for (n = 0; s<e && isdigit((unsigned char)*s); s++)
+        if ((n=n*10+(*s-'0')) > 0x7fffffff)
+            n = 0x7fffffff;
+    *val = (int)n;
     return s;
 }
 
+static char *copy(char *s, int len)
+{
+    char *t;
+
+    t = malloc(len+1);
+    memcpy(t, s, len);
+    t[len] = '\0';
+    return t;
+}
+
 /* label = no_space ID */
-static void parse_label(char *s)
+static void parse_label(Part *p, char *s, char *e)
 {
-    LabSym *np;
-    unsigned h;
-    char buf[LINEBUFSIZ];
+    Label *lp;
+    char *id;
 
-    if ((s=get_identifier(s, buf)) == NULL)
-        err("expecting identifier on label line");
-    h = hash(buf)%LABTABSIZ;
-    for (np = label_table[h]; np != NULL; np = np->next)
-        if (strcmp(np->id, buf) == 0)
-            break;
-    if (np != NULL)
-        err("label `%s' redefined", buf);
-    np = malloc(sizeof(*np));
-    np->id = strdup(buf);
-    np->val = instr_counter;
-    np->next = label_table[h];
-    label_table[h] = np;
+    if ((s=get_identifier(s, e, &id)) == NULL)
+        err(p, "expecting identifier on label line");
+    if (p->nlabels >= p->max_labels) {
+        p->max_labels = p->max_labels?p->max_labels*2:64;
+        p->labels = realloc(p->labels, sizeof(p->labels[0])*p->max_labels);
+    }
+    lp = &p->labels[p->nlabels];
+    lp->len = (int)(s-id);
+    lp->id = p->copy ? copy(id, lp->len) : id;
+    lp->h = hash(id, lp->len);
+    lp->val = p->instr_counter;
+    lp->line = p->line_counter;
+    if (p->seen != NULL) {
+        if (tab_find(p->seen, p->labels, lp->id, lp->len, lp->h) != -1) {
+            if (p->copy)
+                free(lp->id);
+            err(p, "label `%.*s' redefined", lp->len, id);
+        }
+        tab_add(p->seen, p->labels, p->nlabels);
+    }
+    ++p->nlabels;
 }
 
-static IRec *new_instr(OpCode opcode)
+static IRec *new_instr(Part *p, OpCode opcode)
 {
-    if (instr_counter >= instr_max) {
-        instr_max = instr_max?instr_max*2:64;
-        instructions = realloc(instructions, sizeof(instructions[0])*instr_max);
+    if (p->instr_counter >= p->instr_max) {
+        p->instr_max = p->instr_max?p->instr_max*2:64;
+        p->instructions = realloc(p->instructions, sizeof(p->instructions[0])*p->instr_max);
+        if (p->map != NULL)
+            p->map = realloc(p->map, sizeof(p->map[0])*p->instr_max);
     }
-    instructions[instr_counter].opcode = opcode;
-    return &instructions[instr_counter++];
+    if (p->map != NULL)
+        p->map[p->instr_counter] = p->mark;
+    p->instructions[p->instr_counter].opcode = opcode;
+    p->instructions[p->instr_counter].arg.str = NULL;
+    return &p->instructions[p->instr_counter++];
 }
 
 /* instruction = space MNE operand */
-static void parse_instruction(char *s)
+static void parse_instruction(Part *p, char *s, char *e)
 {
-    int i;
+    int i, len, val;
     IRec *ir;
     OpCode opc;
-    char mne[8], buf[LINEBUFSIZ];
+    char *id, *mne;
 
-    if ((s=get_identifier(s, buf)) == NULL)
-        err("expecting mnemonic on instruction line");
-    for (i = 0; opcode_table[i].mne != NULL; i++)
-        if (strcmp(opcode_table[i].mne, buf) == 0)
+    if ((s=get_identifier(s, e, &mne)) == NULL)
+        err(p, "expecting mnemonic on instruction line");
+    len = (int)(s-mne);
+    for (i = 0; p->opcode_table[i].mne != NULL; i++)
+        if (strncmp(p->opcode_table[i].mne, mne, len)==0 && p->opcode_table[i].mne[len]=='\0')
             break;
-    if (opcode_table[i].mne == NULL)
-        err("unknown mnemonic `%s'", buf);
-    strcpy(mne, buf);
-    opc = opcode_table[i].opc;
+    if (p->opcode_table[i].mne == NULL)
+        err(p, "unknown mnemonic `%.*s'", len, mne);
+    mne = p->opcode_table[i].mne;
+    opc = p->opcode_table[i].opc;
 
-    switch (opcode_table[i].arg_kind) {
+    switch (p->opcode_table[i].arg_kind) {
     case ARG_ID: {
-        FixUp *fp;
+        Ref *rp;
 
-        if (get_identifier(s, buf) == NULL)
-            err("instruction `%s' requires an identifier argument", mne);
-        fp = malloc(sizeof(*fp));
-        fp->loc = instr_counter;
-        fp->next = fixup_list;
-        fixup_list = fp;
-        ir = new_instr(opc);
-        ir->arg.str = strdup(buf);
+        if ((s=get_identifier(s, e, &id)) == NULL)
+            err(p, "instruction `%s' requires an identifier argument", mne);
+        if (p->nrefs >= p->max_refs) {
+            p->max_refs = p->max_refs?p->max_refs*2:64;
+            p->refs = realloc(p->refs, sizeof(p->refs[0])*p->max_refs);
+        }
+        rp = &p->refs[p->nrefs++];
+        rp->loc = p->instr_counter;
+        rp->len = (int)(s-id);
+        rp->id = p->copy ? copy(id, rp->len) : id;
+        rp->h = hash(id, rp->len);
+        (void)new_instr(p, opc);
     }
         break;
     case ARG_STR:
-        if (get_string(s, buf) == NULL)
-            err("instruction `%s' requires a string argument", mne);
-        ir = new_instr(opc);
-        ir->arg.str = strdup(buf);
+        if ((s=get_string(s, e, &id)) == NULL)
+            err(p, "instruction `%s' requires a string argument", mne);
+        ir = new_instr(p, opc);
+        ir->arg.str = copy(id, (int)(s-id));
         break;
     case ARG_NUM:
-        if (get_number(s, buf) == NULL)
-            err("instruction `%s' requires a number argument", mne);
-        ir = new_instr(opc);
-        ir->arg.val = (int)strtol(buf, NULL, 10);
+        if (get_number(s, e, &val) == NULL)
+            err(p, "instruction `%s' requires a number argument", mne);
+        ir = new_instr(p, opc);
+        ir->arg.val = val;
         break;
     case ARG_NBLK:
-        if (get_number(s, buf) == NULL)
-            err("instruction `%s' requires a number argument", mne);
-        i = (int)strtol(buf, NULL, 10);
-        assert(i>=0 && i<=256); /* 256 is an arbitrary limit */
-        while (i-- > 0)
-            (void)new_instr(-1);
+        if (get_number(s, e, &val) == NULL)
+            err(p, "instruction `%s' requires a number argument", mne);
+        assert(val>=0 && val<=256); /* 256 is an arbitrary limit */
+        while (val-- > 0)
+            (void)new_instr(p, -1);
         break;
     default:
-        ir = new_instr(opc);
+        ir = new_instr(p, opc);
         ir->arg.str = NULL;
         break;
     }
 }
 
-/* program = { ( label | instruction ) EOL } */
-IRec *read_program(char *_file_path, IDescr *_opcode_table, int *_instr_counter)
+/* mark = { space } '#' NUMBER [ ':' NUMBER ] */
+static void parse_mark(Part *p, char *s, char *e)
 {
-    FILE *fp;
-    FixUp *fx, *next;
-    char linebuf[LINEBUFSIZ];
+    int i;
 
-    file_path = _file_path;
-    opcode_table = _opcode_table;
+    if ((s=get_number(s+1, e, &p->mark.line)) == NULL)
+        err(p, "expecting line number on mark line");
+    p->mark.col = 0;
+    if (s<e && *s==':' && get_number(s+1, e, &p->mark.col)==NULL)
+        err(p, "expecting column number on mark line");
+    if (p->map == NULL) {
+        p->map = malloc(sizeof(p->map[0])*(p->instr_max?p->instr_max:1));
+        for (i = 0; i < p->instr_counter; i++)
+            p->map[i].line = -1;
+    }
+}
 
-    if ((fp=fopen(file_path, "rb")) == NULL) {
-        fprintf(stderr, "%s: cannot read code file `%s'\n", prog_name, file_path);
+/* program = { ( label | instruction | mark ) EOL }; the line is s up to e, without the EOL */
+static void parse_line(Part *p, char *s, char *e)
+{
+    char *t;
+
+    if (s < e) {
+        if ((t=skip_blanks(s, e))<e && *t=='#')
+            parse_mark(p, t, e);
+        else if (isblank((unsigned char)*s))
+            parse_instruction(p, s, e);
+        else
+            parse_label(p, s, e);
+    }
+    ++p->line_counter;
+}
+
+/* assemble all of p's lines or up to the first error */
+static void *parse_part(void *arg)
+{
+    Part *p = arg;
+    char *s, *nl;
+
+    if (setjmp(p->env))
         return NULL;
+    for (s = p->s; s < p->end; s = nl+1) {
+        if ((nl=memchr(s, '\n', p->end-s)) == NULL)
+            nl = p->end;
+        parse_line(p, s, nl);
+    }
+    return NULL;
+}
+
+/* the slice of the label table with labels of hash h */
+#define SLICE(l, h) ((int)((h)>>26)%(l)->nslices)
+
+/* put the labels of p's slice in the table */
+static void *merge_part(void *arg)
+{
+    Part *p = arg;
+    Link *l = p->l;
+    Label *lp;
+    int k;
+
+    p->dup = -1;
+    for (k = 0; k < l->nlabels; k++) {
+        lp = &l->labels[k];
+        if (SLICE(l, lp->h) != p->slice)
+            continue;
+        if (tab_find(&l->tab[p->slice], l->labels, lp->id, lp->len, lp->h) != -1) {
+            p->dup = k;
+            break;
+        }
+        tab_add(&l->tab[p->slice], l->labels, k);
+    }
+    return NULL;
+}
+
+/* move p's instructions to where they go and resolve its references */
+static void *link_part(void *arg)
+{
+    Part *p = arg;
+    Link *l = p->l;
+    Ref *rp;
+    int k;
+
+    if (p->instr_counter > 0)
+        memcpy(l->instructions+p->base, p->instructions, sizeof(IRec)*p->instr_counter);
+    p->undef = -1;
+    for (rp = p->refs; rp < p->refs+p->nrefs; rp++) {
+        if ((k=tab_find(&l->tab[SLICE(l, rp->h)], l->labels, rp->id, rp->len, rp->h)) == -1)
+            p->undef = (int)(rp-p->refs);
+        else
+            l->instructions[p->base+rp->loc].arg.loc = l->labels[k].val;
+    }
+    return NULL;
+}
+
+/* run f on parts[1..n-1] on threads of their own and on parts[0] here */
+static void run_parts(Part *parts, int n, void *(*f)(void *))
+{
+    int i;
+    pthread_t tid[MAXPARTS];
+
+    for (i = 1; i < n; i++)
+        if (pthread_create(&tid[i], NULL, f, &parts[i]) != 0)
+            tid[i] = 0, f(&parts[i]);
+    f(&parts[0]);
+    for (i = 1; i < n; i++)
+        if (tid[i] != 0)
+            pthread_join(tid[i], NULL);
+}
+
+static void free_part(Part *p)
+{
+    int i;
+
+    if (p->copy) {
+        for (i = 0; i < p->nlabels; i++)
+            free(p->labels[i].id);
+        for (i = 0; i < p->nrefs; i++)
+            free(p->refs[i].id);
+    }
+    free(p->labels);
+    free(p->refs);
+    free(p->map);
+    free(p->msg);
+}
+
+/*
+    Put the parts' programs together and return it, or report the first
+    error and return NULL. The parts' instructions are taken over if it
+    went through; the parts are left for the caller to free.
+*/
+static IRec *link_parts(Part *parts, int n, char *file_path, int *instr_counter,
+                        Symbol **symbols, int *nsymbols, SrcPos **map)
+{
+    int i, j, ninstrs, nlabels, lines, err_line, dup;
+    char *msg;
+    Label *lp;
+    Link l;
+    SrcPos mark, *mp;
+
+    /* number the parts' instructions and lines; the first part with an error stops it */
+    msg = NULL;
+    err_line = 0;
+    for (i = ninstrs = nlabels = lines = 0; i < n; i++) {
+        parts[i].base = ninstrs;
+        parts[i].line_base = lines;
+        ninstrs += parts[i].instr_counter;
+        nlabels += parts[i].nlabels;
+        lines += parts[i].line_counter-1;
+        if ((msg=parts[i].msg) != NULL) {
+            err_line = parts[i].line_base+parts[i].err_line;
+            n = i+1;
+            break;
+        }
+    }
+
+    /* gather the labels and put them in the table; one found there already is redefined */
+    memset(&l, 0, sizeof(l));
+    l.labels = malloc(sizeof(Label)*(nlabels?nlabels:1));
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < parts[i].nlabels; j++) {
+            lp = &l.labels[l.nlabels++];
+            *lp = parts[i].labels[j];
+            lp->val += parts[i].base;
+            lp->line += parts[i].line_base;
+        }
+    }
+    l.nslices = n;
+    for (i = 0; i < n; i++) {
+        parts[i].l = &l;
+        parts[i].slice = i;
+    }
+    run_parts(parts, n, merge_part);
+    for (i = 0, dup = -1; i < n; i++)
+        if (parts[i].dup!=-1 && (dup==-1 || parts[i].dup<dup))
+            dup = parts[i].dup;
+    if (dup!=-1 && (msg==NULL || l.labels[dup].line<err_line)) {
+        lp = &l.labels[dup];
+        fprintf(stderr, "%s: %s:%d: error: label `%.*s' redefined\n",
+                prog_name, file_path, lp->line, lp->len, lp->id);
+        goto done;
+    } else if (msg != NULL) {
+        report(file_path, err_line, msg);
+        goto done;
     }
-    if (!setjmp(env)) {
-        while (fgets(linebuf, sizeof(linebuf), fp) != NULL) {
-            if (linebuf[0] != '\n') {
-                if (isblank(linebuf[0]))
-                    parse_instruction(linebuf);
-                else
-                    parse_label(linebuf);
+
+    /* resolve; the reference reported is the last one in the file */
+    l.instructions = malloc(sizeof(IRec)*(ninstrs?ninstrs:1));
+    run_parts(parts, n, link_part);
+    for (i = n-1; i >= 0; i--) {
+        if (parts[i].undef != -1) {
+            Ref *rp = &parts[i].refs[parts[i].undef];
+
+            fprintf(stderr, "%s: label `%.*s' referenced but never defined\n",
+                    prog_name, rp->len, rp->id);
+            free(l.instructions);
+            l.instructions = NULL;
+            goto done;
+        }
+    }
+
+    /* the marks, if any */
+    if (map != NULL) {
+        *map = NULL;
+        for (i = 0; i<n && parts[i].map==NULL; i++)
+            ;
+        if (i < n) {
+            *map = malloc(sizeof(SrcPos)*(ninstrs?ninstrs:1));
+            mark.line = mark.col = 0;
+            for (i = 0; i < n; i++) {
+                mp = *map+parts[i].base;
+                for (j = 0; j < parts[i].instr_counter; j++)
+                    mp[j] = parts[i].map!=NULL && parts[i].map[j].line!=-1 ? parts[i].map[j] : mark;
+                if (parts[i].map != NULL)
+                    mark = parts[i].mark;
             }
-            ++line_counter;
         }
-    } else {
-        fclose(fp);
+    }
+
+    /* the labels are in order of address already */
+    if (symbols != NULL) {
+        *symbols = malloc(sizeof(Symbol)*(l.nlabels?l.nlabels:1));
+        for (i = 0; i < l.nlabels; i++) {
+            (*symbols)[i].id = copy(l.labels[i].id, l.labels[i].len);
+            (*symbols)[i].val = l.labels[i].val;
+        }
+        *nsymbols = l.nlabels;
+    }
+    for (i = 0; i < n; i++) {
+        free(parts[i].instructions);
+        parts[i].instructions = NULL;
+        parts[i].instr_counter = 0;
+    }
+    *instr_counter = ninstrs;
+done:
+    free(l.labels);
+    for (i = 0; i < l.nslices; i++)
+        free(l.tab[i].slot);
+    return l.instructions;
+}
+
+void asm_threads(int n)
+{
+    nthreads = n;
+}
+
+IRec *read_program(char *file_path, IDescr *opcode_table, int *instr_counter)
+{
+    return read_program_symbols(file_path, opcode_table, instr_counter, NULL, NULL, NULL);
+}
+
+IRec *read_program_symbols(char *file_path, IDescr *opcode_table, int *instr_counter,
+                           Symbol **symbols, int *nsymbols, SrcPos **map)
+{
+    int i, n, fd;
+    long k;
+    char *s, *end, *nl;
+    struct stat sb;
+    IRec *instructions;
+    Part parts[MAXPARTS];
+
+    if ((fd=open(file_path, O_RDONLY))==-1 || fstat(fd, &sb)==-1) {
+        if (fd != -1)
+            close(fd);
+        fprintf(stderr, "%s: cannot read code file `%s'\n", prog_name, file_path);
         return NULL;
     }
-    fclose(fp);
-    for (fx = fixup_list; fx != NULL; fx = next) {
-        IRec *ir;
-        int loc;
+    s = NULL;
+    if (sb.st_size>0 && (s=mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))==MAP_FAILED) {
+        close(fd);
+        fprintf(stderr, "%s: cannot read code file `%s'\n", prog_name, file_path);
+        return NULL;
+    }
+    close(fd);
+    end = s+sb.st_size;
+    last_opcode_table = opcode_table;
+
+    /* cut it in parts at line ends */
+    if ((n=nthreads) <= 0)
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > sb.st_size/MINPART)
+        n = (int)(sb.st_size/MINPART);
+    if (n > MAXPARTS)
+        n = MAXPARTS;
+    if (n < 1)
+        n = 1;
+    memset(parts, 0, sizeof(parts[0])*n);
+    for (i = 0; i < n; i++) {
+        parts[i].opcode_table = opcode_table;
+        parts[i].line_counter = 1;
+        parts[i].s = i ? parts[i-1].end : s;
+        k = (end-parts[i].s)/(n-i);
+        if (i==n-1 || (nl=memchr(parts[i].s+k, '\n', end-parts[i].s-k))==NULL)
+            parts[i].end = end;
+        else
+            parts[i].end = nl+1;
+    }
+    if (s != NULL)
+        madvise(s, sb.st_size, MADV_SEQUENTIAL);
+
+    run_parts(parts, n, parse_part);
+    instructions = link_parts(parts, n, file_path, instr_counter, symbols, nsymbols, map);
+    for (i = 0; i < n; i++) {
+        free_program(parts[i].instructions, parts[i].instr_counter, opcode_table);
+        free_part(&parts[i]);
+    }
+    if (s != NULL)
+        munmap(s, sb.st_size);
+    return instructions;
+}
+
+Asm *asm_open(char *file_path, IDescr *opcode_table)
+{
+    Asm *a;
+
+    a = calloc(1, sizeof(*a));
+    a->file_path = file_path;
+    a->p.opcode_table = last_opcode_table = opcode_table;
+    a->p.copy = 1;
+    a->p.seen = &a->seen;
+    a->p.line_counter = 1;
+    return a;
+}
+
+/* assemble the next n chars of the program; return 0 after an error */
+int asm_feed(Asm *a, char *s, int n)
+{
+    int len;
+    char *nl, *e;
+
+    if (a->failed)
+        return 0;
+    if (setjmp(a->p.env)) {
+        report(a->file_path, a->p.err_line, a->p.msg);
+        a->failed = 1;
+        return 0;
+    }
+    for (e = s+n; s < e; s = nl+1) {
+        if ((nl=memchr(s, '\n', e-s)) == NULL) {
+            /* keep what there is of the line for later */
+            if (a->len+(e-s) > a->max) {
+                a->max = 2*(a->len+(int)(e-s));
+                a->line = realloc(a->line, a->max);
+            }
+            memcpy(a->line+a->len, s, e-s);
+            a->len += (int)(e-s);
+            break;
+        }
+        if (a->len > 0) {
+            if (a->len+(nl-s) > a->max) {
+                a->max = 2*(a->len+(int)(nl-s));
+                a->line = realloc(a->line, a->max);
+            }
+            memcpy(a->line+a->len, s, nl-s);
+            len = a->len+(int)(nl-s);
+            a->len = 0;
+            parse_line(&a->p, a->line, a->line+len);
+        } else {
+            parse_line(&a->p, s, nl);
+        }
+    }
+    return 1;
+}
+
+/*
+    Resolve the labels and return the program, its size in *instr_counter
+    and, if symbols is not NULL, its labels and, if map is not NULL, the
+    source position of each instruction (NULL if it had no marks); or NULL
+    if it had errors. a is freed either way.
+*/
+IRec *asm_close(Asm *a, int *instr_counter, Symbol **symbols, int *nsymbols, SrcPos **map)
+{
+    IRec *instructions;
 
-        ir = &instructions[fx->loc];
-        if ((loc=label_value(ir->arg.str)) == -1) {
-            fprintf(stderr, "%s: label `%s' referenced but never defined\n",
-            prog_name, ir->arg.str);
-            return NULL;
+    instructions = NULL;
+    if (a->failed)
+        goto done;
+    if (a->len > 0) {
+        if (setjmp(a->p.env)) {
+            report(a->file_path, a->p.err_line, a->p.msg);
+            goto done;
         }
-        free(ir->arg.str);
-        ir->arg.loc = loc;
-        next = fx->next;
-        free(fx);
+        parse_line(&a->p, a->line, a->line+a->len);
     }
-    *_instr_counter = instr_counter;
+    instructions = link_parts(&a->p, 1, a->file_path, instr_counter, symbols, nsymbols, map);
+done:
+    asm_free(a);
     return instructions;
 }
 
+/* drop a program being assembled */
+void asm_free(Asm *a)
+{
+    free_program(a->p.instructions, a->p.instr_counter, a->p.opcode_table);
+    free_part(&a->p);
+    free(a->seen.slot);
+    free(a->line);
+    free(a);
+}
+
+void free_symbols(Symbol *symbols, int nsymbols)
+{
+    int i;
+
+    for (i = 0; i < nsymbols; i++)
+        free(symbols[i].id);
+    free(symbols);
+}
+
+void free_program(IRec *instructions, int instr_counter, IDescr *opcode_table)
+{
+    int i, j;
+
+    for (i = 0; i < instr_counter; i++) {
+        if (instructions[i].opcode < 0)
+            continue;
+        for (j = 0; opcode_table[j].mne != NULL; j++)
+            if (opcode_table[j].opc == instructions[i].opcode)
+                break;
+        if (opcode_table[j].arg_kind == ARG_STR)
+            free(instructions[i].arg.str);
+    }
+    free(instructions);
+}
+
 void print_instr(IRec *ir)
 {
     int i;
 
-    for (i = 0; opcode_table[i].mne != NULL; i++)
-        if (opcode_table[i].opc == ir->opcode)
+    for (i = 0; last_opcode_table[i].mne != NULL; i++)
+        if (last_opcode_table[i].opc == ir->opcode)
             break;
-    assert(opcode_table[i].mne != NULL);
-    switch (opcode_table[i].arg_kind) {
+    assert(last_opcode_table[i].mne != NULL);
+    switch (last_opcode_table[i].arg_kind) {
     case ARG_NONE:
-        printf("%s(%d)\n", opcode_table[i].mne, ir->opcode);
+        printf("%s(%d)\n", last_opcode_table[i].mne, ir->opcode);
         break;
     case ARG_ID:
-        printf("%s(%d) %d\n", opcode_table[i].mne, ir->opcode, ir->arg.loc);
+        printf("%s(%d) %d\n", last_opcode_table[i].mne, ir->opcode, ir->arg.loc);
         break;
     case ARG_STR:
-        printf("%s(%d) '%s'\n", opcode_table[i].mne, ir->opcode, ir->arg.str);
+        printf("%s(%d) '%s'\n", last_opcode_table[i].mne, ir->opcode, ir->arg.str);
         break;
     case ARG_NUM:
     case ARG_NBLK:
-        printf("%s(%d) %d\n", opcode_table[i].mne, ir->opcode, ir->arg.val);
+        printf("%s(%d) %d\n", last_opcode_table[i].mne, ir->opcode, ir->arg.val);
         break;
     }
 }
+
+typedef struct LineCount LineCount;
+struct LineCount {
+    int line;
+    unsigned long long n;
+};
+
+static int by_count(const void *a, const void *b)
+{
+    const LineCount *x = a, *y = b;
+
+    if (x->n != y->n)
+        return x->n<y->n ? 1 : -1;
+    return (x->line>y->line)-(x->line<y->line);
+}
+
+/*
+    Print counts[i], what was counted for instruction i, added up by the
+    source line of the instruction in map, busiest line first and with the
+    text of the line if src, the source, is not NULL. Without a map each
+    instruction is a line of its own, numbered by its address.
+*/
+void print_by_line(FILE *fp, SrcPos *map, int n, unsigned long long *counts, char *what, char *src)
+{
+    int i, k, nkeys, nlines, len;
+    unsigned long long total, *sum;
+    char **text, *s, *nl;
+    LineCount *lc;
+
+    nkeys = map!=NULL ? 1 : n;
+    for (i = 0; map!=NULL && i<n; i++)
+        if (map[i].line >= nkeys)
+            nkeys = map[i].line+1;
+    sum = calloc(nkeys, sizeof(sum[0]));
+    total = 0;
+    for (i = 0; i < n; i++) {
+        sum[map!=NULL ? map[i].line : i] += counts[i];
+        total += counts[i];
+    }
+    lc = malloc(sizeof(LineCount)*(nkeys?nkeys:1));
+    for (i = k = 0; i < nkeys; i++) {
+        if (sum[i] > 0) {
+            lc[k].line = i;
+            lc[k++].n = sum[i];
+        }
+    }
+    qsort(lc, k, sizeof(LineCount), by_count);
+
+    /* where each source line starts */
+    nlines = 0;
+    text = NULL;
+    if (src!=NULL && map!=NULL) {
+        text = malloc(sizeof(char *)*(nkeys+1));
+        text[0] = NULL;
+        for (s = src, nlines = 1; nlines<nkeys && *s!='\0'; s = nl+1) {
+            text[nlines++] = s;
+            if ((nl=strchr(s, '\n')) == NULL)
+                break;
+        }
+    }
+
+    fprintf(fp, "%12s %7s %6s%s\n", what, "%", map!=NULL?"line":"addr", text!=NULL?"  source":"");
+    for (i = 0; i < k; i++) {
+        fprintf(fp, "%12llu %6.2f%% ", lc[i].n, 100.0*(double)lc[i].n/(double)total);
+        if (map!=NULL && lc[i].line==0)
+            fprintf(fp, "%6s", "?");
+        else
+            fprintf(fp, "%6d", lc[i].line);
+        if (text!=NULL && lc[i].line>0 && lc[i].line<nlines) {
+            s = text[lc[i].line];
+            len = (nl=strchr(s, '\n'))!=NULL ? (int)(nl-s) : (int)strlen(s);
+            fprintf(fp, "  %.*s", len, s);
+        }
+        fprintf(fp, "\n");
+    }
+    fprintf(fp, "%12llu %6.2f%%  total\n", total, total>0?100.0:0.0);
+    free(text);
+    free(lc);
+    free(sum);
+}
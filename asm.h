@@ -1,9 +1,14 @@
 #ifndef ASM_H_
 #define ASM_H_
 
+#include <stdio.h>
+
 typedef int OpCode;
 typedef struct IRec IRec;
 typedef struct IDescr IDescr;
+typedef struct Symbol Symbol;
+typedef struct SrcPos SrcPos;
+typedef struct Asm Asm;
 
 typedef enum {
     ARG_NONE,
@@ -28,7 +33,30 @@ struct IDescr {
     ArgKind arg_kind;
 };
 
+struct Symbol {
+    char *id;
+    int val;
+};
+
+/*
+    Where the code of an instruction came from, as given by the last mark
+    line (`#<line>[:<column>]') before it; line 0 if there was none.
+*/
+struct SrcPos {
+    int line, col;
+};
+
+void asm_threads(int n);
 IRec *read_program(char *file_path, IDescr *opcode_table, int *instr_counter);
+IRec *read_program_symbols(char *file_path, IDescr *opcode_table, int *instr_counter,
+                           Symbol **symbols, int *nsymbols, SrcPos **map);
+Asm *asm_open(char *file_path, IDescr *opcode_table);
+int asm_feed(Asm *a, char *s, int n);
+IRec *asm_close(Asm *a, int *instr_counter, Symbol **symbols, int *nsymbols, SrcPos **map);
+void asm_free(Asm *a);
+void free_symbols(Symbol *symbols, int nsymbols);
+void free_program(IRec *instructions, int instr_counter, IDescr *opcode_table);
 void print_instr(IRec *ir);
+void print_by_line(FILE *fp, SrcPos *map, int n, unsigned long long *counts, char *what, char *src);
 
 #endif
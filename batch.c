@@ -0,0 +1,566 @@
+/*
+    Batch I/O; see batch.h.
+
+    Each file is a job: open it, read or write it whole from offset 0 on,
+    close it. There are depth read jobs, input i going to read job i%depth,
+    and depth write jobs taken in any order. Inputs are read ahead as far as
+    the read jobs go: the one for input i+depth is started as soon as input
+    i has been handed back.
+
+    With io_uring the open and the reads or writes of a job are submitted
+    one after the other (a job has at most one request in flight) and the
+    completions move the jobs along whenever the caller waits for one; the
+    ring is set up with raw system calls. With the thread pool a worker does
+    a whole job at a time.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "batch.h"
+
+#define MAXTHREADS  16
+#define MAXIO       (1<<30)     /* # of bytes per read or write request */
+
+extern char *prog_name;
+
+enum {
+    J_FREE,
+    J_OPEN,         /* being opened */
+    J_IO,           /* being read or written */
+    J_DONE
+};
+
+typedef struct Job Job;
+typedef struct Ring Ring;
+
+struct Job {
+    int write;
+    int state;
+    char *path;
+    char *buf;
+    long len, done;
+    int fd;
+    int err;
+    Job *next;      /* in the thread pool's queue */
+};
+
+struct Ring {
+    int fd;
+    unsigned tail, pending;     /* next free entry, # queued but not submitted */
+    atomic_uint *sq_head, *sq_tail, *cq_head, *cq_tail;
+    unsigned *sq_mask, *sq_array, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+struct Batch {
+    int mode;
+    char **paths;
+    int n, next, issued;    /* # of inputs handed back and being read */
+    Job *reads, *writes;
+    int nslots;             /* # of read jobs and of write jobs */
+    BatchIn in;
+    int nfailed;            /* # of outputs not written */
+    Ring ring;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    Job *head, *tail;
+    int stop, nthreads;
+    pthread_t tids[MAXTHREADS];
+};
+
+/* the file is open: get a read job's buffer; return 0 on failure */
+static int job_opened(Job *j)
+{
+    struct stat sb;
+
+    j->done = 0;
+    if (j->write)
+        return 1;
+    if (fstat(j->fd, &sb) == -1) {
+        j->err = errno;
+        return 0;
+    }
+    if (sb.st_size >= 0x7FFFFFFF) {
+        j->err = EFBIG;
+        return 0;
+    }
+    j->len = (long)sb.st_size;
+    if ((j->buf=malloc(j->len+1)) == NULL) {
+        j->err = ENOMEM;
+        return 0;
+    }
+    return 1;
+}
+
+static void job_end(Job *j)
+{
+    close(j->fd);
+    if (!j->write && j->buf!=NULL) {
+        j->len = j->done;
+        j->buf[j->len] = '\0';
+    }
+}
+
+/* do a whole job in the calling thread, all but setting its state */
+static void job_run(Job *j)
+{
+    ssize_t k;
+    size_t n;
+
+    j->fd = open(j->path, j->write?O_WRONLY|O_CREAT|O_TRUNC:O_RDONLY, 0666);
+    if (j->fd == -1) {
+        j->err = errno;
+        return;
+    }
+    if (!job_opened(j)) {
+        job_end(j);
+        return;
+    }
+    while (j->done < j->len) {
+        n = (size_t)(j->len-j->done);
+        if (j->write)
+            k = pwrite(j->fd, j->buf+j->done, n, j->done);
+        else
+            k = pread(j->fd, j->buf+j->done, n, j->done);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            j->err = errno;
+            break;
+        }
+        if (k == 0) {   /* the file got shorter, or the disk is full */
+            if (j->write)
+                j->err = ENOSPC;
+            break;
+        }
+        j->done += k;
+    }
+    job_end(j);
+}
+
+/* io_uring */
+
+static int ring_open(Ring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd=(int)syscall(SYS_io_uring_setup, entries, &p)) == -1)
+        return 0;
+    /* OPENAT, READ and WRITE came with 5.6, as did this feature */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(r->fd);
+        return 0;
+    }
+    r->pending = 0;
+    r->sq_len = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if ((p.features&IORING_FEAT_SINGLE_MMAP) && r->cq_len>r->sq_len)
+        r->sq_len = r->cq_len;
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+                     IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+        r->cq_len = 0;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+                         IORING_OFF_CQ_RING);
+    }
+    r->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sq_map==MAP_FAILED || r->cq_map==MAP_FAILED || r->sqes==MAP_FAILED) {
+        if (r->sq_map != MAP_FAILED)
+            munmap(r->sq_map, r->sq_len);
+        if (r->cq_len>0 && r->cq_map!=MAP_FAILED)
+            munmap(r->cq_map, r->cq_len);
+        if (r->sqes != MAP_FAILED)
+            munmap(r->sqes, r->sqes_len);
+        close(r->fd);
+        return 0;
+    }
+    sq = r->sq_map;
+    cq = r->cq_map;
+    r->sq_head = (atomic_uint *)(sq+p.sq_off.head);
+    r->sq_tail = (atomic_uint *)(sq+p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq+p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq+p.sq_off.array);
+    r->cq_head = (atomic_uint *)(cq+p.cq_off.head);
+    r->cq_tail = (atomic_uint *)(cq+p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq+p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq+p.cq_off.cqes);
+    r->tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    return 1;
+}
+
+static void ring_close(Ring *r)
+{
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_len > 0)
+        munmap(r->cq_map, r->cq_len);
+    munmap(r->sq_map, r->sq_len);
+    close(r->fd);
+}
+
+/*
+    Queue a request for j. A job has one request at a time and there are no
+    more jobs than entries, so the queue can't be full.
+*/
+static struct io_uring_sqe *ring_sqe(Ring *r, Job *j, int op)
+{
+    unsigned i;
+    struct io_uring_sqe *e;
+
+    i = r->tail++ & *r->sq_mask;
+    e = &r->sqes[i];
+    memset(e, 0, sizeof(*e));
+    e->opcode = (unsigned char)op;
+    e->user_data = (uintptr_t)j;
+    r->sq_array[i] = i;
+    ++r->pending;
+    return e;
+}
+
+static void ring_start(Ring *r, Job *j)
+{
+    struct io_uring_sqe *e;
+
+    e = ring_sqe(r, j, IORING_OP_OPENAT);
+    e->fd = AT_FDCWD;
+    e->addr = (uintptr_t)j->path;
+    e->len = 0666;
+    e->open_flags = j->write ? O_WRONLY|O_CREAT|O_TRUNC : O_RDONLY;
+    j->state = J_OPEN;
+}
+
+static void ring_io(Ring *r, Job *j)
+{
+    struct io_uring_sqe *e;
+    long n;
+
+    n = j->len-j->done;
+    e = ring_sqe(r, j, j->write?IORING_OP_WRITE:IORING_OP_READ);
+    e->fd = j->fd;
+    e->addr = (uintptr_t)(j->buf+j->done);
+    e->len = (unsigned)(n<MAXIO ? n : MAXIO);
+    e->off = (unsigned long long)j->done;
+}
+
+/* move j along after its request completed with res */
+static void ring_done(Ring *r, Job *j, int res)
+{
+    if (j->state == J_OPEN) {
+        if (res < 0) {
+            j->err = -res;
+            j->state = J_DONE;
+            return;
+        }
+        j->fd = res;
+        j->state = J_IO;
+        if (!job_opened(j))
+            goto end;
+    } else if (res < 0) {
+        if (res!=-EINTR && res!=-EAGAIN) {
+            j->err = -res;
+            goto end;
+        }
+    } else if (res == 0) {
+        if (j->write)
+            j->err = ENOSPC;
+        goto end;
+    } else {
+        j->done += res;
+    }
+    if (j->done < j->len) {
+        ring_io(r, j);
+        return;
+    }
+end:
+    job_end(j);
+    j->state = J_DONE;
+}
+
+/* submit what's queued and handle the completions, waiting for one if wait */
+static void ring_reap(Ring *r, int wait)
+{
+    int n;
+    unsigned head, tail;
+    struct io_uring_cqe *c;
+
+    atomic_store_explicit(r->sq_tail, r->tail, memory_order_release);
+    do {
+        n = (int)syscall(SYS_io_uring_enter, r->fd, r->pending, wait?1:0,
+                         wait?IORING_ENTER_GETEVENTS:0, NULL, 0);
+    } while (n==-1 && errno==EINTR);
+    if (n == -1) {
+        fprintf(stderr, "%s: io_uring_enter: %s\n", prog_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    r->pending -= (unsigned)n;
+    head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+    tail = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        c = &r->cqes[head & *r->cq_mask];
+        ring_done(r, (Job *)(uintptr_t)c->user_data, c->res);
+    }
+    atomic_store_explicit(r->cq_head, head, memory_order_release);
+}
+
+/* thread pool */
+
+static void *worker(void *arg)
+{
+    Batch *b;
+    Job *j;
+
+    b = arg;
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        while (b->head==NULL && !b->stop)
+            pthread_cond_wait(&b->work, &b->lock);
+        if ((j=b->head) == NULL)
+            break;
+        if ((b->head=j->next) == NULL)
+            b->tail = NULL;
+        pthread_mutex_unlock(&b->lock);
+        job_run(j);
+        pthread_mutex_lock(&b->lock);
+        j->state = J_DONE;
+        pthread_cond_broadcast(&b->done);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+/* common */
+
+static void start(Batch *b, Job *j)
+{
+    j->err = 0;
+    if (b->mode == BATCH_URING) {
+        ring_start(&b->ring, j);
+    } else if (b->mode == BATCH_THREADS) {
+        pthread_mutex_lock(&b->lock);
+        j->state = J_OPEN;
+        j->next = NULL;
+        if (b->tail != NULL)
+            b->tail->next = j;
+        else
+            b->head = j;
+        b->tail = j;
+        pthread_cond_signal(&b->work);
+        pthread_mutex_unlock(&b->lock);
+    } else {
+        job_run(j);
+        j->state = J_DONE;
+    }
+}
+
+/* wait until j is done */
+static void wait_job(Batch *b, Job *j)
+{
+    if (b->mode == BATCH_URING) {
+        while (j->state != J_DONE)
+            ring_reap(&b->ring, 1);
+    } else if (b->mode == BATCH_THREADS) {
+        pthread_mutex_lock(&b->lock);
+        while (j->state != J_DONE)
+            pthread_cond_wait(&b->done, &b->lock);
+        pthread_mutex_unlock(&b->lock);
+    } else if (j->state != J_DONE) {
+        job_run(j);
+        j->state = J_DONE;
+    }
+}
+
+/* a finished write job, waiting for one if none is; NULL if none is busy */
+static Job *write_wait(Batch *b)
+{
+    int i, busy;
+    Job *j;
+
+    if (b->mode == BATCH_THREADS)
+        pthread_mutex_lock(&b->lock);
+    for (j = NULL; ; ) {
+        for (i = busy = 0; i<b->nslots && j==NULL; i++) {
+            if (b->writes[i].state == J_DONE)
+                j = &b->writes[i];
+            busy |= b->writes[i].state != J_FREE;
+        }
+        if (j!=NULL || !busy)
+            break;
+        if (b->mode == BATCH_THREADS)
+            pthread_cond_wait(&b->done, &b->lock);
+        else
+            ring_reap(&b->ring, 1);
+    }
+    if (b->mode == BATCH_THREADS)
+        pthread_mutex_unlock(&b->lock);
+    return j;
+}
+
+/* start reading the inputs there are read jobs for */
+static void read_ahead(Batch *b)
+{
+    Job *j;
+
+    for (; b->issued<b->n && b->issued<b->next+b->nslots; b->issued++) {
+        j = &b->reads[b->issued%b->nslots];
+        j->path = b->paths[b->issued];
+        j->buf = NULL;
+        j->len = 0;
+        j->err = 0;
+        if (b->mode != BATCH_SYNC)
+            start(b, j);
+    }
+}
+
+Batch *batch_open(char **paths, int n, int depth, int mode)
+{
+    int i;
+    Batch *b;
+
+    if ((b=calloc(1, sizeof(*b))) == NULL)
+        return NULL;
+    if (depth <= 0)
+        mode = BATCH_SYNC;
+    b->nslots = depth>0 ? depth : 1;
+    b->paths = paths;
+    b->n = n;
+    b->reads = calloc(b->nslots, sizeof(Job));
+    b->writes = calloc(b->nslots, sizeof(Job));
+    for (i = 0; i < b->nslots; i++)
+        b->writes[i].write = 1;
+    if (mode==BATCH_URING && !ring_open(&b->ring, (unsigned)b->nslots*2))
+        mode = BATCH_THREADS;
+    if (mode == BATCH_THREADS) {
+        pthread_mutex_init(&b->lock, NULL);
+        pthread_cond_init(&b->work, NULL);
+        pthread_cond_init(&b->done, NULL);
+        for (i = 0; i<depth && i<MAXTHREADS; i++)
+            if (pthread_create(&b->tids[i], NULL, worker, b) != 0)
+                break;
+        if ((b->nthreads=i) == 0) {
+            pthread_mutex_destroy(&b->lock);
+            pthread_cond_destroy(&b->work);
+            pthread_cond_destroy(&b->done);
+            mode = BATCH_SYNC;
+        }
+    }
+    b->mode = mode;
+    read_ahead(b);
+    return b;
+}
+
+/* the next input, NULL when there are no more */
+BatchIn *batch_next(Batch *b)
+{
+    Job *j;
+
+    if (b->next > 0) {
+        j = &b->reads[(b->next-1)%b->nslots];
+        free(j->buf);
+        j->buf = NULL;
+        j->state = J_FREE;
+        read_ahead(b);
+    }
+    if (b->next == b->n)
+        return NULL;
+    j = &b->reads[b->next%b->nslots];
+    wait_job(b, j);
+    ++b->next;
+    b->in.path = j->path;
+    b->in.err = j->err;
+    if (j->err != 0) {
+        free(j->buf);
+        j->buf = NULL;
+    }
+    b->in.buf = j->buf;
+    b->in.len = (int)j->len;
+    return &b->in;
+}
+
+/* free a finished write job */
+static void write_done(Batch *b, Job *j)
+{
+    if (j->err != 0) {
+        fprintf(stderr, "%s: cannot write file `%s': %s\n", prog_name, j->path, strerror(j->err));
+        ++b->nfailed;
+    }
+    free(j->path);
+    free(j->buf);
+    j->state = J_FREE;
+}
+
+/* write buf to path; buf is freed when written */
+void batch_write(Batch *b, char *path, char *buf, int len)
+{
+    int i;
+    Job *j;
+
+    for (i = 0; i<b->nslots && b->writes[i].state!=J_FREE; i++)
+        ;
+    if (i < b->nslots) {
+        j = &b->writes[i];
+    } else {
+        j = write_wait(b);
+        write_done(b, j);
+    }
+    j->path = strdup(path);
+    j->buf = buf;
+    j->len = len;
+    start(b, j);
+    if (b->mode == BATCH_SYNC)
+        write_done(b, j);
+}
+
+/* wait for the writes and free b; return the # of outputs not written */
+int batch_close(Batch *b)
+{
+    int i, nfailed;
+    Job *j;
+
+    while ((j=write_wait(b)) != NULL)
+        write_done(b, j);
+    for (i = 0; i < b->issued-b->next; i++) {
+        j = &b->reads[(b->next+i)%b->nslots];
+        if (b->mode != BATCH_SYNC) {
+            wait_job(b, j);
+            free(j->buf);
+        }
+    }
+    if (b->next > 0)
+        free(b->reads[(b->next-1)%b->nslots].buf);
+    if (b->mode == BATCH_URING) {
+        ring_close(&b->ring);
+    } else if (b->mode == BATCH_THREADS) {
+        pthread_mutex_lock(&b->lock);
+        b->stop = 1;
+        pthread_cond_broadcast(&b->work);
+        pthread_mutex_unlock(&b->lock);
+        for (i = 0; i < b->nthreads; i++)
+            pthread_join(b->tids[i], NULL);
+        pthread_mutex_destroy(&b->lock);
+        pthread_cond_destroy(&b->work);
+        pthread_cond_destroy(&b->done);
+    }
+    nfailed = b->nfailed;
+    free(b->reads);
+    free(b->writes);
+    free(b);
+    return nfailed;
+}
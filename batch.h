@@ -0,0 +1,37 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+/*
+    Batch I/O: read many input files ahead of the caller and write their
+    outputs behind it, with at most depth files being read and depth being
+    written at a time.
+
+    Inputs come back from batch_next() in order, whole and followed by a
+    '\0'; one stays valid until the next call. batch_write() takes over a
+    malloc()ed output buffer and frees it once written. The I/O is done with
+    io_uring when the kernel has it, else by a pool of threads with pread()
+    and pwrite(); with a depth of 0 it's all done synchronously in
+    batch_next() and batch_write().
+*/
+enum {
+    BATCH_URING,
+    BATCH_THREADS,
+    BATCH_SYNC
+};
+
+typedef struct Batch Batch;
+typedef struct BatchIn BatchIn;
+
+struct BatchIn {
+    char *path;
+    char *buf;
+    int len;
+    int err;        /* errno if the file couldn't be read; buf is NULL */
+};
+
+Batch *batch_open(char **paths, int n, int depth, int mode);
+BatchIn *batch_next(Batch *b);
+void batch_write(Batch *b, char *path, char *buf, int len);
+int batch_close(Batch *b);
+
+#endif
@@ -0,0 +1,253 @@
+#!/bin/sh
+#
+# Benchmarks for the META II tools. Run from the source directory after make.
+# Times are the best of $REPS runs, in milliseconds.
+#
+# N     # of rules in the generated grammar (default 20000)
+# NA    # of rules in the grammar whose code is assembled (default 5*N)
+# REPS  # of runs per measurement (default 3)
+# BASE  git revision to build the baseline meta_machine from (default: the
+#       first commit)
+#
+set -e
+N=${N:-20000}
+NA=${NA:-$((5*N))}
+REPS=${REPS:-3}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+now() { date +%s%N; }
+before=     # command run before each timed run
+
+# bench <label> <output> <command...>
+bench() {
+    label=$1 out=$2
+    shift 2
+    best=
+    i=0
+    while [ $i -lt $REPS ]; do
+        [ -z "$before" ] || $before
+        t0=$(now)
+        "$@" > "$out"
+        t1=$(now)
+        t=$(( (t1-t0)/1000000 ))
+        if [ -z "$best" ] || [ $t -lt $best ]; then best=$t; fi
+        i=$((i+1))
+    done
+    printf '%-48s %8d ms\n' "$label" $best
+}
+
+# grammar <n>: grammar with n rules, each a few alternatives long
+grammar() {
+    awk -v n=$1 'BEGIN {
+        print ".SYNTAX PROGRAM"
+        for (i = 0; i < n; i++)
+            printf "R%d = '\''A%d'\'' .OUT('\''X'\'' *) / R%d / .ID .OUT('\''CI '\'' *1) $('\''B'\'' .OUT(*2)) .,\n", i, i, (i+1)%n
+        print "PROGRAM = R0 .,"
+        print ".END"
+    }'
+}
+grammar $N > "$tmp/big.m2"
+echo "input: $N rules, $(wc -c < "$tmp/big.m2") bytes, $(nproc) cpus"
+
+echo
+echo "== speculative parallel parsing (meta_machine -j) =="
+bench "meta_machine" "$tmp/seq.m2a" ./meta_machine META_II.m2a "$tmp/big.m2"
+for j in 2 4 8 $(nproc); do
+    bench "meta_machine -j $j" "$tmp/par.m2a" ./meta_machine -j $j META_II.m2a "$tmp/big.m2"
+    cmp "$tmp/seq.m2a" "$tmp/par.m2a"
+done
+
+echo
+echo "== compiling the grammar (rules/s) =="
+bench "meta_compiler" "$tmp/comp.m2a" ./meta_compiler "$tmp/big.m2"
+echo "meta_compiler: $((N*1000/(best>0?best:1))) rules/s"
+bench "meta_machine META_II.m2a" "$tmp/seq.m2a" ./meta_machine META_II.m2a "$tmp/big.m2"
+echo "meta_machine META_II.m2a: $((N*1000/(best>0?best:1))) rules/s"
+cmp "$tmp/comp.m2a" "$tmp/seq.m2a"
+
+echo
+echo "== code loading (assembly text vs binary) =="
+./meta_machine META_II.m2a "$tmp/big.m2" > "$tmp/big.m2a"
+./meta_machine -w "$tmp/big.m2b" "$tmp/big.m2a"
+echo "code: $(wc -c < "$tmp/big.m2a") bytes as text, $(wc -c < "$tmp/big.m2b") bytes binary"
+echo "A0" > "$tmp/tiny"
+bench "meta_machine text" "$tmp/text.out" ./meta_machine "$tmp/big.m2a" "$tmp/tiny"
+bench "meta_machine binary" "$tmp/bin.out" ./meta_machine "$tmp/big.m2b" "$tmp/tiny"
+cmp "$tmp/text.out" "$tmp/bin.out"
+
+echo
+echo "== assembling a large code file (meta_machine -A) =="
+grammar $NA > "$tmp/huge.m2"
+./meta_machine META_II.m2a "$tmp/huge.m2" > "$tmp/huge.m2a"
+echo "code: $NA rules, $(wc -c < "$tmp/huge.m2a") bytes"
+./meta_machine -A 1 -w "$tmp/huge1.m2b" "$tmp/huge.m2a"
+for j in 1 2 4 8 $(nproc); do
+    bench "meta_machine -A $j -w" /dev/null ./meta_machine -A $j -w "$tmp/hugej.m2b" "$tmp/huge.m2a"
+    cmp "$tmp/huge1.m2b" "$tmp/hugej.m2b"
+done
+
+echo
+echo "== grammar as code (compiled on the fly, cold vs warm cache) =="
+nocache() { rm -rf "$tmp/cache"; }
+before=nocache
+bench "meta_machine big.m2 cold" "$tmp/cold.out" ./meta_machine -K "$tmp/cache" "$tmp/big.m2" "$tmp/tiny"
+before=
+bench "meta_machine big.m2 warm" "$tmp/warm.out" ./meta_machine -K "$tmp/cache" "$tmp/big.m2" "$tmp/tiny"
+cmp "$tmp/text.out" "$tmp/cold.out"
+cmp "$tmp/text.out" "$tmp/warm.out"
+
+echo
+echo "== output to a slow pipe (-a: writer thread) =="
+# a reader that takes a 16K bite of the pipe every 2 ms
+slow='while [ $(head -c 16384 | wc -c) -gt 0 ]; do sleep 0.002; done'
+awk 'BEGIN {
+    print ".BEGIN"
+    print ".REAL X .,"
+    print "0 = X .,"
+    print ".UNTIL X .= 20000 .DO"
+    print ".BEGIN EDIT (5, '\''HELLO'\'') ., PRINT ., X+1 = X .END"
+    print ".END"
+}' > "$tmp/print.v"
+./meta_machine VALGOL_I.m2a "$tmp/print.v" > "$tmp/print.v1a"
+for a in "" -a; do
+    bench "meta_machine $a" /dev/null sh -c "./meta_machine $a META_II.m2a $tmp/big.m2 | $slow"
+    bench "meta_machine_bt $a" /dev/null sh -c "./meta_machine_bt $a META_II.m2a $tmp/big.m2 | $slow"
+    bench "valgol_machine $a" /dev/null sh -c "./valgol_machine $a $tmp/print.v1a | $slow"
+done
+
+echo
+echo "== many small inputs (meta_machine -o: batch I/O) =="
+# cold runs drop the inputs from the page cache first: all of it when we
+# may, else file by file; it only means something if $tmp is on a disk
+evict() {
+    sync
+    if [ -w /proc/sys/vm/drop_caches ]; then
+        echo 3 > /proc/sys/vm/drop_caches
+    else
+        for f in "$tmp"/batch/*.v; do dd if="$f" iflag=nocache count=0 2>/dev/null; done
+    fi
+}
+NB=${NB:-2000}
+mkdir "$tmp/batch"
+i=0
+while [ $i -lt $NB ]; do
+    sed "s/10/$((i%50+1))/" VALGOL_I_example > "$tmp/batch/v$i.v"
+    i=$((i+1))
+done
+echo "inputs: $NB files, $(cat "$tmp"/batch/*.v | wc -c) bytes"
+loop="for f in $tmp/batch/*.v; do ./meta_machine VALGOL_I.m2a \$f > \$f.out; done"
+for cache in warm cold; do
+    if [ $cache = cold ]; then before=evict; else before=; fi
+    bench "$cache: meta_machine per file" /dev/null sh -c "$loop"
+    cat "$tmp"/batch/*.out > "$tmp/batch.seq"
+    for o in "-q 0" "-P" ""; do
+        bench "$cache: meta_machine -o $o" /dev/null ./meta_machine -o .out $o VALGOL_I.m2a "$tmp"/batch/*.v
+        cat "$tmp"/batch/*.out | cmp - "$tmp/batch.seq"
+    done
+done
+before=
+
+echo
+echo "== VALGOL source to output (valgol_machine -g: one process, no code file) =="
+awk -v n=$((N/4)) 'BEGIN {
+    print ".BEGIN"
+    print ".REAL X, Y .,"
+    print "5 = X ., 1 = Y"
+    for (i = 0; i < n; i++)
+        printf ".,\nX + %d * Y - %d * Y = X\n", i, i
+    print "., EDIT (X, '\''*'\'') ., PRINT"
+    print ".END"
+}' > "$tmp/long.v"
+echo "source: $(wc -c < "$tmp/long.v") bytes"
+for v in VALGOL_I_example "$tmp/long.v"; do
+    bench "$(basename $v): meta_machine, valgol_machine" "$tmp/two.out" \
+        sh -c "./meta_machine VALGOL_I.m2a $v > $tmp/v.v1a && ./valgol_machine $tmp/v.v1a"
+    bench "$(basename $v): valgol_machine -g" "$tmp/one.out" ./valgol_machine -g VALGOL_I.m2a "$v"
+    cmp "$tmp/two.out" "$tmp/one.out"
+done
+
+echo
+echo "== checking only (-c) vs output to /dev/null =="
+for m in meta_machine meta_machine_bt; do
+    bench "$m > /dev/null" /dev/null ./$m META_II.m2a "$tmp/big.m2"
+    bench "$m -c" "$tmp/check.out" ./$m -c META_II.m2a "$tmp/big.m2"
+    test ! -s "$tmp/check.out"
+done
+
+echo
+echo "== profile-guided layout (--profile, --layout) =="
+steps() { ./meta_machine --stats "$@" 2>&1 > /dev/null | awk '/^machine instructions/ { print $3 }'; }
+for p in "VALGOL_I.m2a $tmp/long.v" "META_II.m2a $tmp/big.m2"; do
+    set -- $p
+    rm -f "$tmp/prof"
+    ./meta_machine --profile "$tmp/prof" $1 $2 > "$tmp/plain.out"
+    ./meta_machine --layout "$tmp/prof" $1 > "$tmp/laid.m2a"
+    bench "$(basename $2): $1" "$tmp/plain.out" ./meta_machine $1 $2
+    bench "$(basename $2): $1 laid out" "$tmp/laid.out" ./meta_machine "$tmp/laid.m2a" $2
+    cmp "$tmp/plain.out" "$tmp/laid.out"
+    echo "instructions executed: $(steps $1 $2) -> $(steps "$tmp/laid.m2a" $2)"
+done
+
+echo
+echo "== alternatives run ahead (meta_machine_bt -j -r) =="
+# ITEM's alternatives each read a long block and only its last word tells
+# which one it is: the ones before the right one fail after all that work
+cat > "$tmp/blocks.m2" <<'END'
+.SYNTAX BLOCKS
+BLOCKS = $ ITEM '.' .OUT('END') .,
+ITEM = A / B / C .,
+A = 'BEGIN' $ .NUMBER 'ENDA' .OUT('A ' *) .,
+B = 'BEGIN' .LABEL *1 $ (.NUMBER .OUT('N ' *)) 'ENDB' .OUT('B ' *1) .,
+C = 'BEGIN' $ .NUMBER 'ENDC' .OUT('C ' *) .,
+.END
+END
+./meta_machine META_II.m2a "$tmp/blocks.m2" > "$tmp/blocks.m2a"
+awk -v n=$((N/100)) 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "BEGIN"
+        for (j = 0; j < 20000; j++)
+            printf " %d", j
+        print " END" substr("ABC", i%3+1, 1)
+    }
+    print "."
+}' > "$tmp/blocks"
+echo "input: $((N/100)) blocks, $(wc -c < "$tmp/blocks") bytes"
+bench "meta_machine_bt" "$tmp/blocks.seq" ./meta_machine_bt "$tmp/blocks.m2a" "$tmp/blocks"
+for j in 2 3 $(nproc); do
+    bench "meta_machine_bt -j $j -r ITEM" "$tmp/blocks.par" ./meta_machine_bt -j $j -r ITEM "$tmp/blocks.m2a" "$tmp/blocks"
+    cmp "$tmp/blocks.seq" "$tmp/blocks.par"
+done
+./meta_machine_bt --stats -j 3 -r ITEM "$tmp/blocks.m2a" "$tmp/blocks" 2>&1 > /dev/null | grep '^run ahead'
+
+echo
+echo "== one-byte edit (meta_machine_bt -e) vs full reparse =="
+# -e parses the input keeping what it needs to reuse, applies the edit and
+# parses again: the last line is what that costs over one plain parse
+for n in $((N/4)) $N; do
+    grammar $n > "$tmp/e.m2"
+    off=$(grep -bo "'A$((n/2))'" "$tmp/e.m2" | head -1 | cut -d: -f1)
+    printf '%d 1 1\nC' $((off+1)) > "$tmp/e.edits"
+    { head -c $((off+1)) "$tmp/e.m2"; printf C; tail -c +$((off+3)) "$tmp/e.m2"; } > "$tmp/e2.m2"
+    echo "input: $n rules, $(wc -c < "$tmp/e.m2") bytes"
+    bench "$n: meta_machine_bt" "$tmp/e.out" ./meta_machine_bt META_II.m2a "$tmp/e.m2"
+    once=$best
+    bench "$n: meta_machine_bt, edited input" "$tmp/full.out" ./meta_machine_bt META_II.m2a "$tmp/e2.m2"
+    bench "$n: meta_machine_bt -e" "$tmp/edit.out" ./meta_machine_bt -e "$tmp/e.edits" META_II.m2a "$tmp/e.m2"
+    cmp "$tmp/full.out" "$tmp/edit.out"
+    echo "$n: reparse after the edit: $((best-once)) ms"
+done
+
+echo
+echo "== plain machine vs the baseline =="
+# the baseline's code has no ALTs, so its labels are numbered differently
+base=${BASE:-$(git rev-list --max-parents=0 HEAD 2>/dev/null || true)}
+mkdir "$tmp/base"
+if [ -n "$base" ] && git archive "$base" | tar -x -C "$tmp/base" \
+&& make -C "$tmp/base" meta_machine META_II.m2a > /dev/null 2>&1; then
+    bench "baseline meta_machine ($(git rev-parse --short "$base"))" /dev/null \
+        "$tmp/base/meta_machine" "$tmp/base/META_II.m2a" "$tmp/big.m2"
+    bench "meta_machine" /dev/null ./meta_machine META_II.m2a "$tmp/big.m2"
+else
+    echo "cannot build the baseline"
+fi
@@ -0,0 +1,142 @@
+/*
+    Reader for the META II machine's binary event stream.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "events.h"
+
+static int get_num(EvReader *r, unsigned *v)
+{
+    int shift;
+
+    for (*v = 0, shift = 0; r->p<r->lim && shift<32; shift += 7) {
+        *v |= (unsigned)(*r->p&0x7F)<<shift;
+        if ((*r->p++&0x80) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static char *get_bytes(EvReader *r)
+{
+    unsigned n;
+    char *s;
+
+    if (!get_num(r, &n) || n>(unsigned)(r->lim-r->p))
+        return NULL;
+    s = malloc(n+1);
+    memcpy(s, r->p, n);
+    s[n] = '\0';
+    r->p += n;
+    return s;
+}
+
+/* read the header; return 0 if buf doesn't hold an event stream */
+int ev_open(EvReader *r, unsigned char *buf, unsigned len)
+{
+    int i;
+    unsigned n;
+
+    memset(r, 0, sizeof(*r));
+    r->p = buf;
+    r->lim = buf+len;
+    if (len<5 || memcmp(buf, EV_MAGIC, 4)!=0 || buf[4]<1 || buf[4]>EV_VERSION)
+        return 0;
+    r->p += 5;
+    if (!get_num(r, &n) || n>len)
+        return 0;
+    r->literals = calloc(n?n:1, sizeof(char *));
+    for (r->nliterals = 0; r->nliterals < (int)n; r->nliterals++)
+        if ((r->literals[r->nliterals]=get_bytes(r)) == NULL)
+            goto fail;
+    if (!get_num(r, &n) || n>len)
+        goto fail;
+    r->rule_names = calloc(n?n:1, sizeof(char *));
+    r->rule_addrs = calloc(n?n:1, sizeof(unsigned));
+    for (i = 0; i < (int)n; i++, r->nrules++)
+        if (!get_num(r, &r->rule_addrs[i]) || (r->rule_names[i]=get_bytes(r))==NULL)
+            goto fail;
+    return 1;
+fail:
+    ev_close(r);
+    return 0;
+}
+
+/* return 1 and fill ev, 0 at the end of the stream, -1 if it is malformed */
+int ev_next(EvReader *r, Event *ev)
+{
+    int ok;
+
+    if (r->p >= r->lim)
+        return 0;
+    ev->tag = *r->p++;
+    ev->a = ev->b = ev->start = ev->end = 0;
+    switch (ev->tag) {
+    case EV_ENTER:
+        ok = get_num(r, &ev->a) && get_num(r, &ev->start);
+        break;
+    case EV_EXIT:
+        ok = get_num(r, &ev->a) && get_num(r, &ev->end);
+        break;
+    case EV_TST:
+        ok = get_num(r, &ev->a) && get_num(r, &ev->start) && get_num(r, &ev->end)
+          && ev->a<(unsigned)r->nliterals;
+        break;
+    case EV_ID:
+    case EV_NUM:
+    case EV_SR:
+    case EV_CI:
+    case EV_SCN:
+        ok = get_num(r, &ev->start) && get_num(r, &ev->end);
+        break;
+    case EV_CL:
+        ok = get_num(r, &ev->a) && ev->a<(unsigned)r->nliterals;
+        break;
+    case EV_GN:
+        ok = get_num(r, &ev->a);
+        break;
+    case EV_LB:
+    case EV_OUT:
+        ok = 1;
+        break;
+    case EV_END:
+    case EV_POS:
+        ok = get_num(r, &ev->a) && get_num(r, &ev->b);
+        break;
+    default:
+        ok = 0;
+        break;
+    }
+    return ok?1:-1;
+}
+
+/* rules are sorted by address */
+char *ev_rule_name(EvReader *r, unsigned addr)
+{
+    int lo, hi, mid;
+
+    for (lo = 0, hi = r->nrules-1; lo <= hi; ) {
+        mid = (lo+hi)/2;
+        if (r->rule_addrs[mid] == addr)
+            return r->rule_names[mid];
+        else if (r->rule_addrs[mid] < addr)
+            lo = mid+1;
+        else
+            hi = mid-1;
+    }
+    return NULL;
+}
+
+void ev_close(EvReader *r)
+{
+    int i;
+
+    for (i = 0; i < r->nliterals; i++)
+        free(r->literals[i]);
+    for (i = 0; i < r->nrules; i++)
+        free(r->rule_names[i]);
+    free(r->literals);
+    free(r->rule_names);
+    free(r->rule_addrs);
+    memset(r, 0, sizeof(*r));
+}
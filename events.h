@@ -0,0 +1,59 @@
+#ifndef EVENTS_H_
+#define EVENTS_H_
+
+/*
+    Binary event stream written by the META II machine in place of its text
+    output (see meta_execute()).
+
+    stream  = header { event }
+    header  = "M2EV" version
+              nliterals { len bytes }       literal ids are indices
+              nrules { addr len bytes }     rule names
+    event   = tag operands
+
+    Numbers are unsigned LEB128; input offsets are absolute.
+*/
+#define EV_MAGIC    "M2EV"
+#define EV_VERSION  3
+
+enum {
+    EV_ENTER = 1,   /* rule start              (a: rule address, start) */
+    EV_EXIT,        /* rule return             (a: result, end)         */
+    EV_TST,         /* literal recognized      (a: literal id, start, end) */
+    EV_ID,          /* identifier recognized   (start, end)             */
+    EV_NUM,         /* number recognized       (start, end)             */
+    EV_SR,          /* string recognized       (start, end)             */
+    EV_CL,          /* literal emitted         (a: literal id)          */
+    EV_CI,          /* last token emitted      (start, end)             */
+    EV_GN,          /* label emitted           (a: label number)        */
+    EV_LB,          /* next output goes in the label field              */
+    EV_OUT,         /* end of output line                               */
+    EV_END,         /* end of run              (a: status, b: line)     */
+    EV_SCN,         /* token recognized by SCN (start, end); version 2  */
+    EV_POS,         /* position emitted        (a: line, b: column); version 3 */
+};
+
+typedef struct EvReader EvReader;
+typedef struct Event Event;
+
+struct Event {
+    int tag;
+    unsigned a, b;
+    unsigned start, end;
+};
+
+struct EvReader {
+    unsigned char *p, *lim;
+    char **literals;
+    int nliterals;
+    char **rule_names;
+    unsigned *rule_addrs;
+    int nrules;
+};
+
+int ev_open(EvReader *r, unsigned char *buf, unsigned len);
+int ev_next(EvReader *r, Event *ev);
+char *ev_rule_name(EvReader *r, unsigned addr);
+void ev_close(EvReader *r);
+
+#endif
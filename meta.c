@@ -0,0 +1,3739 @@
+/*
+    META II machine engine.
+    Reentrant: all the execution state lives in meta_execute()'s frame so that
+    several programs/inputs can be run at the same time.
+
+    The main loop is in meta_exec.h, specialized for running without
+    backtracking (meta_execute(), meta_feed()), with backtracking and with
+    backtracking and memoization (meta_bt_run()).
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "meta.h"
+#include "events.h"
+#include "trace.h"
+#include "stats.h"
+#include "sha256.h"
+
+#define MAXFRAMES   64      /* max # of stacked frames (CLL) at one given time */
+#define MAXCHOICES  256     /* max # of pending alternatives (ALT) at one given time */
+#define OUTFLUSHSIZ 65536   /* write out a file sink once this much is buffered */
+#define TRACEBUFSIZ 4096    /* # of trace records buffered before writing */
+#define CHECKSTEPS  1024    /* # of instructions between time/output limit checks */
+#define CACHEMAXSIZ (64LL*1024*1024)    /* compiled grammar cache size bound */
+
+#define POLICY_NONE         0
+#define POLICY_BACKTRACK    1
+#define POLICY_MEMO         2
+
+IDescr meta_opcode_table[] = {
+    { "TST", OP_TST, ARG_STR  },
+    { "ID",  OP_ID,  ARG_NONE },
+    { "NUM", OP_NUM, ARG_NONE },
+    { "SR",  OP_SR,  ARG_NONE },
+    { "CLL", OP_CLL, ARG_ID   },
+    { "R",   OP_R,   ARG_NONE },
+    { "SET", OP_SET, ARG_NONE },
+    { "B",   OP_B,   ARG_ID   },
+    { "BT",  OP_BT,  ARG_ID   },
+    { "BF",  OP_BF,  ARG_ID   },
+    { "BE",  OP_BE,  ARG_NONE },
+    { "CL",  OP_CL,  ARG_STR  },
+    { "CI",  OP_CI,  ARG_NONE },
+    { "GN1", OP_GN1, ARG_NONE },
+    { "GN2", OP_GN2, ARG_NONE },
+    { "LB",  OP_LB,  ARG_NONE },
+    { "OUT", OP_OUT, ARG_NONE },
+    { "ADR", OP_ADR, ARG_ID   },
+    { "END", OP_END, ARG_NONE },
+    { "SCN", OP_SCN, ARG_ID   },
+    { "SCR", OP_SCR, ARG_ID   },
+    { "CLS", OP_CLS, ARG_STR  },
+    { "ALT", OP_ALT, ARG_ID   },
+    { "POS", OP_POS, ARG_NONE },
+    { NULL,  0,      0        },
+};
+
+/* string pool entry; a TST/CL operand is its position in the pool */
+typedef struct Lit Lit;
+struct Lit {
+    int id, len;
+    char s[];
+};
+
+#define LIT(prog, w)    ((Lit *)((prog)->pool+M_ARG(w)))
+#define LITSIZ(len)     (2+((len)+1+3)/4)   /* in ints */
+
+#define BIN_MAGIC       "M2AB"
+#define BIN_VERSION     3
+
+/*
+    Token shapes. `SCN first' followed by `SCR rest' scans a token made of a
+    char of class first followed by any # of chars of class rest; a class is
+    a run of CLS instructions. The loader folds both classes into a map.
+*/
+#define SHAPE_FIRST     1
+#define SHAPE_REST      2
+
+/*
+    `ALT end' starts an alternative of the choice ending at end. Once loaded
+    its operand is where the next alternative starts instead, or ALT_NONE if
+    there's no point in saving the state (see link_alternatives()).
+*/
+#define ALT_NONE        M_MAXARG
+
+extern char *prog_name;
+
+static unsigned hash(char *s)
+{
+    unsigned hash_val;
+
+    for (hash_val = 0; *s != '\0'; s++)
+        hash_val = (unsigned)*s + 31*hash_val;
+    return hash_val;
+}
+
+/* append a literal to the pool; return its position */
+static int pool_add(MetaProg *prog, char *s, int len, int *maxsiz)
+{
+    int pos;
+    Lit *lp;
+
+    if (prog->poolsiz+LITSIZ(len) > *maxsiz) {
+        *maxsiz = (prog->poolsiz+LITSIZ(len))*2;
+        prog->pool = realloc(prog->pool, sizeof(int)**maxsiz);
+        assert(prog->pool != NULL);
+    }
+    pos = prog->poolsiz;
+    lp = (Lit *)(prog->pool+pos);
+    lp->id = prog->nliterals++;
+    lp->len = len;
+    memset(lp->s, 0, (LITSIZ(len)-2)*sizeof(int));
+    memcpy(lp->s, s, len);
+    prog->poolsiz += LITSIZ(len);
+    return pos;
+}
+
+/* add the chars of the class at loc to map */
+static int add_class(unsigned char *map, unsigned char bit, IRec *instructions, int instr_counter, int loc)
+{
+    char *s;
+
+    if (instructions[loc].opcode != OP_CLS)
+        return 0;
+    for (; loc<instr_counter && instructions[loc].opcode==OP_CLS; loc++)
+        for (s = instructions[loc].arg.str; *s != '\0'; s++)
+            map[(unsigned char)*s] |= bit;
+    return 1;
+}
+
+/* is the rule at loc a lone SCN (token rules, see META_II.m2)? */
+static int is_token_rule(MetaProg *prog, int loc)
+{
+    MInstr *code;
+
+    code = prog->code;
+    if (M_OP(code[loc]) != OP_SCN)
+        return 0;
+    if (loc+1<prog->ncode && M_OP(code[loc+1])==OP_SCR)
+        ++loc;
+    return loc+1<prog->ncode && M_OP(code[loc+1])==OP_R;
+}
+
+/*
+    Make each ALT point to where the next alternative starts: the BT that
+    ends its alternative (skipping the choices nested in it), or the end of
+    the choice for the last one. Failing the last alternative of a rule body
+    is the same as failing the rule, so that one gets ALT_NONE.
+*/
+static void link_alternatives(MInstr *code, int ncode)
+{
+    int i, j, end;
+
+    for (i = 0; i < ncode; i++) {
+        if (M_OP(code[i]) != OP_ALT)
+            continue;
+        end = M_ARG(code[i]);
+        for (j = i+1; j < end; j++) {
+            if (M_OP(code[j])==OP_BT && M_ARG(code[j])==end)
+                break;
+            if (M_OP(code[j])==OP_ALT && M_ARG(code[j])>j)
+                j = M_ARG(code[j])-1;
+        }
+        if (j>=end && end<ncode && M_OP(code[end])==OP_R)
+            code[i] = M_INSTR(OP_ALT, ALT_NONE);
+        else
+            code[i] = M_INSTR(OP_ALT, j);
+    }
+}
+
+/* pack the instructions and intern their strings */
+static int pack(MetaProg *prog, IRec *instructions, int instr_counter, char *file_path)
+{
+    int i, n, tabsiz, maxsiz, arg, len;
+    unsigned h;
+    int *tab;
+    IRec *ir;
+    Lit *lp;
+
+    if (instr_counter > M_MAXARG) {
+        fprintf(stderr, "%s: code file `%s' is too large\n", prog_name, file_path);
+        return 0;
+    }
+    for (i = n = 0; i < instr_counter; i++)
+        if (instructions[i].opcode==OP_TST || instructions[i].opcode==OP_CL)
+            ++n;
+    for (tabsiz = 16; tabsiz < 2*n; tabsiz *= 2)
+        ;
+    tab = malloc(sizeof(int)*tabsiz);   /* open addressing on pool positions */
+    for (i = 0; i < tabsiz; i++)
+        tab[i] = -1;
+    prog->code = malloc(sizeof(MInstr)*(instr_counter?instr_counter:1));
+    prog->ncode = instr_counter;
+    prog->pool = NULL;
+    prog->poolsiz = prog->nliterals = maxsiz = 0;
+    for (i = 0; i < instr_counter; i++) {
+        ir = &instructions[i];
+        switch (ir->opcode) {
+        case OP_TST:
+        case OP_CL:
+        case OP_CLS:
+            len = (int)strlen(ir->arg.str);
+            for (h = hash(ir->arg.str)&(tabsiz-1); tab[h] != -1; h = (h+1)&(tabsiz-1)) {
+                lp = (Lit *)(prog->pool+tab[h]);
+                if (lp->len==len && memcmp(lp->s, ir->arg.str, len)==0)
+                    break;
+            }
+            if (tab[h] == -1)
+                tab[h] = pool_add(prog, ir->arg.str, len, &maxsiz);
+            arg = tab[h];
+            break;
+        case OP_SCN:
+            if (prog->nshapes%16 == 0)
+                prog->shapes = realloc(prog->shapes, sizeof(prog->shapes[0])*(prog->nshapes+16));
+            memset(prog->shapes[prog->nshapes], 0, sizeof(prog->shapes[0]));
+            if (!add_class(prog->shapes[prog->nshapes], SHAPE_FIRST, instructions, instr_counter, ir->arg.loc)
+            || i+1<instr_counter && instructions[i+1].opcode==OP_SCR
+            && !add_class(prog->shapes[prog->nshapes], SHAPE_REST, instructions, instr_counter, instructions[i+1].arg.loc)) {
+                fprintf(stderr, "%s: code file `%s': SCN/SCR operand is not a class\n", prog_name, file_path);
+                free(tab);
+                return 0;
+            }
+            arg = prog->nshapes++;
+            break;
+        case OP_CLL:
+        case OP_B:
+        case OP_BT:
+        case OP_BF:
+        case OP_ADR:
+        case OP_SCR:
+        case OP_ALT:
+            arg = ir->arg.loc;
+            break;
+        default:
+            arg = 0;
+            break;
+        }
+        prog->code[i] = M_INSTR(ir->opcode, arg);
+    }
+    free(tab);
+    /* scan directly instead of calling token rules */
+    for (i = 0; i < instr_counter; i++)
+        if (M_OP(prog->code[i])==OP_CLL && is_token_rule(prog, M_ARG(prog->code[i])))
+            prog->code[i] = prog->code[M_ARG(prog->code[i])];
+    link_alternatives(prog->code, prog->ncode);
+    if (prog->poolsiz > M_MAXARG) {
+        fprintf(stderr, "%s: code file `%s' has too many strings\n", prog_name, file_path);
+        return 0;
+    }
+    return 1;
+}
+
+static int is_generated_label(char *s)
+{
+    if (*s++ != 'L' || !isdigit(*s))
+        return 0;
+    while (isdigit(*s))
+        ++s;
+    return *s == '\0';
+}
+
+/* keep the names of the CLL/ADR targets */
+static void find_rules(MetaProg *prog, Symbol *symbols, int nsymbols)
+{
+    int i, n;
+    char *is_rule;
+
+    is_rule = calloc(prog->ncode+1, 1);
+    for (i = 0; i < prog->ncode; i++)
+        if (M_OP(prog->code[i])==OP_CLL || M_OP(prog->code[i])==OP_ADR)
+            is_rule[M_ARG(prog->code[i])] = 1;
+    prog->rules = malloc(sizeof(Symbol)*(nsymbols?nsymbols:1));
+    for (i = n = 0; i < nsymbols; i++) {
+        if (!is_rule[symbols[i].val])
+            continue;
+        /* a rule starting with $ shares its address with a generated label */
+        if (n>0 && prog->rules[n-1].val==symbols[i].val) {
+            if (is_generated_label(prog->rules[n-1].id)) {
+                free(prog->rules[n-1].id);
+                prog->rules[n-1] = symbols[i];
+            } else {
+                free(symbols[i].id);
+            }
+        } else {
+            prog->rules[n++] = symbols[i];
+        }
+        symbols[i].id = NULL;
+    }
+    prog->nrules = n;
+    free(is_rule);
+}
+
+/* check the operands of a program read from a binary file */
+static int check_code(MetaProg *prog)
+{
+    int i, pos;
+    char *is_lit;
+    Lit *lp;
+
+    if (prog->ncode==0 || M_OP(prog->code[0])!=OP_ADR)
+        return 0;
+    is_lit = calloc(prog->poolsiz+1, 1);
+    for (pos = 0; pos < prog->poolsiz; pos += LITSIZ(lp->len)) {
+        lp = (Lit *)(prog->pool+pos);
+        is_lit[pos] = 1;
+    }
+    for (i = 0; i < prog->ncode; i++) {
+        switch (M_OP(prog->code[i])) {
+        case OP_TST:
+        case OP_CL:
+        case OP_CLS:
+            if (M_ARG(prog->code[i])>=prog->poolsiz || !is_lit[M_ARG(prog->code[i])])
+                goto fail;
+            break;
+        case OP_CLL:
+        case OP_B:
+        case OP_BT:
+        case OP_BF:
+        case OP_ADR:
+        case OP_SCR:
+            if (M_ARG(prog->code[i]) >= prog->ncode)
+                goto fail;
+            break;
+        case OP_ALT:
+            if (M_ARG(prog->code[i])>=prog->ncode && M_ARG(prog->code[i])!=ALT_NONE)
+                goto fail;
+            break;
+        case OP_SCN:
+            if (M_ARG(prog->code[i]) >= prog->nshapes)
+                goto fail;
+            break;
+        default:
+            if (M_OP(prog->code[i]) > OP_POS)
+                goto fail;
+            break;
+        }
+    }
+    free(is_lit);
+    return 1;
+fail:
+    free(is_lit);
+    return 0;
+}
+
+/*
+    Abstract execution for check_loops(): st[i] is the set of (consumed,
+    res) pairs possible before instruction i, consumed meaning that input
+    was consumed since from. Only the instructions in [lo, hi] are followed.
+*/
+#define CR(c, r)    (1<<((c)*2+(r)))
+
+static void flow(MetaProg *prog, char *nullable, unsigned char *st, int *work,
+                 int from, int lo, int hi)
+{
+    int i, c, r, n, arg;
+    Lit *lp;
+    MInstr *code;
+
+#define ADD(j, bits)                                                \
+    do {                                                            \
+        if ((j)>=lo && (j)<=hi && (st[j]|(bits))!=st[j]) {          \
+            st[j] |= (bits);                                        \
+            work[n++] = (j);                                        \
+        }                                                           \
+    } while (0)
+
+    code = prog->code;
+    memset(st+lo, 0, hi-lo+1);
+    n = 0;
+    ADD(from, CR(0, 0)|CR(0, 1));
+    while (n > 0) {
+        i = work[--n];
+        arg = M_ARG(code[i]);
+        for (c = 0; c < 2; c++) {
+            for (r = 0; r < 2; r++) {
+                if (!(st[i] & CR(c, r)))
+                    continue;
+                switch (M_OP(code[i])) {
+                case OP_TST:
+                    lp = LIT(prog, code[i]);
+                    ADD(i+1, lp->len>0 ? CR(1, 1)|CR(c, 0) : CR(c, 1));
+                    break;
+                case OP_ID:
+                case OP_NUM:
+                case OP_SR:
+                case OP_SCN:
+                    ADD(i+1, CR(1, 1)|CR(c, 0));
+                    break;
+                case OP_CLL:
+                    ADD(i+1, CR(1, 1)|CR(c, 0)|(nullable[arg]?CR(c, 1):0));
+                    break;
+                case OP_SET:
+                    ADD(i+1, CR(c, 1));
+                    break;
+                case OP_B:
+                    ADD(arg, CR(c, r));
+                    break;
+                case OP_BT:
+                    ADD(r?arg:i+1, CR(c, r));
+                    break;
+                case OP_BF:
+                    ADD(r?i+1:arg, CR(c, r));
+                    break;
+                case OP_BE:
+                    if (r)
+                        ADD(i+1, CR(c, r));
+                    break;
+                case OP_ALT:    /* backtracking resumes at arg with res 0 */
+                    ADD(i+1, CR(c, r));
+                    if (arg != ALT_NONE)
+                        ADD(arg, CR(c, 0));
+                    break;
+                case OP_R:
+                case OP_END:
+                case OP_ADR:
+                    break;
+                default:
+                    ADD(i+1, CR(c, r));
+                    break;
+                }
+            }
+        }
+    }
+#undef ADD
+}
+
+/*
+    A `$' loop whose body can succeed without consuming input repeats
+    forever once it does: reject the program. Which rules can succeed
+    without consuming is found first, by iterating until nothing changes.
+*/
+static int check_loops(MetaProg *prog, char *file_path)
+{
+    int i, j, lo, hi, changed, ok;
+    char *nullable;
+    unsigned char *st;
+    int *work;
+
+    nullable = calloc(prog->ncode+1, 1);
+    st = malloc(prog->ncode+1);
+    work = malloc(sizeof(int)*(4*prog->ncode+4));
+    do {
+        changed = 0;
+        for (i = 0; i < prog->nrules; i++) {
+            lo = prog->rules[i].val;
+            hi = (i+1<prog->nrules) ? prog->rules[i+1].val-1 : prog->ncode-1;
+            if (nullable[lo] || lo>hi)
+                continue;
+            flow(prog, nullable, st, work, lo, lo, hi);
+            for (j = lo; j <= hi; j++) {
+                if (M_OP(prog->code[j])==OP_R && (st[j]&CR(0, 1))) {
+                    nullable[lo] = 1;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+
+    ok = 1;
+    for (i = 0; i<prog->ncode && ok; i++) {
+        if (M_OP(prog->code[i])!=OP_BT || M_ARG(prog->code[i])>i)
+            continue;
+        flow(prog, nullable, st, work, M_ARG(prog->code[i]), M_ARG(prog->code[i]), i);
+        if (st[i] & CR(0, 1)) {
+            for (j = prog->nrules-1; j>0 && prog->rules[j].val>i; j--)
+                ;
+            fprintf(stderr, "%s: code file `%s': a `$' loop in rule %s can repeat without consuming input\n",
+                    prog_name, file_path, prog->nrules>0?prog->rules[j].id:"?");
+            ok = 0;
+        }
+    }
+    free(nullable);
+    free(st);
+    free(work);
+    return ok;
+}
+
+static int get32(FILE *fp, int *v)
+{
+    unsigned char b[4];
+
+    if (fread(b, 1, 4, fp) != 4)
+        return 0;
+    *v = (int)((unsigned)b[0] | (unsigned)b[1]<<8 | (unsigned)b[2]<<16 | (unsigned)b[3]<<24);
+    return 1;
+}
+
+static void put32(FILE *fp, int v)
+{
+    unsigned char b[4];
+
+    b[0] = (unsigned char)v;
+    b[1] = (unsigned char)(v>>8);
+    b[2] = (unsigned char)(v>>16);
+    b[3] = (unsigned char)(v>>24);
+    fwrite(b, 1, 4, fp);
+}
+
+/*
+    Binary code file:
+        "M2AB" version ncode nliterals nrules
+        code...
+        { len chars }...            literals, in pool order
+        { addr len chars }...       rules
+        nshapes { map }...          SCN char maps, 256 bytes each (version 2)
+    All numbers are 32-bit little-endian. ALT operands are linked from
+    version 3 on.
+*/
+static int load_binary(MetaProg *prog, FILE *fp)
+{
+    int i, version, n, len, maxsiz, nrules;
+    char *buf;
+
+    if (!get32(fp, &version) || version<1 || version>BIN_VERSION || !get32(fp, &prog->ncode)
+    || !get32(fp, &n) || !get32(fp, &nrules)
+    || prog->ncode<0 || prog->ncode>M_MAXARG || n<0 || n>M_MAXARG || nrules<0 || nrules>prog->ncode)
+        return 0;
+    prog->code = malloc(sizeof(MInstr)*(prog->ncode?prog->ncode:1));
+    for (i = 0; i < prog->ncode; i++)
+        if (!get32(fp, (int *)&prog->code[i]))
+            return 0;
+    maxsiz = 0;
+    for (i = 0; i < n; i++) {
+        if (!get32(fp, &len) || len<0 || len>M_MAXARG)
+            return 0;
+        buf = malloc(len+1);
+        if (fread(buf, 1, len, fp) != (size_t)len) {
+            free(buf);
+            return 0;
+        }
+        pool_add(prog, buf, len, &maxsiz);
+        free(buf);
+        if (prog->poolsiz > M_MAXARG)
+            return 0;
+    }
+    prog->rules = calloc(nrules?nrules:1, sizeof(Symbol));
+    for (i = 0; i < nrules; i++) {
+        if (!get32(fp, &prog->rules[i].val) || prog->rules[i].val<0 || prog->rules[i].val>=prog->ncode
+        || !get32(fp, &len) || len<0 || len>M_MAXARG)
+            return 0;
+        prog->rules[i].id = malloc(len+1);
+        prog->nrules = i+1;
+        if (fread(prog->rules[i].id, 1, len, fp) != (size_t)len)
+            return 0;
+        prog->rules[i].id[len] = '\0';
+    }
+    if (version >= 2) {
+        if (!get32(fp, &n) || n<0 || n>M_MAXARG)
+            return 0;
+        prog->shapes = malloc(sizeof(prog->shapes[0])*(n?n:1));
+        if (fread(prog->shapes, sizeof(prog->shapes[0]), n, fp) != (size_t)n)
+            return 0;
+        prog->nshapes = n;
+        for (i = 0; i < n; i++)
+            prog->shapes[i][0] = 0;     /* NUL ends the input */
+    }
+    if (!check_code(prog))
+        return 0;
+    if (version < 3)
+        link_alternatives(prog->code, prog->ncode);
+    return 1;
+}
+
+/* write prog as a binary code file to fp and close it; 0 if that fails */
+static int save_binary(MetaProg *prog, FILE *fp)
+{
+    int i, pos, len;
+    Lit *lp;
+
+    fwrite(BIN_MAGIC, 1, 4, fp);
+    put32(fp, BIN_VERSION);
+    put32(fp, prog->ncode);
+    put32(fp, prog->nliterals);
+    put32(fp, prog->nrules);
+    for (i = 0; i < prog->ncode; i++)
+        put32(fp, (int)prog->code[i]);
+    for (pos = 0; pos < prog->poolsiz; pos += LITSIZ(lp->len)) {
+        lp = (Lit *)(prog->pool+pos);
+        put32(fp, lp->len);
+        fwrite(lp->s, 1, lp->len, fp);
+    }
+    for (i = 0; i < prog->nrules; i++) {
+        len = (int)strlen(prog->rules[i].id);
+        put32(fp, prog->rules[i].val);
+        put32(fp, len);
+        fwrite(prog->rules[i].id, 1, len, fp);
+    }
+    put32(fp, prog->nshapes);
+    if (prog->nshapes > 0)
+        fwrite(prog->shapes, sizeof(prog->shapes[0]), prog->nshapes, fp);
+    return fclose(fp) == 0;
+}
+
+int meta_save(MetaProg *prog, char *file_path)
+{
+    FILE *fp;
+
+    if ((fp=fopen(file_path, "wb"))==NULL || !save_binary(prog, fp)) {
+        fprintf(stderr, "%s: cannot write file `%s'\n", prog_name, file_path);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Turn assembled code into prog; the code and symbols are freed.
+    file_path is for messages.
+*/
+static int load_text(MetaProg *prog, IRec *instructions, int instr_counter,
+                     Symbol *symbols, int nsymbols, char *file_path)
+{
+    int ok;
+
+    ok = 0;
+    if (instr_counter==0 || instructions[0].opcode!=OP_ADR)
+        fprintf(stderr, "%s: code file `%s' does not begin with ADR instruction\n",
+        prog_name, file_path);
+    else if (pack(prog, instructions, instr_counter, file_path))
+        ok = 1;
+    if (ok) {
+        find_rules(prog, symbols, nsymbols);
+        ok = check_loops(prog, file_path);
+    }
+    if (!ok)
+        meta_free(prog);
+    free_program(instructions, instr_counter, meta_opcode_table);
+    free_symbols(symbols, nsymbols);
+    return ok;
+}
+
+/* load a code file, either assembly text or binary (see meta_save()) */
+int meta_load(MetaProg *prog, char *file_path)
+{
+    int ok, instr_counter, nsymbols;
+    char magic[4];
+    FILE *fp;
+    IRec *instructions;
+    Symbol *symbols;
+
+    memset(prog, 0, sizeof(*prog));
+    if ((fp=fopen(file_path, "rb")) == NULL) {
+        fprintf(stderr, "%s: cannot read code file `%s'\n", prog_name, file_path);
+        return 0;
+    }
+    if (fread(magic, 1, 4, fp)==4 && memcmp(magic, BIN_MAGIC, 4)==0) {
+        ok = load_binary(prog, fp);
+        fclose(fp);
+        if (!ok)
+            fprintf(stderr, "%s: code file `%s' is corrupt\n", prog_name, file_path);
+        else
+            ok = check_loops(prog, file_path);
+        if (!ok)
+            meta_free(prog);
+        return ok;
+    }
+    fclose(fp);
+
+    instructions = read_program_symbols(file_path, meta_opcode_table,
+                   &instr_counter, &symbols, &nsymbols, NULL);
+    if (instructions == NULL)
+        return 0;
+    return load_text(prog, instructions, instr_counter, symbols, nsymbols, file_path);
+}
+
+/*
+    Compiled grammars. meta_open() compiles a grammar by running the
+    compiler code on it and assembling the output in memory. With a cache
+    directory the result is kept there as a binary code file named after
+    the SHA-256 of the binary format version, the compiler code and the
+    grammar (<64 hex digits>.m2b), so the next run with the same compiler
+    and grammar only has to load it. An entry is written to a temporary
+    file and renamed into place: a reader never sees half an entry and
+    racing writers leave one whole copy. Loading an entry touches it and,
+    when a new one pushes the cache over CACHEMAXSIZ bytes, the least
+    recently used entries go.
+*/
+typedef struct CacheEnt CacheEnt;
+struct CacheEnt {
+    char *name;
+    struct timespec mtime;
+    long long size;
+};
+
+static char *read_file(char *file_path, long *len)
+{
+    char *buf;
+    FILE *fp;
+
+    if ((fp=fopen(file_path, "rb")) == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    if ((*len=ftell(fp)) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    rewind(fp);
+    buf = malloc(*len+1);
+    *len = (long)fread(buf, 1, *len, fp);
+    buf[*len] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+static void put_code(void *arg, char *s, int n)
+{
+    asm_feed(arg, s, n);
+}
+
+/* compile the grammar src read from file_path by running comp on it */
+static int compile(MetaProg *prog, MetaProg *comp, char *src, char *file_path)
+{
+    int status, line_counter, instr_counter, nsymbols;
+    MetaOut out;
+    Asm *a;
+    IRec *instructions;
+    Symbol *symbols;
+
+    a = asm_open(file_path, meta_opcode_table);
+    meta_out_init(&out, NULL);
+    out.put = put_code;
+    out.arg = a;
+    status = meta_execute(comp, src, &out, &line_counter);
+    meta_flush(&out);
+    free(out.buf);
+    if (status != META_OK) {
+        fprintf(stderr, "%s: %s:%d: %s\n", prog_name, file_path, line_counter,
+                status==META_SYNTAX_ERROR?"syntax error":meta_strerror(status));
+        asm_free(a);
+        return 0;
+    }
+    if ((instructions=asm_close(a, &instr_counter, &symbols, &nsymbols, NULL)) == NULL)
+        return 0;
+    return load_text(prog, instructions, instr_counter, symbols, nsymbols, file_path);
+}
+
+/* load the cache entry at path if there is a sound one */
+static int cache_get(MetaProg *prog, char *path)
+{
+    int ok;
+    char magic[4];
+    FILE *fp;
+
+    if ((fp=fopen(path, "rb")) == NULL)
+        return 0;
+    ok = fread(magic, 1, 4, fp)==4 && memcmp(magic, BIN_MAGIC, 4)==0 && load_binary(prog, fp);
+    fclose(fp);
+    if (!ok || !check_loops(prog, path)) {
+        meta_free(prog);
+        return 0;
+    }
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return 1;
+}
+
+/* make dir and whatever parents it's missing */
+static int make_dirs(char *dir)
+{
+    char path[PATH_MAX], *p;
+
+    if (strlen(dir) >= sizeof(path))
+        return 0;
+    strcpy(path, dir);
+    for (p = path+1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(path, 0777);
+            *p = '/';
+        }
+    }
+    return mkdir(path, 0777)==0 || errno==EEXIST;
+}
+
+static int by_mtime(const void *a, const void *b)
+{
+    const CacheEnt *x = a, *y = b;
+
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec<y->mtime.tv_sec ? -1 : 1;
+    return x->mtime.tv_nsec<y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec>y->mtime.tv_nsec;
+}
+
+/*
+    Remove the least recently used entries of dir but keep until they fit
+    in CACHEMAXSIZ bytes. Temporary files left by writers that died count
+    as entries once they're a minute old.
+*/
+static void cache_evict(char *dir, char *keep)
+{
+    int i, n, max;
+    size_t len;
+    long long total;
+    char path[PATH_MAX];
+    DIR *d;
+    struct dirent *e;
+    struct stat sb;
+    CacheEnt *ents;
+
+    if ((d=opendir(dir)) == NULL)
+        return;
+    n = 0;
+    max = 64;
+    ents = malloc(sizeof(ents[0])*max);
+    total = 0;
+    while ((e=readdir(d)) != NULL) {
+        len = strlen(e->d_name);
+        if (len<4 || strcmp(e->d_name+len-4, ".m2b")!=0 && strcmp(e->d_name+len-4, ".tmp")!=0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (stat(path, &sb)!=0 || !S_ISREG(sb.st_mode)
+        || e->d_name[len-1]=='p' && time(NULL)-sb.st_mtim.tv_sec<60)
+            continue;
+        if (n == max) {
+            max *= 2;
+            ents = realloc(ents, sizeof(ents[0])*max);
+        }
+        ents[n].name = strdup(e->d_name);
+        ents[n].mtime = sb.st_mtim;
+        ents[n].size = sb.st_size;
+        total += sb.st_size;
+        n++;
+    }
+    closedir(d);
+    qsort(ents, n, sizeof(ents[0]), by_mtime);
+    for (i = 0; i<n && total>CACHEMAXSIZ; i++) {
+        if (strcmp(ents[i].name, keep) == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ents[i].name);
+        if (unlink(path) == 0)
+            total -= ents[i].size;
+    }
+    for (i = 0; i < n; i++)
+        free(ents[i].name);
+    free(ents);
+}
+
+/* store prog in dir as entry name; failing to is not an error */
+static void cache_put(MetaProg *prog, char *dir, char *name)
+{
+    int fd;
+    char path[PATH_MAX], tmp[PATH_MAX];
+    FILE *fp;
+
+    if (snprintf(tmp, sizeof(tmp), "%s/%s.%d.tmp", dir, name, (int)getpid()) >= (int)sizeof(tmp))
+        return;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!make_dirs(dir) || (fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        return;
+    if ((fp=fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    if (!save_binary(prog, fp) || rename(tmp, path)!=0) {
+        unlink(tmp);
+        return;
+    }
+    cache_evict(dir, name);
+}
+
+/*
+    Load a code file or, if file_path ends in .m2, a grammar compiled with
+    the compiler code at compiler. With a cache_dir, a grammar compiled
+    before with the same compiler is loaded from the cache instead.
+*/
+int meta_open(MetaProg *prog, char *file_path, char *compiler, char *cache_dir)
+{
+    int i, ok, phase;
+    size_t n;
+    long len, clen;
+    char *src, *ctext, name[2*32+5], path[PATH_MAX];
+    unsigned char digest[32], version[4];
+    MetaProg comp;
+    Sha256 c;
+
+    n = strlen(file_path);
+    if (n<3 || strcmp(file_path+n-3, ".m2")!=0)
+        return meta_load(prog, file_path);
+    memset(prog, 0, sizeof(*prog));
+    if ((src=read_file(file_path, &len)) == NULL) {
+        fprintf(stderr, "%s: cannot read grammar file `%s'\n", prog_name, file_path);
+        return 0;
+    }
+    if (cache_dir != NULL) {
+        if ((ctext=read_file(compiler, &clen)) == NULL) {
+            fprintf(stderr, "%s: cannot read code file `%s'\n", prog_name, compiler);
+            free(src);
+            return 0;
+        }
+        for (i = 0; i < 4; i++)
+            version[i] = (unsigned char)(BIN_VERSION>>8*i);
+        sha256_init(&c);
+        sha256_feed(&c, BIN_MAGIC, 4);
+        sha256_feed(&c, version, 4);
+        sha256_feed(&c, &clen, sizeof(clen));
+        sha256_feed(&c, ctext, clen);
+        sha256_feed(&c, src, len);
+        sha256_end(&c, digest);
+        free(ctext);
+        for (i = 0; i < 32; i++)
+            sprintf(name+2*i, "%02x", digest[i]);
+        strcpy(name+2*32, ".m2b");
+        if (snprintf(path, sizeof(path), "%s/%s", cache_dir, name) >= (int)sizeof(path))
+            cache_dir = NULL;
+        else if (cache_get(prog, path)) {
+            free(src);
+            return 1;
+        }
+    }
+    if (!meta_load(&comp, compiler)) {
+        free(src);
+        return 0;
+    }
+    meta_drop_alts(&comp);
+    phase = stats_phase(PH_COMPILE);
+    ok = compile(prog, &comp, src, file_path);
+    meta_free(&comp);
+    free(src);
+    if (ok && cache_dir!=NULL)
+        cache_put(prog, cache_dir, name);
+    stats_phase(phase);
+    return ok;
+}
+
+/* $XDG_CACHE_HOME/meta_ii, else ~/.cache/meta_ii, or NULL if neither is set */
+char *meta_cache_dir(void)
+{
+    static char dir[PATH_MAX];
+    char *s;
+
+    if ((s=getenv("XDG_CACHE_HOME"))!=NULL && *s!='\0')
+        snprintf(dir, sizeof(dir), "%s/meta_ii", s);
+    else if ((s=getenv("HOME"))!=NULL && *s!='\0')
+        snprintf(dir, sizeof(dir), "%s/.cache/meta_ii", s);
+    else
+        return NULL;
+    return dir;
+}
+
+/*
+    Whether the rule at addr can be copied in place of a call: it must be a
+    stretch of code that ends with its R, that only branches within itself
+    and that is at most maxsize instructions long, not counting ALTs. Return
+    the address of its R, or -1.
+*/
+static int inlinable(MetaProg *prog, int addr, int maxsize)
+{
+    int i, j, end, n;
+    MInstr *code;
+
+    code = prog->code;
+    for (i = 0; i<prog->nrules && prog->rules[i].val<=addr; i++)
+        ;
+    end = (i<prog->nrules ? prog->rules[i].val : prog->ncode)-1;
+    if (end<addr || M_OP(code[end])!=OP_R)
+        return -1;
+    for (j = addr, n = 0; j < end; j++) {
+        switch (M_OP(code[j])) {
+        case OP_B:
+        case OP_BT:
+        case OP_BF:
+            if (M_ARG(code[j])<addr || M_ARG(code[j])>end)
+                return -1;
+            break;
+        case OP_ADR:
+        case OP_END:
+        case OP_CLS:
+            return -1;
+        case OP_ALT:
+            continue;
+        }
+        if (++n > maxsize)
+            return -1;
+    }
+    return end;
+}
+
+/* whether the code from addr only branches on to an R, within n branches */
+static int returns(MInstr *code, int ncode, int addr, int n)
+{
+    for (; addr<ncode && n>0; addr = M_ARG(code[addr]), n--) {
+        switch (M_OP(code[addr])) {
+        case OP_R:
+            return 1;
+        case OP_BT:
+        case OP_BF:
+            if (!returns(code, ncode, addr+1, n-1))
+                return 0;
+            break;
+        case OP_B:
+            break;
+        default:
+            return 0;
+        }
+    }
+    return addr<ncode && M_OP(code[addr])==OP_R;
+}
+
+/*
+    Rewrite the program for the plain machine:
+
+    - a call of a rule of at most maxsize instructions is replaced by a copy
+      of the rule in which the R's branch to after the copy, GN1 and GN2 are
+      GNI1 and GNI2, which use label slots of their own in the caller's
+      frame, and an INL at the start clears those slots as a call would
+    - CLL followed by R (possibly through branches) becomes TCL,
+      which goes to the rule in the same frame: the rule returns where the R
+      would have
+    - ALTs, which only the backtracking machine uses, are dropped
+
+    Only what the program was is copied, so rules are inlined one level
+    deep. The rule at keep (if not -1) is left alone, for
+    meta_execute_parallel(). The backtracking machine cannot run the result.
+    Return 0 if the program would get too large.
+*/
+int meta_inline(MetaProg *prog, int maxsize, int keep)
+{
+    int i, j, k, n, end, arg, ncode, gen;
+    int *map, *ends, *cmap;
+    MInstr *code, *new, w;
+
+    code = prog->code;
+    ncode = prog->ncode;
+    map = malloc(sizeof(int)*(ncode+1));    /* new address of each instruction */
+    ends = malloc(sizeof(int)*(ncode+1));   /* R of the rule at each address, or -1 */
+    cmap = malloc(sizeof(int)*(ncode+1));
+    for (i = 0; i <= ncode; i++)
+        ends[i] = -2;
+    for (i = n = 0; i < ncode; i++) {
+        map[i] = n;
+        if (M_OP(code[i]) == OP_ALT)
+            continue;
+        if (M_OP(code[i]) != OP_CLL || (arg=M_ARG(code[i])) == keep) {
+            ++n;
+            continue;
+        }
+        if (ends[arg] == -2)
+            ends[arg] = inlinable(prog, arg, maxsize);
+        if ((end=ends[arg]) == -1) {
+            ++n;
+            continue;
+        }
+        for (j = arg, gen = 0; j < end; j++) {
+            if (M_OP(code[j]) != OP_ALT)
+                ++n;
+            if (M_OP(code[j])==OP_GN1 || M_OP(code[j])==OP_GN2)
+                gen = 1;
+        }
+        n += gen;
+    }
+    map[ncode] = n;
+    if (n > M_MAXARG) {
+        free(map);
+        free(ends);
+        free(cmap);
+        return 0;
+    }
+
+    new = malloc(sizeof(MInstr)*(n?n:1));
+    for (i = 0, k = 0; i < ncode; i++) {
+        w = code[i];
+        if (M_OP(w) == OP_ALT)
+            continue;
+        if (M_OP(w)==OP_CLL && M_ARG(w)!=keep && (end=ends[M_ARG(w)]) >= 0) {
+            /* new addresses of the copy; the final R is after it */
+            arg = M_ARG(w);
+            for (j = arg, gen = 0; j < end; j++)
+                if (M_OP(code[j])==OP_GN1 || M_OP(code[j])==OP_GN2)
+                    gen = 1;
+            if (gen)
+                new[k++] = M_INSTR(OP_INL, 0);
+            for (j = arg, n = k; j < end; j++) {
+                cmap[j] = n;
+                if (M_OP(code[j]) != OP_ALT)
+                    ++n;
+            }
+            cmap[end] = n;
+            for (j = arg; j < end; j++) {
+                w = code[j];
+                switch (M_OP(w)) {
+                case OP_ALT:
+                    continue;
+                case OP_B:
+                case OP_BT:
+                case OP_BF:
+                    w = M_INSTR(M_OP(w), cmap[M_ARG(w)]);
+                    break;
+                case OP_R:
+                    w = M_INSTR(OP_B, cmap[end]);
+                    break;
+                case OP_GN1:
+                    w = M_INSTR(OP_GNI1, 0);
+                    break;
+                case OP_GN2:
+                    w = M_INSTR(OP_GNI2, 0);
+                    break;
+                case OP_CLL:
+                case OP_SCR:
+                    w = M_INSTR(M_OP(w), map[M_ARG(w)]);
+                    break;
+                }
+                new[k++] = w;
+            }
+            continue;
+        }
+        switch (M_OP(w)) {
+        case OP_CLL:
+        case OP_B:
+        case OP_BT:
+        case OP_BF:
+        case OP_ADR:
+        case OP_SCR:
+            w = M_INSTR(M_OP(w), map[M_ARG(w)]);
+            break;
+        }
+        new[k++] = w;
+    }
+
+    /* tail calls */
+    if (keep >= 0)
+        keep = map[keep];
+    for (i = 0; i < k; i++) {
+        if (M_OP(new[i])!=OP_CLL || M_ARG(new[i])==keep)
+            continue;
+        if (returns(new, k, i+1, 8))
+            new[i] = M_INSTR(OP_TCL, M_ARG(new[i]));
+    }
+
+    for (i = 0; i < prog->nrules; i++)
+        prog->rules[i].val = map[prog->rules[i].val];
+    free(prog->code);
+    prog->code = new;
+    prog->ncode = k;
+    free(map);
+    free(ends);
+    free(cmap);
+    return 1;
+}
+
+/*
+    Move each instruction i to map[i] and drop those with map[i] ==
+    map[i+1], pointing the operands that are addresses, and the rules, at
+    the new places.
+*/
+static void squeeze(MetaProg *prog, int *map)
+{
+    int i;
+    MInstr *code, w;
+
+    code = prog->code;
+    for (i = 0; i < prog->ncode; i++) {
+        w = code[i];
+        if (map[i] == map[i+1])
+            continue;
+        switch (M_OP(w)) {
+        case OP_ALT:
+            if (M_ARG(w) == ALT_NONE)
+                break;
+            /* fall through */
+        case OP_CLL:
+        case OP_TCL:
+        case OP_B:
+        case OP_BT:
+        case OP_BF:
+        case OP_ADR:
+        case OP_SCR:
+            w = M_INSTR(M_OP(w), map[M_ARG(w)]);
+            break;
+        }
+        code[map[i]] = w;
+    }
+    for (i = 0; i < prog->nrules; i++)
+        prog->rules[i].val = map[prog->rules[i].val];
+    prog->ncode = map[prog->ncode];
+}
+
+/*
+    Rewrite the program to only check its input: the instructions that make
+    output (CL, CI, GN1, GN2, LB, OUT, POS and those meta_inline() made of them)
+    are dropped, so that meta_check() and meta_bt_check() can run it with
+    none of the output state. Whether the input is accepted, and where a
+    syntax error is found, doesn't change.
+*/
+void meta_strip(MetaProg *prog)
+{
+    int i, k, *map;
+    MInstr *code;
+
+    code = prog->code;
+    map = malloc(sizeof(int)*(prog->ncode+1));
+    for (i = k = 0; i < prog->ncode; i++) {
+        map[i] = k;
+        switch (M_OP(code[i])) {
+        case OP_CL:
+        case OP_CI:
+        case OP_GN1:
+        case OP_GN2:
+        case OP_GNI1:
+        case OP_GNI2:
+        case OP_INL:
+        case OP_LB:
+        case OP_OUT:
+        case OP_POS:
+            break;
+        default:
+            ++k;
+        }
+    }
+    map[prog->ncode] = k;
+    squeeze(prog, map);
+    prog->stripped = 1;
+    free(map);
+}
+
+/*
+    Drop the ALTs, which only the backtracking machine needs, so that the
+    plain machine doesn't spend a dispatch on each one. As with
+    meta_inline(), the result is for the plain machine only.
+*/
+void meta_drop_alts(MetaProg *prog)
+{
+    int i, k, *map;
+
+    map = malloc(sizeof(int)*(prog->ncode+1));
+    for (i = k = 0; i < prog->ncode; i++) {
+        map[i] = k;
+        if (M_OP(prog->code[i]) != OP_ALT)
+            ++k;
+    }
+    map[prog->ncode] = k;
+    squeeze(prog, map);
+    free(map);
+}
+
+/*
+    Profiles. After meta_profile() meta_execute() counts how many times
+    each instruction is executed and each branch is taken (with none of the
+    speculative results of meta_execute_parallel()). meta_profile_save()
+    adds those counts to a profile file. The file is text: a header
+
+        M2PROF <# of instructions> <SHA-256 of the loaded program>
+
+    followed by `<address> <# executed> <# taken>' for every instruction
+    that was executed. meta_layout() lays a program out by a profile and
+    meta_lines() adds its counts up by source line.
+*/
+#define PROF_MAGIC      "M2PROF"
+
+static void prog_digest(MetaProg *prog, unsigned char digest[32])
+{
+    Sha256 c;
+
+    sha256_init(&c);
+    sha256_feed(&c, prog->code, (long)sizeof(MInstr)*prog->ncode);
+    sha256_feed(&c, prog->pool, (long)sizeof(int)*prog->poolsiz);
+    sha256_feed(&c, prog->shapes, (long)sizeof(prog->shapes[0])*prog->nshapes);
+    sha256_end(&c, digest);
+}
+
+void meta_profile(MetaProg *prog)
+{
+    if (prog->prof == NULL)
+        prog->prof = calloc(prog->ncode?prog->ncode:1, sizeof(MetaCount));
+}
+
+/*
+    Add the counts of the profile at path, which must be one of a program
+    of ncode instructions with the given hash, to prof. If missing_ok is
+    set a missing file is an empty profile.
+*/
+static int read_profile(char *path, int ncode, unsigned char digest[32], MetaCount *prof, int missing_ok)
+{
+    int i, addr, n;
+    char magic[8], hex[2*32+1], want[2*32+1];
+    unsigned long long cnt, taken;
+    FILE *fp;
+
+    if ((fp=fopen(path, "r")) == NULL) {
+        if (missing_ok && errno==ENOENT)
+            return 1;
+        fprintf(stderr, "%s: cannot read profile `%s'\n", prog_name, path);
+        return 0;
+    }
+    for (i = 0; i < 32; i++)
+        sprintf(want+2*i, "%02x", digest[i]);
+    if (fscanf(fp, "%7s %d %64s", magic, &n, hex)!=3 || strcmp(magic, PROF_MAGIC)!=0) {
+        fprintf(stderr, "%s: `%s' is not a profile\n", prog_name, path);
+        fclose(fp);
+        return 0;
+    }
+    if (n!=ncode || strcmp(hex, want)!=0) {
+        fprintf(stderr, "%s: profile `%s' is for another program\n", prog_name, path);
+        fclose(fp);
+        return 0;
+    }
+    while (fscanf(fp, "%d %llu %llu", &addr, &cnt, &taken) == 3) {
+        if (addr<0 || addr>=ncode || taken>cnt)
+            break;
+        prof[addr].n += cnt;
+        prof[addr].taken += taken;
+    }
+    if (!feof(fp)) {
+        fprintf(stderr, "%s: profile `%s' is corrupt\n", prog_name, path);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* add the counts since meta_profile() to the profile at path */
+int meta_profile_save(MetaProg *prog, char *path)
+{
+    int i, ok;
+    char tmp[PATH_MAX];
+    unsigned char digest[32];
+    MetaCount *all;
+    FILE *fp;
+
+    prog_digest(prog, digest);
+    all = calloc(prog->ncode?prog->ncode:1, sizeof(MetaCount));
+    if (!read_profile(path, prog->ncode, digest, all, 1)) {
+        free(all);
+        return 0;
+    }
+    ok = 0;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path)<(int)sizeof(tmp) && (fp=fopen(tmp, "w"))!=NULL) {
+        fprintf(fp, "%s %d ", PROF_MAGIC, prog->ncode);
+        for (i = 0; i < 32; i++)
+            fprintf(fp, "%02x", digest[i]);
+        fprintf(fp, "\n");
+        for (i = 0; i < prog->ncode; i++) {
+            all[i].n += prog->prof[i].n;
+            all[i].taken += prog->prof[i].taken;
+            if (all[i].n > 0)
+                fprintf(fp, "%d %llu %llu\n", i, all[i].n, all[i].taken);
+        }
+        ok = fclose(fp)==0 && rename(tmp, path)==0;
+        if (!ok)
+            unlink(tmp);
+    }
+    if (!ok)
+        fprintf(stderr, "%s: cannot write profile `%s'\n", prog_name, path);
+    free(all);
+    return ok;
+}
+
+/*
+    Profile-guided layout. The code is cut into segments at its named
+    labels (rules and classes) and the segments into basic blocks. The
+    rules go in order of how many times they were called and, within a
+    rule, each block is followed by the more frequent of its successors,
+    inverting BT and BF and adding B's as needed; blocks never executed and
+    rules never called go after the rest, in their old order. A class is
+    kept right before the code that followed it, as it ends where the CLS
+    instructions end. ALTs are dropped: as with meta_inline(), the result
+    is for the plain machine only.
+*/
+typedef struct Block Block;
+struct Block {
+    int start, end;     /* its instructions */
+    int seg;            /* first block of its segment */
+    int placed;
+    int lab;            /* # of its generated label in the output, or 0 */
+    int nexits;         /* branches that end it in the output */
+    int exit_op[2], exit_to[2];
+};
+
+typedef struct SegKey SegKey;
+struct SegKey {
+    unsigned long long n;   /* # of calls */
+    int b;                  /* first block */
+};
+
+static int by_calls(const void *a, const void *b)
+{
+    const SegKey *x = a, *y = b;
+
+    if (x->n != y->n)
+        return x->n<y->n ? 1 : -1;
+    return (x->b>y->b)-(x->b<y->b);
+}
+
+/* the branch, R or END that ends b, or -1 if it falls through */
+static int block_end(IRec *ins, Block *b)
+{
+    int i;
+
+    for (i = b->end-1; i>=b->start && ins[i].opcode==OP_ALT; i--)
+        ;
+    if (i < b->start)
+        return -1;
+    switch (ins[i].opcode) {
+    case OP_B:
+    case OP_BT:
+    case OP_BF:
+    case OP_R:
+    case OP_END:
+        return i;
+    }
+    return -1;
+}
+
+/* the unplaced executed block of segment seg to put after b, or -1 */
+static int next_block(IRec *ins, Block *bl, int nb, int *at, MetaCount *prof, int b)
+{
+    int i, k, f, t, best;
+    unsigned long long wf, wt, n;
+
+    k = block_end(ins, &bl[b]);
+    f = t = -1;
+    wf = wt = 0;
+    if (k == -1) {
+        f = at[bl[b].end];
+        wf = prof[bl[b].end-1].n;
+    } else if (ins[k].opcode == OP_B) {
+        t = at[ins[k].arg.loc];
+        wt = prof[k].n;
+    } else if (ins[k].opcode==OP_BT || ins[k].opcode==OP_BF) {
+        f = at[bl[b].end];
+        t = at[ins[k].arg.loc];
+        wf = prof[k].n-prof[k].taken;
+        wt = prof[k].taken;
+    }
+#define HOT(c)  ((c)!=-1 && !bl[c].placed && bl[c].seg==bl[b].seg && prof[bl[c].start].n>0)
+    if (HOT(t) && (wt>wf || !HOT(f)))
+        return t;
+    if (HOT(f))
+        return f;
+#undef HOT
+    /* or else the hottest one left */
+    best = -1;
+    n = 0;
+    for (i = bl[b].seg; i<nb && bl[i].seg==bl[b].seg; i++) {
+        if (!bl[i].placed && prof[bl[i].start].n>n) {
+            best = i;
+            n = prof[bl[i].start].n;
+        }
+    }
+    return best;
+}
+
+static void put_target(FILE *fp, Block *bl, int *at, char **name, int addr)
+{
+    if (name[addr] != NULL)
+        fprintf(fp, " %s\n", name[addr]);
+    else
+        fprintf(fp, " L%d\n", bl[at[addr]].lab);
+}
+
+/* the label to branch to block b by */
+static void need_label(Block *bl, char **name, int b, int *nlab)
+{
+    if (name[bl[b].start]==NULL && bl[b].lab==0)
+        bl[b].lab = ++*nlab;
+}
+
+/*
+    Write the program at code_path, which must be assembly text, laid out
+    by the profile at profile_path to fp.
+*/
+int meta_layout(char *code_path, char *profile_path, FILE *fp)
+{
+    int i, j, k, b, nb, ni, nsym, nord, nlab, op, f, t, ok;
+    int *at, *ord, *segs, *symat, nsegs;
+    char *lead, **name, magic[4];
+    unsigned char digest[32];
+    MetaProg prog;
+    MetaCount *prof;
+    IRec *ins;
+    Symbol *sym;
+    SrcPos *map, mark;
+    Block *bl;
+    SegKey *keys;
+    FILE *cf;
+
+    if ((cf=fopen(code_path, "rb")) != NULL) {
+        ok = fread(magic, 1, 4, cf)!=4 || memcmp(magic, BIN_MAGIC, 4)!=0;
+        fclose(cf);
+        if (!ok) {
+            fprintf(stderr, "%s: code file `%s' is not assembly text\n", prog_name, code_path);
+            return 0;
+        }
+    }
+    if (!meta_load(&prog, code_path))
+        return 0;
+    prog_digest(&prog, digest);
+    prof = calloc(prog.ncode+1, sizeof(MetaCount));
+    ok = read_profile(profile_path, prog.ncode, digest, prof, 0);
+    meta_free(&prog);
+    if (!ok || (ins=read_program_symbols(code_path, meta_opcode_table, &ni, &sym, &nsym, &map))==NULL) {
+        free(prof);
+        return 0;
+    }
+
+    /* block leaders; bit 2: starts a segment */
+    lead = calloc(ni+1, 1);
+    name = calloc(ni+1, sizeof(char *));
+    lead[0] = 2;
+    for (i = 0; i < nsym; i++) {
+        if (!is_generated_label(sym[i].id)) {
+            lead[sym[i].val] = 2;
+            if (name[sym[i].val] == NULL)
+                name[sym[i].val] = sym[i].id;
+        }
+    }
+    for (i = 0; i < ni; i++) {
+        switch (ins[i].opcode) {
+        case OP_END:
+            lead[i] |= 2;
+            break;
+        case OP_B:
+        case OP_BT:
+        case OP_BF:
+            lead[i+1] |= 1;
+            /* fall through */
+        case OP_CLL:
+        case OP_ADR:
+        case OP_SCN:
+        case OP_SCR:
+            lead[ins[i].arg.loc] |= 1;
+            break;
+        case OP_R:
+            lead[i+1] |= 1;
+            break;
+        }
+    }
+
+    bl = malloc(sizeof(Block)*(ni?ni:1));
+    at = malloc(sizeof(int)*(ni+1));
+    segs = malloc(sizeof(int)*(ni?ni:1));
+    for (i = 0; i <= ni; i++)
+        at[i] = -1;
+    nb = nsegs = 0;
+    for (i = 0; i < ni; i = j) {
+        for (j = i+1; j<ni && !lead[j]; j++)
+            ;
+        memset(&bl[nb], 0, sizeof(Block));
+        bl[nb].start = i;
+        bl[nb].end = j;
+        if (lead[i] & 2)
+            segs[nsegs++] = nb;
+        bl[nb].seg = segs[nsegs-1];
+        at[i] = nb++;
+    }
+
+    /* the ADR, then the rules called, hottest first, then the rest */
+    ord = malloc(sizeof(int)*(nb?nb:1));
+    nord = 0;
+    for (i = 0; i<nb && bl[i].seg==0; i++) {
+        bl[i].placed = 1;
+        ord[nord++] = i;
+    }
+    keys = malloc(sizeof(SegKey)*(nsegs?nsegs:1));
+    for (i = 0; i < nsegs; i++) {
+        keys[i].n = prof[bl[segs[i]].start].n;
+        keys[i].b = segs[i];
+    }
+    if (nsegs > 1)
+        qsort(keys+1, nsegs-1, sizeof(SegKey), by_calls);
+    for (i = 0; i < nsegs; i++)
+        segs[i] = keys[i].b;
+    free(keys);
+    for (i = 1; i<nsegs && prof[bl[segs[i]].start].n>0; i++) {
+        for (b = segs[i]; b>0 && !bl[b-1].placed && ins[bl[b-1].start].opcode==OP_CLS; b--)
+            ;
+        for (; b < segs[i]; b++) {
+            bl[b].placed = 1;
+            ord[nord++] = b;
+        }
+        for (; b != -1; b = next_block(ins, bl, nb, at, prof, b)) {
+            bl[b].placed = 1;
+            ord[nord++] = b;
+        }
+    }
+    for (i = 0; i < nb; i++) {
+        if (!bl[i].placed) {
+            bl[i].placed = 1;
+            ord[nord++] = i;
+        }
+    }
+
+    /* how each block ends now */
+    nlab = 0;
+    for (i = 0; i < nord; i++) {
+        b = ord[i];
+        k = block_end(ins, &bl[b]);
+        op = k==-1 ? -1 : ins[k].opcode;
+        f = at[bl[b].end];
+        t = op==OP_B || op==OP_BT || op==OP_BF ? at[ins[k].arg.loc] : -1;
+        j = i+1<nord ? ord[i+1] : -1;
+        if (op==OP_BT || op==OP_BF) {
+            if (j==t && f!=-1) {
+                bl[b].exit_op[bl[b].nexits] = op==OP_BT ? OP_BF : OP_BT;
+                bl[b].exit_to[bl[b].nexits++] = f;
+                f = -1;
+            } else {
+                bl[b].exit_op[bl[b].nexits] = op;
+                bl[b].exit_to[bl[b].nexits++] = t;
+            }
+        } else if (op == OP_B) {
+            f = t;
+        } else if (op==OP_R || op==OP_END) {
+            f = -1;
+        }
+        if (f!=-1 && f!=j) {
+            bl[b].exit_op[bl[b].nexits] = OP_B;
+            bl[b].exit_to[bl[b].nexits++] = f;
+        }
+        for (j = 0; j < bl[b].nexits; j++)
+            need_label(bl, name, bl[b].exit_to[j], &nlab);
+        for (j = bl[b].start; j < bl[b].end; j++)
+            if (meta_opcode_table[ins[j].opcode].arg_kind==ARG_ID && ins[j].opcode!=OP_ALT)
+                need_label(bl, name, at[ins[j].arg.loc], &nlab);
+    }
+
+    /* write it out */
+    symat = malloc(sizeof(int)*(ni+1));
+    for (i = 0; i <= ni; i++)
+        symat[i] = -1;
+    for (i = nsym-1; i >= 0; i--)
+        symat[sym[i].val] = i;
+    mark.line = mark.col = 0;
+    for (i = 0; i < nord; i++) {
+        b = ord[i];
+        for (j = symat[bl[b].start]; j>=0 && j<nsym && sym[j].val==bl[b].start; j++)
+            if (!is_generated_label(sym[j].id))
+                fprintf(fp, "%s\n", sym[j].id);
+        if (bl[b].lab != 0)
+            fprintf(fp, "L%d\n", bl[b].lab);
+        k = block_end(ins, &bl[b]);
+        for (j = bl[b].start; j < bl[b].end; j++) {
+            op = ins[j].opcode;
+            if (op==OP_ALT || j==k && (op==OP_B || op==OP_BT || op==OP_BF))
+                continue;
+            if (map!=NULL && (map[j].line!=mark.line || map[j].col!=mark.col)) {
+                mark = map[j];
+                fprintf(fp, "\t#%d:%d\n", mark.line, mark.col);
+            }
+            fprintf(fp, "\t%s", meta_opcode_table[op].mne);
+            if (meta_opcode_table[op].arg_kind == ARG_STR)
+                fprintf(fp, " '%s'\n", ins[j].arg.str);
+            else if (meta_opcode_table[op].arg_kind == ARG_ID)
+                put_target(fp, bl, at, name, ins[j].arg.loc);
+            else
+                fprintf(fp, "\n");
+        }
+        for (j = 0; j < bl[b].nexits; j++) {
+            fprintf(fp, "\t%s", meta_opcode_table[bl[b].exit_op[j]].mne);
+            put_target(fp, bl, at, name, bl[bl[b].exit_to[j]].start);
+        }
+    }
+    ok = fflush(fp) == 0;
+
+    free(symat);
+    free(ord);
+    free(segs);
+    free(at);
+    free(bl);
+    free(name);
+    free(lead);
+    free(prof);
+    free(map);
+    free_symbols(sym, nsym);
+    free_program(ins, ni, meta_opcode_table);
+    return ok;
+}
+
+/*
+    Write the counts of the profile at profile_path for the program at
+    code_path, which must be assembly text with marks (see asm.c), added up
+    by source line to fp; with the text of the lines if src_path, the
+    source the code was compiled from, is not NULL.
+*/
+int meta_lines(char *code_path, char *profile_path, char *src_path, FILE *fp)
+{
+    int i, ni, ok;
+    long len;
+    char *src, magic[4];
+    unsigned char digest[32];
+    unsigned long long *counts;
+    MetaProg prog;
+    MetaCount *prof;
+    IRec *ins;
+    SrcPos *map;
+    FILE *cf;
+
+    if ((cf=fopen(code_path, "rb")) != NULL) {
+        ok = fread(magic, 1, 4, cf)!=4 || memcmp(magic, BIN_MAGIC, 4)!=0;
+        fclose(cf);
+        if (!ok) {
+            fprintf(stderr, "%s: code file `%s' is not assembly text\n", prog_name, code_path);
+            return 0;
+        }
+    }
+    if (!meta_load(&prog, code_path))
+        return 0;
+    prog_digest(&prog, digest);
+    prof = calloc(prog.ncode+1, sizeof(MetaCount));
+    ok = read_profile(profile_path, prog.ncode, digest, prof, 0);
+    meta_free(&prog);
+    if (!ok || (ins=read_program_symbols(code_path, meta_opcode_table, &ni, NULL, NULL, &map))==NULL) {
+        free(prof);
+        return 0;
+    }
+    src = NULL;
+    if (src_path!=NULL && (src=read_file(src_path, &len))==NULL)
+        fprintf(stderr, "%s: cannot read source file `%s'\n", prog_name, src_path);
+    if (map == NULL)
+        fprintf(stderr, "%s: code file `%s' has no marks: counting by address\n", prog_name, code_path);
+    counts = malloc(sizeof(counts[0])*(ni?ni:1));
+    for (i = 0; i < ni; i++)
+        counts[i] = prof[i].n;
+    print_by_line(fp, map, ni, counts, "executed", src);
+    ok = fflush(fp) == 0;
+
+    free(counts);
+    free(src);
+    free(map);
+    free(prof);
+    free_program(ins, ni, meta_opcode_table);
+    return ok;
+}
+
+void meta_free(MetaProg *prog)
+{
+    free(prog->code);
+    free(prog->pool);
+    free(prog->shapes);
+    free_symbols(prog->rules, prog->nrules);
+    free(prog->prof);
+    memset(prog, 0, sizeof(*prog));
+}
+
+/* message for a status other than META_OK and META_MORE */
+char *meta_strerror(int status)
+{
+    switch (status) {
+    case META_SYNTAX_ERROR:
+        return "syntax error";
+    case META_TOO_DEEP:
+        return "rules or alternatives nested too deeply";
+    case META_STEP_LIMIT:
+        return "instruction limit reached";
+    case META_TIME_LIMIT:
+        return "time limit reached";
+    case META_OUTPUT_LIMIT:
+        return "output limit reached";
+    default:
+        return "unknown error";
+    }
+}
+
+void meta_out_init(MetaOut *out, FILE *fp)
+{
+    out->siz = 256;
+    out->buf = malloc(out->siz);
+    out->pos = 0;
+    out->fp = fp;
+    out->w = NULL;
+    out->put = NULL;
+    out->arg = NULL;
+    out->events = 0;
+    out->nout = 0;
+}
+
+#define SINK(out)   ((out)->fp!=NULL || (out)->w!=NULL || (out)->put!=NULL)
+
+static void out_sink(MetaOut *out, char *s, int n)
+{
+    int phase;
+
+    if (out->put != NULL) {     /* not output yet; the taker accounts for it */
+        out->nout += n;
+        out->put(out->arg, s, n);
+        return;
+    }
+    phase = stats_phase(PH_OUTPUT);
+    out->nout += n;
+    stats_add(ST_BYTES_OUT, (unsigned long long)n);
+    if (out->w != NULL)
+        writer_write(out->w, s, n);
+    else
+        fwrite(s, 1, n, out->fp);
+    stats_phase(phase);
+}
+
+void meta_flush(MetaOut *out)
+{
+    if (!SINK(out) || out->pos==0)
+        return;
+    out_sink(out, out->buf, out->pos);
+    out->pos = 0;
+}
+
+static void out_write(MetaOut *out, char *s, int n)
+{
+    if (out->pos+n > out->siz) {
+        if (SINK(out)) {
+            meta_flush(out);
+            if (n > out->siz) {
+                out_sink(out, s, n);
+                return;
+            }
+        } else {
+            out->siz = out->siz*2+n;
+            out->buf = realloc(out->buf, out->siz);
+            assert(out->buf != NULL);
+        }
+    }
+    memcpy(out->buf+out->pos, s, n);
+    out->pos += n;
+}
+
+/* append to the output without writing it out: a failure may take it back */
+static void out_put(MetaOut *out, char *s, int n)
+{
+    if (out->pos+n > out->siz) {
+        out->siz = out->siz*2+n;
+        out->buf = realloc(out->buf, out->siz);
+        assert(out->buf != NULL);
+    }
+    memcpy(out->buf+out->pos, s, n);
+    out->pos += n;
+}
+
+/* write out the first n bytes of the output */
+static void out_commit(MetaOut *out, int n)
+{
+    out_sink(out, out->buf, n);
+    memmove(out->buf, out->buf+n, out->pos-n);
+    out->pos -= n;
+}
+
+static void out_label(MetaOut *out, int lab)
+{
+    char labbuf[32];
+
+    out_write(out, labbuf, sprintf(labbuf, "L%d", lab));
+}
+
+static void out_num(MetaOut *out, unsigned v)
+{
+    int n;
+    char buf[5];
+
+    for (n = 0; v >= 0x80; v >>= 7)
+        buf[n++] = (char)(v&0x7F|0x80);
+    buf[n++] = (char)v;
+    out_write(out, buf, n);
+}
+
+static void out_event(MetaOut *out, int tag, int nargs, unsigned a, unsigned b, unsigned c)
+{
+    char t;
+
+    t = (char)tag;
+    out_write(out, &t, 1);
+    if (nargs > 0)
+        out_num(out, a);
+    if (nargs > 1)
+        out_num(out, b);
+    if (nargs > 2)
+        out_num(out, c);
+}
+
+static void out_event_header(MetaProg *prog, MetaOut *out)
+{
+    int i, pos;
+    char version;
+    Lit *lp;
+
+    version = EV_VERSION;
+    out_write(out, EV_MAGIC, 4);
+    out_write(out, &version, 1);
+    out_num(out, prog->nliterals);
+    for (pos = 0; pos < prog->poolsiz; pos += LITSIZ(lp->len)) {   /* in id order */
+        lp = (Lit *)(prog->pool+pos);
+        out_num(out, lp->len);
+        out_write(out, lp->s, lp->len);
+    }
+    out_num(out, prog->nrules);
+    for (i = 0; i < prog->nrules; i++) {
+        out_num(out, prog->rules[i].val);
+        out_num(out, (unsigned)strlen(prog->rules[i].id));
+        out_write(out, prog->rules[i].id, (int)strlen(prog->rules[i].id));
+    }
+}
+
+/* the column of s, from 1; col0 chars of its line come before input */
+static int column(char *input, char *s, int col0)
+{
+    char *t;
+
+    for (t = s; t>input && t[-1]!='\n'; t--)
+        ;
+    return (int)(s-t)+(t==input?col0:0)+1;
+}
+
+static char *skip_white(char *s, int *line_counter)
+{
+    while (*s!='\0' && isspace(*s)) {
+        if (*s == '\n')
+            ++*line_counter;
+        ++s;
+    }
+    return s;
+}
+
+/* the end of the token at s, whose first char has been checked */
+static char *scan_id(char *s)
+{
+    for (++s; isalnum(*s); s++)
+        ;
+    return s;
+}
+
+static char *scan_num(char *s)
+{
+    for (++s; isdigit(*s); s++)
+        ;
+    return s;
+}
+
+/* stops at the closing quote if there's one */
+static char *scan_sr(char *s)
+{
+    for (++s; *s!='\'' && *s!='\0' && *s!='\n'; s++)
+        ;
+    return s;
+}
+
+/* what's left of a run's limits (see MetaLimits) */
+typedef struct Budget Budget;
+struct Budget {
+    unsigned long long check_at;    /* instruction count of the next check */
+    long long out_base;             /* output produced before the run */
+    struct timespec deadline;
+    int maxdepth;                   /* deepest frame allowed */
+};
+
+static void budget_next(Budget *b, MetaLimits *lim, unsigned long long icount)
+{
+    b->check_at = ULLONG_MAX;
+    if (lim->msecs>0 || lim->output>0)
+        b->check_at = icount+CHECKSTEPS;
+    if (lim->steps>0 && lim->steps<b->check_at)
+        b->check_at = lim->steps+1;
+}
+
+static void budget_start(Budget *b, MetaLimits *lim, MetaOut *out)
+{
+    b->out_base = out->nout+out->pos;
+    if (lim->msecs > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &b->deadline);
+        b->deadline.tv_sec += lim->msecs/1000;
+        b->deadline.tv_nsec += lim->msecs%1000*1000000;
+        if (b->deadline.tv_nsec >= 1000000000) {
+            b->deadline.tv_nsec -= 1000000000;
+            ++b->deadline.tv_sec;
+        }
+    }
+    b->maxdepth = (lim->depth>0 && lim->depth<MAXFRAMES-1) ? lim->depth : MAXFRAMES-1;
+    budget_next(b, lim, 0);
+}
+
+/* whether a run must check any of lim but the depth */
+static int limited(MetaLimits *lim)
+{
+    return lim->steps>0 || lim->msecs>0 || lim->output>0;
+}
+
+/* called once icount reaches b->check_at */
+static int budget_check(Budget *b, MetaLimits *lim, unsigned long long icount, MetaOut *out)
+{
+    struct timespec now;
+
+    if (lim->steps>0 && icount>lim->steps)
+        return META_STEP_LIMIT;
+    if (lim->output>0 && out->nout+out->pos-b->out_base>lim->output)
+        return META_OUTPUT_LIMIT;
+    if (lim->msecs > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec>b->deadline.tv_sec
+        || now.tv_sec==b->deadline.tv_sec && now.tv_nsec>=b->deadline.tv_nsec)
+            return META_TIME_LIMIT;
+    }
+    budget_next(b, lim, icount);
+    return META_OK;
+}
+
+typedef struct Frame Frame;
+struct Frame {
+    int lab1, lab2;
+    int ilab1, ilab2;   /* of the rule copied in by meta_inline() being run */
+    int ret_addr;
+};
+
+/* machine registers that outlive one execute() call */
+typedef struct State State;
+struct State {
+    char *input, *pos;
+    char *end;          /* the NUL after the input */
+    char *tok;          /* last token: toklen chars at tok */
+    int toklen;
+    int res, labcnt, indent, line_counter;
+    int ip;
+    Frame frames[MAXFRAMES];
+    int top_frame;
+    char *more;         /* end of the input so far if more may follow */
+    unsigned base;      /* offset of input in the whole input */
+    int col0;           /* # of chars of the line of input[0] before it */
+    unsigned long long icount;  /* # of instructions executed */
+    unsigned long long ncalls, ntails;  /* # of CLLs and TCLs executed */
+    int maxtop;                 /* deepest frame */
+    Budget budget;
+};
+
+/* get st ready to run the rule at start */
+static void state_start(State *st, int start)
+{
+    st->ip = start;
+    st->res = 1;
+    st->top_frame = 0;
+    st->frames[0].lab1 = -1;
+    st->frames[0].lab2 = -1;
+    st->more = NULL;
+    st->base = 0;
+    st->col0 = 0;
+}
+
+typedef struct Inv Inv;
+typedef struct Chunk Chunk;
+typedef struct Spec Spec;
+
+/*
+    Speculative parallel runs. The input is cut after occurrences of a
+    separator and, for every piece but the first, a thread repeatedly calls
+    the split rule from the start of the piece as the `$ RULE' loop of the
+    sequential run would, recording each invocation. When the sequential run
+    calls the rule at an offset where a recorded invocation started with the
+    same state, it takes the recorded result instead of executing the rule.
+    A wrong guess just doesn't match and that part is parsed sequentially.
+*/
+struct Inv {
+    int start, end;             /* input offsets */
+    int res;
+    int indent_in, indent_out;
+    int tok_dep;                /* output depends on the token before start or on the line */
+    int tok, toklen;            /* token upon exit; tok == -1: untouched */
+    int lines, nlab, labbase;
+    int depth;                  /* # of frames used */
+    int out_pos, out_len;
+    int mark, nmarks;
+};
+
+struct Chunk {
+    int start, end;
+    Inv *invs;
+    int ninvs, maxinvs;
+    MetaOut out;
+    struct {
+        int pos;                /* of the `L' */
+        int val;
+    } *marks;
+    int nmarks, maxmarks;
+    int tok_dep, depth;         /* of the invocation being recorded */
+    int started, done;
+    Spec *spec;
+    pthread_t tid;
+};
+
+struct Spec {
+    MetaProg *prog;
+    char *input;
+    int len;
+    int rule;
+    Chunk *chunks;
+    int nchunks;
+    int cancel;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+static int execute_all(MetaProg *prog, State *st, MetaOut *out, Spec *spec, Chunk *ck);
+
+static void chunk_mark(Chunk *ck, int pos, int val)
+{
+    if (ck->nmarks >= ck->maxmarks) {
+        ck->maxmarks = ck->maxmarks?ck->maxmarks*2:64;
+        ck->marks = realloc(ck->marks, sizeof(ck->marks[0])*ck->maxmarks);
+        assert(ck->marks != NULL);
+    }
+    ck->marks[ck->nmarks].pos = pos;
+    ck->marks[ck->nmarks++].val = val;
+}
+
+static int cancelled(Spec *spec)
+{
+    int c;
+
+    pthread_mutex_lock(&spec->lock);
+    c = spec->cancel;
+    pthread_mutex_unlock(&spec->lock);
+    return c;
+}
+
+static void *chunk_run(void *arg)
+{
+    Chunk *ck;
+    Spec *spec;
+    Inv *iv;
+    State st;
+
+    ck = arg;
+    spec = ck->spec;
+    st.input = spec->input;
+    st.end = st.input+spec->len;
+    st.pos = st.input+ck->start;
+    st.indent = 1;
+    st.labcnt = 1;
+    st.line_counter = 0;
+    st.icount = 0;
+    st.ncalls = st.ntails = 0;
+    st.maxtop = 0;
+    budget_start(&st.budget, &spec->prog->limits, &ck->out);
+    while (!cancelled(spec)) {
+        if (ck->ninvs >= ck->maxinvs) {
+            ck->maxinvs = ck->maxinvs?ck->maxinvs*2:64;
+            ck->invs = realloc(ck->invs, sizeof(Inv)*ck->maxinvs);
+            assert(ck->invs != NULL);
+        }
+        iv = &ck->invs[ck->ninvs];
+        iv->start = (int)(st.pos-st.input);
+        iv->indent_in = st.indent;
+        iv->labbase = st.labcnt;
+        iv->lines = st.line_counter;
+        iv->out_pos = ck->out.pos;
+        iv->mark = ck->nmarks;
+        st.tok = NULL;
+        st.toklen = 0;
+        ck->tok_dep = 0;
+        ck->depth = 0;
+        state_start(&st, spec->rule);
+        if (execute_all(spec->prog, &st, &ck->out, NULL, ck) != META_OK)
+            break;
+        iv->end = (int)(st.pos-st.input);
+        iv->res = st.res;
+        iv->indent_out = st.indent;
+        iv->tok_dep = ck->tok_dep;
+        iv->tok = st.tok!=NULL?(int)(st.tok-st.input):-1;
+        iv->toklen = st.toklen;
+        iv->lines = st.line_counter-iv->lines;
+        iv->nlab = st.labcnt-iv->labbase;
+        iv->depth = ck->depth;
+        iv->out_len = ck->out.pos-iv->out_pos;
+        iv->nmarks = ck->nmarks-iv->mark;
+        ++ck->ninvs;
+        if (!st.res || iv->end>=ck->end || iv->end==iv->start)
+            break;
+    }
+    stats_add(ST_STEPS, st.icount);
+    stats_add(ST_CALLS, st.ncalls);
+    stats_add(ST_TAILCALLS, st.ntails);
+    stats_max(ST_DEPTH, (unsigned long long)st.maxtop+1);
+    pthread_mutex_lock(&spec->lock);
+    ck->done = 1;
+    pthread_cond_broadcast(&spec->done);
+    pthread_mutex_unlock(&spec->lock);
+    return NULL;
+}
+
+/* find a recorded invocation of the split rule starting at off */
+static Inv *spec_lookup(Spec *spec, int off, Chunk **ckp)
+{
+    int lo, hi, mid;
+    Chunk *ck;
+
+    for (lo = 1, hi = spec->nchunks-1; lo <= hi; ) {
+        mid = (lo+hi)/2;
+        if (spec->chunks[mid].start <= off)
+            lo = mid+1;
+        else
+            hi = mid-1;
+    }
+    if (hi < 1)
+        return NULL;
+    ck = &spec->chunks[hi];
+    pthread_mutex_lock(&spec->lock);
+    while (!ck->done)
+        pthread_cond_wait(&spec->done, &spec->lock);
+    pthread_mutex_unlock(&spec->lock);
+    for (lo = 0, hi = ck->ninvs-1; lo <= hi; ) {
+        mid = (lo+hi)/2;
+        if (ck->invs[mid].start == off) {
+            *ckp = ck;
+            return &ck->invs[mid];
+        } else if (ck->invs[mid].start < off) {
+            lo = mid+1;
+        } else {
+            hi = mid-1;
+        }
+    }
+    return NULL;
+}
+
+/* emit the output of a recorded invocation with its labels renumbered */
+static void spec_replay(Chunk *ck, Inv *iv, MetaOut *out, int labcnt)
+{
+    int i, prev, val;
+    char labbuf[32];
+
+    prev = iv->out_pos;
+    for (i = iv->mark; i < iv->mark+iv->nmarks; i++) {
+        out_write(out, ck->out.buf+prev, ck->marks[i].pos-prev);
+        val = ck->marks[i].val;
+        out_label(out, labcnt+val-iv->labbase);
+        prev = ck->marks[i].pos+sprintf(labbuf, "L%d", val);
+    }
+    out_write(out, ck->out.buf+prev, iv->out_pos+iv->out_len-prev);
+}
+
+#define OFF(p)  ((unsigned)((p)-input)+base)
+
+/*
+    The plain machine comes without the features a run may not need, and
+    with all of them for the runs that do (see limited()).
+*/
+#define POLICY      POLICY_NONE
+#define EXECUTE     execute
+#include "meta_exec.h"
+
+#define POLICY      POLICY_NONE
+#define FEED        1
+#define EVENTS      1
+#define PARALLEL    1
+#define LIMITS      1
+#define EXECUTE     execute_all
+#include "meta_exec.h"
+
+#define POLICY      POLICY_NONE
+#define CHECK       1
+#define EXECUTE     execute_check
+#include "meta_exec.h"
+
+#define POLICY      POLICY_NONE
+#define CHECK       1
+#define LIMITS      1
+#define EXECUTE     execute_check_limits
+#include "meta_exec.h"
+
+#define POLICY      POLICY_NONE
+#define PROFILE     1
+#define EVENTS      1
+#define PARALLEL    1
+#define LIMITS      1
+#define EXECUTE     execute_profile
+#include "meta_exec.h"
+
+/*
+    Backtracking runs. The state upon entry to every rule invocation and
+    alternative is saved so that a failure can go back to it; see
+    meta_exec.h.
+*/
+typedef struct BtFrame BtFrame;
+typedef struct Choice Choice;
+typedef struct LabMark LabMark;
+typedef struct Memo Memo;
+typedef struct BtRegs BtRegs;
+typedef struct Resume Resume;
+typedef struct AltJob AltJob;
+typedef struct AltSet AltSet;
+typedef struct AltPool AltPool;
+
+struct BtFrame {
+    int lab1, lab2;
+    int ret_addr;
+    int nchoices;       /* # of pending alternatives upon entry */
+    /* state upon entry */
+    char *in_pos;
+    int out_pos;
+    char *tok;
+    int toklen;
+    int line_counter, labcnt, indent;
+    int nmarks;
+    unsigned long long t0;
+    /* POLICY_MEMO */
+    char *hwm;
+    int tok_set;        /* the token was set by this invocation */
+    int tok_dep;        /* output depends on the token upon entry */
+    int pos_dep;        /* output has input positions (POS): not kept */
+    /* POLICY_BACKTRACK */
+    AltSet *alts;       /* alternatives of the body run ahead; see meta_bt_spec() */
+};
+
+/* state upon entry to an alternative */
+struct Choice {
+    MInstr *alt;        /* its ALT */
+    MInstr *next;       /* where the next alternative (or the end of the choice) starts */
+    char *in_pos;
+    int out_pos;
+    char *tok;
+    int toklen;
+    int line_counter, labcnt, indent;
+    int lab1, lab2;
+    int nmarks;
+    int tok_set;
+    unsigned long long t0;
+};
+
+/* BtFrame and Choice of a run of a program stripped by meta_strip() */
+typedef struct CkFrame CkFrame;
+typedef struct CkChoice CkChoice;
+
+struct CkFrame {
+    int ret_addr;
+    int nchoices;
+    char *in_pos;
+    int line_counter;
+    unsigned long long t0;
+};
+
+struct CkChoice {
+    MInstr *alt;
+    MInstr *next;
+    char *in_pos;
+    int line_counter;
+    unsigned long long t0;
+};
+
+/* position of a generated label number in the output */
+struct LabMark {
+    int pos, len;
+    int val;
+};
+
+/*
+    Result of a rule invocation. Offsets are relative to the invocation's
+    start so that the entry doesn't change when it is moved by an edit.
+*/
+struct Memo {
+    int loc;            /* rule address */
+    int indent;         /* indent upon entry */
+    char *tok_in;       /* token upon entry if the output depends on it */
+    int tok_inlen;
+    int res;
+    int len;            /* # of input chars consumed */
+    int ext;            /* # of input chars examined */
+    int lines;          /* # of newlines consumed */
+    int nlab;           /* # of labels generated */
+    int lab_base;       /* labcnt upon entry when the entry was recorded */
+    int indent_out;
+    int tok_out;        /* token upon exit; -1 if left untouched */
+    int tok_outlen;
+    char *out;
+    int nout;
+    LabMark *marks;     /* positions relative to out, values to labcnt */
+    int nmarks;
+    Memo *next;
+};
+
+struct MetaBt {
+    MetaProg *prog;
+    MetaOut *out;
+    char *input;
+    int len, siz;
+    int line_counter, pos;      /* where the last run stopped */
+    unsigned long long icount;  /* # of instructions executed in the last run */
+    Budget budget;
+    /* incremental mode */
+    Memo **tab;                 /* one chain per input offset, including EOF */
+    int max_ext;
+    LabMark *marks;             /* of the label numbers in the output */
+    int nmarks, maxmarks;
+    /* token cache (see meta_bt_lex()) */
+    unsigned short *lex;        /* one entry per input offset */
+    size_t lexsiz;              /* bytes mapped for lex */
+    unsigned long long scanned, cached;     /* input chars of the last run */
+    /* trace mode */
+    FILE *trace;
+    TraceRec *trbuf;
+    int ntrace;
+    /* checkpoints */
+    char *ckpt;                 /* file to write them to */
+    long ckpt_secs;             /* how often */
+    time_t ckpt_due;
+    unsigned long long ckpt_at; /* icount at which to look at the clock again */
+    unsigned char prog_hash[32], input_hash[32];
+    int hashed;                 /* prog_hash and input_hash are set */
+    Resume *resume;             /* where the next run starts from */
+    /* alternatives run ahead */
+    AltPool *pool;
+    AltJob *job;                /* the one a worker's MetaBt runs */
+};
+
+static void bt_label_number(MetaBt *bt, int val, int mark)
+{
+    int n;
+    char labbuf[32];
+
+    n = sprintf(labbuf, "%d", val);
+    if (mark) {
+        if (bt->nmarks >= bt->maxmarks) {
+            bt->maxmarks = bt->maxmarks?bt->maxmarks*2:64;
+            bt->marks = realloc(bt->marks, sizeof(LabMark)*bt->maxmarks);
+            assert(bt->marks != NULL);
+        }
+        bt->marks[bt->nmarks].pos = bt->out->pos;
+        bt->marks[bt->nmarks].len = n;
+        bt->marks[bt->nmarks].val = val;
+        ++bt->nmarks;
+    }
+    out_put(bt->out, labbuf, n);
+}
+
+static void bt_label(MetaBt *bt, int val, int mark)
+{
+    out_put(bt->out, "L", 1);
+    bt_label_number(bt, val, mark);
+}
+
+static void put64(FILE *fp, unsigned long long v)
+{
+    put32(fp, (int)(unsigned)v);
+    put32(fp, (int)(unsigned)(v>>32));
+}
+
+static void trace_flush(MetaBt *bt)
+{
+    int i;
+    TraceRec *r;
+
+    for (i = 0, r = bt->trbuf; i < bt->ntrace; i++, r++) {
+        put32(bt->trace, (int)r->rule);
+        put32(bt->trace, (int)r->start);
+        put32(bt->trace, (int)r->fail);
+        put32(bt->trace, (int)r->discarded);
+        put32(bt->trace, (int)r->depth);
+        put64(bt->trace, r->t0);
+        put64(bt->trace, r->t1);
+    }
+    bt->ntrace = 0;
+}
+
+static void trace_record(MetaBt *bt, unsigned rule, int start, int fail, int discarded, int depth,
+                         unsigned long long t0)
+{
+    TraceRec *r;
+
+    if (bt->ntrace == TRACEBUFSIZ)
+        trace_flush(bt);
+    r = &bt->trbuf[bt->ntrace++];
+    r->rule = rule;
+    r->start = (unsigned)start;
+    r->fail = (unsigned)fail;
+    r->discarded = (unsigned)discarded;
+    r->depth = (unsigned)depth;
+    r->t0 = t0;
+    r->t1 = bt->icount;
+}
+
+static void memo_free(Memo *m)
+{
+    free(m->tok_in);
+    free(m->out);
+    free(m->marks);
+    free(m);
+}
+
+static Memo *memo_lookup(MetaBt *bt, int loc, char *pos, int indent, char *tok, int toklen)
+{
+    Memo *m;
+
+    for (m = bt->tab[pos-bt->input]; m != NULL; m = m->next)
+        if (m->loc==loc && m->indent==indent
+        && (m->tok_in==NULL || m->tok_inlen==toklen && memcmp(m->tok_in, tok, toklen)==0))
+            break;
+    return m;
+}
+
+static void memo_store(MetaBt *bt, BtFrame *f, int loc, int res, char *pos, char *tok, int toklen,
+                       int line_counter, int labcnt, int indent, char *hwm)
+{
+    int i;
+    Memo *m;
+    LabMark *lm;
+
+    if (f->pos_dep)     /* an edit before it may move the positions */
+        return;
+    m = malloc(sizeof(*m));
+    m->loc = loc;
+    m->indent = f->indent;
+    m->tok_in = NULL;
+    m->tok_inlen = f->toklen;
+    if (f->tok_dep) {
+        m->tok_in = malloc(f->toklen+1);
+        memcpy(m->tok_in, f->tok, f->toklen);
+    }
+    m->res = res;
+    m->len = (int)(pos-f->in_pos);
+    m->ext = (int)(hwm-f->in_pos);
+    m->lines = line_counter-f->line_counter;
+    m->nlab = labcnt-f->labcnt;
+    m->lab_base = f->labcnt;
+    m->indent_out = indent;
+    m->tok_out = f->tok_set ? (int)(tok-f->in_pos) : -1;
+    m->tok_outlen = toklen;
+    m->nout = bt->out->pos-f->out_pos;
+    m->out = malloc(m->nout);
+    memcpy(m->out, bt->out->buf+f->out_pos, m->nout);
+    m->nmarks = bt->nmarks-f->nmarks;
+    m->marks = malloc(sizeof(LabMark)*m->nmarks);
+    for (i = 0, lm = &bt->marks[f->nmarks]; i < m->nmarks; i++, lm++) {
+        m->marks[i].pos = lm->pos-f->out_pos;
+        m->marks[i].len = lm->len;
+        m->marks[i].val = lm->val-f->labcnt;
+    }
+    m->next = bt->tab[f->in_pos-bt->input];
+    bt->tab[f->in_pos-bt->input] = m;
+    if (m->ext > bt->max_ext)
+        bt->max_ext = m->ext;
+}
+
+/*
+    Emit the output of m with labels renumbered from labcnt. The label marks
+    are only needed when the replay is nested inside an invocation that will
+    be recorded itself.
+*/
+static void memo_replay(MetaBt *bt, Memo *m, int labcnt, int nested)
+{
+    int i, n, prev;
+    char labbuf[32];
+
+    if (labcnt==m->lab_base && !nested) {
+        out_put(bt->out, m->out, m->nout);
+        return;
+    }
+    for (i = prev = 0; i < m->nmarks; i++) {
+        out_put(bt->out, m->out+prev, m->marks[i].pos-prev);
+        if (nested) {
+            bt_label_number(bt, labcnt+m->marks[i].val, 1);
+        } else {
+            n = sprintf(labbuf, "%d", labcnt+m->marks[i].val);
+            out_put(bt->out, labbuf, n);
+        }
+        prev = m->marks[i].pos+m->marks[i].len;
+    }
+    out_put(bt->out, m->out+prev, m->nout-prev);
+}
+
+/*
+    Token cache (see meta_bt_lex()). Backtracking goes over the same input
+    again and again; what the scanners find at an offset is kept in bt->lex
+    so that the second time round it takes a lookup. Whether an entry is
+    about white space or a token follows from the char at its offset:
+
+        white space     LEX_WHITE(n, nl): skip n chars, nl of them newlines;
+                        n is at most 255, a longer run takes several entries
+        ID, NUM, SR     length of the token + 1, if it starts with the right
+                        char for its kind; SR's length is up to the closing
+                        quote, or to where it stopped without one
+
+    0 means not scanned yet.
+*/
+#define LEX_WHITE(n, nl)    ((unsigned short)((n)<<8 | (nl)))
+#define LEX_MAXWHITE        255
+#define LEX_MAXTOKEN        0xFFFE
+
+/*
+    Make room for n entries, zeroed. The table is twice as big as the input;
+    it is mapped rather than allocated so that the kernel can back it with
+    huge pages, as the page faults of filling it otherwise cost more than
+    the scans it saves.
+*/
+static int lex_alloc(MetaBt *bt, int n)
+{
+    size_t siz;
+    void *p;
+
+    siz = sizeof(unsigned short)*(size_t)n;
+    p = mmap(NULL, siz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return 0;
+#ifdef MADV_HUGEPAGE
+    madvise(p, siz, MADV_HUGEPAGE);
+#endif
+    if (bt->lex != NULL) {
+        memcpy(p, bt->lex, bt->lexsiz<siz?bt->lexsiz:siz);
+        munmap(bt->lex, bt->lexsiz);
+    }
+    bt->lex = p;
+    bt->lexsiz = siz;
+    return 1;
+}
+
+static char *lex_skip(MetaBt *bt, char *s, int *line_counter)
+{
+    unsigned short *e;
+    int n, nl;
+
+    if (!isspace(*s))
+        return s;
+    do {
+        e = &bt->lex[s-bt->input];
+        if (*e != 0) {
+            n = *e>>8;
+            nl = *e&0xFF;
+            bt->cached += n;
+        } else {
+            for (n = nl = 0; n<LEX_MAXWHITE && isspace(s[n]); n++)
+                nl += s[n]=='\n';
+            bt->scanned += n;
+            *e = LEX_WHITE(n, nl);
+        }
+        *line_counter += nl;
+        s += n;
+    } while (n==LEX_MAXWHITE && isspace(*s));
+    return s;
+}
+
+/* the end of the token at s as found by scan */
+static char *lex_token(MetaBt *bt, char *s, char *(*scan)(char *))
+{
+    unsigned short *e;
+    char *t;
+
+    e = &bt->lex[s-bt->input];
+    if (*e != 0) {
+        bt->cached += *e-1;
+        return s+*e-1;
+    }
+    t = scan(s);
+    bt->scanned += t-s;
+    if (t-s <= LEX_MAXTOKEN)
+        *e = (unsigned short)(t-s+1);
+    return t;
+}
+
+/* drop the entries that looked at offset off or past it */
+static void lex_forget(MetaBt *bt, int off)
+{
+    int i, ext;
+    unsigned short e;
+
+    if (bt->lex == NULL)
+        return;
+    for (i = off>LEX_MAXTOKEN?off-LEX_MAXTOKEN-1:0; i < off; i++) {
+        if ((e=bt->lex[i]) == 0)
+            continue;
+        ext = isspace(bt->input[i]) ? e>>8 : e-1;
+        if (i+ext >= off)
+            bt->lex[i] = 0;
+    }
+}
+
+/*
+    Checkpoints (see meta_bt_checkpoint()). A backtracking run can be
+    stopped and picked up again wherever no pending alternative can take it
+    back past that point, which is checked at ALT and CLL: the rule
+    invocations still open can only fail back to their entry states, and
+    those are offsets into the input and output.
+
+    Checkpoint file:
+        "M2CK" version
+        program hash (32 bytes) input hash (32 bytes)
+        icount:64 nout:64
+        ip res labcnt indent line_counter pos tok toklen top_frame
+        lab1 lab2                                               frame 0
+        { lab1 lab2 ret_addr in_pos out_pos tok toklen
+          line_counter labcnt indent t0:64 }...                 frames 1..top_frame
+        nbuf { chars }                                          output not yet written out
+    Numbers are 32-bit little-endian unless marked :64. nout is how much
+    output had been written out; the output held back follows.
+*/
+#define CKPT_MAGIC      "M2CK"
+#define CKPT_VERSION    1
+#define CKPTSTEPS       (1<<20)     /* # of instructions between looks at the clock */
+
+/* registers of a backtracking run; offsets are into the input */
+struct BtRegs {
+    int ip, res, labcnt, indent, line_counter;
+    int pos, tok, toklen;
+    int top_frame;
+};
+
+struct Resume {
+    BtRegs regs;
+    unsigned long long icount;
+    BtFrame frames[MAXFRAMES];
+};
+
+static int get64(FILE *fp, unsigned long long *v)
+{
+    int lo, hi;
+
+    if (!get32(fp, &lo) || !get32(fp, &hi))
+        return 0;
+    *v = (unsigned long long)(unsigned)lo | (unsigned long long)(unsigned)hi<<32;
+    return 1;
+}
+
+/* identify the program and the input a checkpoint is good for */
+static void ckpt_hashes(MetaBt *bt, unsigned char prog_hash[32], unsigned char input_hash[32])
+{
+    Sha256 c;
+
+    prog_digest(bt->prog, prog_hash);
+    sha256_init(&c);
+    sha256_feed(&c, bt->input, bt->len);
+    sha256_end(&c, input_hash);
+}
+
+/*
+    Called at a safe point once icount reaches bt->ckpt_at: if a checkpoint
+    is due, write out the output no failure can take back any more, then
+    the checkpoint, to a temporary file that replaces the last one once it
+    and the output are on disk.
+*/
+static void bt_checkpoint(MetaBt *bt, BtRegs *r, BtFrame *frames)
+{
+    int i, n, ok;
+    char tmp[PATH_MAX];
+    FILE *fp;
+    MetaOut *out;
+    BtFrame *f;
+
+    bt->ckpt_at = bt->icount+CKPTSTEPS;
+    if (time(NULL) < bt->ckpt_due)
+        return;
+    bt->ckpt_due = time(NULL)+bt->ckpt_secs;
+
+    out = bt->out;
+    n = r->top_frame>0 ? frames[1].out_pos : out->pos;
+    if (n > 0) {
+        out_commit(out, n);
+        for (i = 1; i <= r->top_frame; i++)
+            frames[i].out_pos -= n;
+    }
+    if (out->fp!=NULL && (fflush(out->fp)!=0 || fsync(fileno(out->fp))!=0 && errno!=EINVAL))
+        return;
+
+    if (!bt->hashed) {
+        ckpt_hashes(bt, bt->prog_hash, bt->input_hash);
+        bt->hashed = 1;
+    }
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", bt->ckpt) >= (int)sizeof(tmp)
+    || (fp=fopen(tmp, "wb")) == NULL)
+        return;
+    fwrite(CKPT_MAGIC, 1, 4, fp);
+    put32(fp, CKPT_VERSION);
+    fwrite(bt->prog_hash, 1, 32, fp);
+    fwrite(bt->input_hash, 1, 32, fp);
+    put64(fp, bt->icount);
+    put64(fp, (unsigned long long)out->nout);
+    put32(fp, r->ip);
+    put32(fp, r->res);
+    put32(fp, r->labcnt);
+    put32(fp, r->indent);
+    put32(fp, r->line_counter);
+    put32(fp, r->pos);
+    put32(fp, r->tok);
+    put32(fp, r->toklen);
+    put32(fp, r->top_frame);
+    put32(fp, frames[0].lab1);
+    put32(fp, frames[0].lab2);
+    for (i = 1; i <= r->top_frame; i++) {
+        f = &frames[i];
+        put32(fp, f->lab1);
+        put32(fp, f->lab2);
+        put32(fp, f->ret_addr);
+        put32(fp, (int)(f->in_pos-bt->input));
+        put32(fp, f->out_pos);
+        put32(fp, (int)(f->tok-bt->input));
+        put32(fp, f->toklen);
+        put32(fp, f->line_counter);
+        put32(fp, f->labcnt);
+        put32(fp, f->indent);
+        put64(fp, f->t0);
+    }
+    put32(fp, out->pos);
+    fwrite(out->buf, 1, out->pos, fp);
+    ok = fflush(fp)==0 && fsync(fileno(fp))==0;
+    if (fclose(fp)!=0 || !ok || rename(tmp, bt->ckpt)!=0)
+        unlink(tmp);
+}
+
+/*
+    Write a checkpoint to path every secs seconds, or as soon after as the
+    run gets to a safe point. Only for runs without memoization whose output
+    goes to a file stream.
+*/
+int meta_bt_checkpoint(MetaBt *bt, char *path, long secs)
+{
+    if (bt->tab!=NULL || bt->out->w!=NULL || bt->out->put!=NULL)
+        return 0;
+    bt->ckpt = path;
+    bt->ckpt_secs = secs;
+    bt->ckpt_due = time(NULL)+secs;
+    bt->ckpt_at = CKPTSTEPS;
+    return 1;
+}
+
+/*
+    Have the next run start from the checkpoint at path. It must have been
+    written for the same program and input. The output, a regular file,
+    is cut back to what had been written out then and what was held back
+    is put back. Return 0 with a message if that can't be done.
+*/
+int meta_bt_resume(MetaBt *bt, char *path)
+{
+    int i, ok, n, version, off;
+    unsigned long long nout;
+    char magic[4], *buf;
+    unsigned char prog_hash[32], input_hash[32];
+    FILE *fp;
+    Resume *rs;
+    BtRegs *r;
+    BtFrame *f;
+    struct stat sb;
+
+    if ((fp=fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "%s: cannot read checkpoint file `%s'\n", prog_name, path);
+        return 0;
+    }
+    rs = calloc(1, sizeof(*rs));
+    r = &rs->regs;
+    buf = NULL;
+    ok = fread(magic, 1, 4, fp)==4 && memcmp(magic, CKPT_MAGIC, 4)==0
+      && get32(fp, &version) && version==CKPT_VERSION
+      && fread(prog_hash, 1, 32, fp)==32 && fread(input_hash, 1, 32, fp)==32;
+    if (ok) {
+        if (!bt->hashed) {
+            ckpt_hashes(bt, bt->prog_hash, bt->input_hash);
+            bt->hashed = 1;
+        }
+        if (memcmp(bt->prog_hash, prog_hash, 32)!=0 || memcmp(bt->input_hash, input_hash, 32)!=0) {
+            fprintf(stderr, "%s: checkpoint file `%s' is for another %s\n", prog_name, path,
+                    memcmp(bt->prog_hash, prog_hash, 32)!=0 ? "program" : "input");
+            fclose(fp);
+            goto fail;
+        }
+    }
+    ok = ok && get64(fp, &rs->icount) && get64(fp, &nout)
+      && get32(fp, &r->ip) && get32(fp, &r->res) && get32(fp, &r->labcnt)
+      && get32(fp, &r->indent) && get32(fp, &r->line_counter)
+      && get32(fp, &r->pos) && get32(fp, &r->tok) && get32(fp, &r->toklen)
+      && get32(fp, &r->top_frame)
+      && r->ip>=0 && r->ip<bt->prog->ncode && r->pos>=0 && r->pos<=bt->len
+      && r->tok>=0 && r->toklen>=0 && r->tok+r->toklen<=bt->len
+      && r->top_frame>=0 && r->top_frame<MAXFRAMES
+      && get32(fp, &rs->frames[0].lab1) && get32(fp, &rs->frames[0].lab2);
+    for (i = 1; ok && i <= r->top_frame; i++) {
+        f = &rs->frames[i];
+        ok = get32(fp, &f->lab1) && get32(fp, &f->lab2) && get32(fp, &f->ret_addr)
+          && get32(fp, &off) && off>=0 && off<=bt->len
+          && (f->in_pos=bt->input+off, get32(fp, &f->out_pos))
+          && get32(fp, &off) && off>=0 && off<=bt->len
+          && (f->tok=bt->input+off, get32(fp, &f->toklen))
+          && get32(fp, &f->line_counter) && get32(fp, &f->labcnt) && get32(fp, &f->indent)
+          && get64(fp, &f->t0)
+          && f->ret_addr>0 && f->ret_addr<bt->prog->ncode;
+    }
+    ok = ok && get32(fp, &n) && n>=0;
+    if (ok) {
+        buf = malloc(n?n:1);
+        ok = fread(buf, 1, n, fp) == (size_t)n;
+    }
+    fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "%s: checkpoint file `%s' is corrupt\n", prog_name, path);
+        goto fail;
+    }
+    if (bt->out->fp==NULL || fstat(fileno(bt->out->fp), &sb)!=0 || !S_ISREG(sb.st_mode)
+    || (unsigned long long)sb.st_size<nout) {
+        fprintf(stderr, "%s: output to resume must be the file being written (append to it with >>)\n",
+                prog_name);
+        goto fail;
+    }
+    fflush(bt->out->fp);
+    if (ftruncate(fileno(bt->out->fp), (off_t)nout)!=0
+    || fseeko(bt->out->fp, (off_t)nout, SEEK_SET)!=0) {
+        fprintf(stderr, "%s: cannot cut the output back\n", prog_name);
+        goto fail;
+    }
+    bt->out->nout = (long long)nout;
+    bt->out->pos = 0;
+    out_put(bt->out, buf, n);
+    free(buf);
+    for (i = 1; i <= r->top_frame; i++)
+        rs->frames[i].nchoices = 0;
+    free(bt->resume);
+    bt->resume = rs;
+    return 1;
+fail:
+    free(buf);
+    free(rs);
+    return 0;
+}
+
+/*
+    Alternatives run ahead (see meta_bt_spec()). When a run enters a marked
+    rule, the alternatives of its body after the first are queued for a pool
+    of threads. Each is run from the state upon entry to the body on a
+    MetaBt of its own, with frame 0 standing for the rule's frame, its own
+    output buffer and what's left of the frames and choices, up to where it
+    ends: the BT before the next alternative, or the rule's R for the last
+    one. Meanwhile the run tries the first alternative itself. When it gets
+    to a later one in the very state that one was started from, as it does
+    when the ones before it failed by backtracking, it takes its result
+    instead of running it: the registers and the output are those the run
+    would have had there. One not picked up yet is run by the run itself,
+    and those still running when the rule returns are cancelled.
+*/
+#define ALT_CANCELLED   (-1)    /* status of a run stopped by alt_stop() */
+
+enum {
+    ALT_QUEUED,
+    ALT_RUNNING,
+    ALT_DONE
+};
+
+struct AltJob {
+    MInstr *alt;                /* its ALT */
+    MInstr *stop;               /* where it ends; NULL: at R */
+    BtRegs in;                  /* registers upon entry */
+    int lab1, lab2;             /* of the rule's frame upon entry */
+    int maxdepth, maxchoices;   /* left by the run */
+    int state;
+    int status;
+    BtRegs regs;                /* upon exit */
+    int lab1_out, lab2_out;
+    unsigned long long icount;  /* # of instructions that would have run in its place */
+    MetaOut out;
+    atomic_int cancel;
+    AltSet *set;
+    AltJob *next;               /* in the queue */
+};
+
+/* the alternatives run ahead for a rule invocation */
+struct AltSet {
+    AltJob *jobs;
+    int njobs;
+};
+
+struct AltPool {
+    unsigned char *marked;      /* per instruction: the first ALT of a marked rule */
+    pthread_t *tids;
+    int nthreads;
+    AltJob *head, *tail;
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+};
+
+static int execute_bt_spec(MetaBt *bt);
+
+/* the ALT of the alternative after the one at alt, NULL if it's the last */
+static MInstr *alt_next(MetaProg *prog, MInstr *alt)
+{
+    int next;
+
+    next = M_ARG(*alt);
+    if (next==ALT_NONE || next+1>=prog->ncode
+    || M_OP(prog->code[next])!=OP_BT || M_OP(prog->code[next+1])!=OP_ALT)
+        return NULL;
+    return &prog->code[next+1];
+}
+
+/* queue the alternatives after the one at alt of a marked rule's body */
+static AltSet *alt_start(MetaBt *bt, MInstr *alt, BtRegs *r, BtFrame *f, int top_choice)
+{
+    int i, n;
+    MInstr *a;
+    AltSet *s;
+    AltJob *job;
+    AltPool *pool;
+
+    for (n = 0, a = alt_next(bt->prog, alt); a != NULL; a = alt_next(bt->prog, a))
+        ++n;
+    s = malloc(sizeof(*s));
+    s->jobs = calloc(n, sizeof(AltJob));
+    s->njobs = n;
+    for (i = 0, a = alt_next(bt->prog, alt); i < n; i++, a = alt_next(bt->prog, a)) {
+        job = &s->jobs[i];
+        job->alt = a;
+        job->stop = M_ARG(*a)!=ALT_NONE ? &bt->prog->code[M_ARG(*a)] : NULL;
+        job->in = *r;
+        job->lab1 = f->lab1;
+        job->lab2 = f->lab2;
+        job->maxdepth = bt->budget.maxdepth-r->top_frame;
+        job->maxchoices = MAXCHOICES-top_choice;
+        meta_out_init(&job->out, NULL);
+        job->set = s;
+    }
+    pool = bt->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < n; i++) {
+        if (pool->tail != NULL)
+            pool->tail->next = &s->jobs[i];
+        else
+            pool->head = &s->jobs[i];
+        pool->tail = &s->jobs[i];
+    }
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    stats_add(ST_AHEAD, (unsigned long long)n);
+    return s;
+}
+
+/* take the queued jobs of s off the queue; called with the lock held */
+static void alt_unqueue(AltPool *pool, AltSet *s)
+{
+    AltJob *job, **pj;
+
+    pool->tail = NULL;
+    for (pj = &pool->head; (job=*pj) != NULL; ) {
+        if (job->set == s) {
+            if (job->state == ALT_QUEUED) {
+                job->state = ALT_DONE;
+                job->status = ALT_CANCELLED;
+            }
+            *pj = job->next;
+        } else {
+            pool->tail = job;
+            pj = &job->next;
+        }
+    }
+}
+
+/*
+    The alternative at alt of s if it was run ahead from the state r and f
+    are in and the run may take its result, else NULL.
+*/
+static AltJob *alt_take(MetaBt *bt, AltSet *s, MInstr *alt, BtRegs *r, BtFrame *f)
+{
+    int i;
+    AltJob *job;
+    AltPool *pool;
+    MetaLimits *lim;
+
+    for (i = 0; i<s->njobs && s->jobs[i].alt!=alt; i++)
+        ;
+    if (i == s->njobs)
+        return NULL;
+    job = &s->jobs[i];
+    if (job->in.pos!=r->pos || job->in.tok!=r->tok || job->in.toklen!=r->toklen
+    || job->in.line_counter!=r->line_counter || job->in.labcnt!=r->labcnt
+    || job->in.indent!=r->indent || job->lab1!=f->lab1 || job->lab2!=f->lab2)
+        return NULL;
+    pool = bt->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (job->state == ALT_QUEUED) {
+        /* quicker to run it here than to wait for a thread; alt_stop() unqueues it */
+        job->state = ALT_DONE;
+        job->status = ALT_CANCELLED;
+    }
+    while (job->state != ALT_DONE)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    lim = &bt->prog->limits;
+    if (job->status!=META_OK && job->status!=META_SYNTAX_ERROR
+    || lim->steps>0 && bt->icount+job->icount>lim->steps)
+        return NULL;
+    stats_add(ST_TAKEN, 1);
+    return job;
+}
+
+/* cancel what's left of s and free it */
+static void alt_stop(MetaBt *bt, AltSet *s)
+{
+    int i;
+    AltPool *pool;
+
+    pool = bt->pool;
+    pthread_mutex_lock(&pool->lock);
+    alt_unqueue(pool, s);
+    for (i = 0; i < s->njobs; i++)
+        if (s->jobs[i].state == ALT_RUNNING)
+            atomic_store_explicit(&s->jobs[i].cancel, 1, memory_order_relaxed);
+    for (i = 0; i < s->njobs; i++)
+        while (s->jobs[i].state != ALT_DONE)
+            pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < s->njobs; i++)
+        free(s->jobs[i].out.buf);
+    free(s->jobs);
+    free(s);
+}
+
+static void *alt_worker(void *arg)
+{
+    MetaBt *bt, *wbt;
+    AltPool *pool;
+    AltJob *job;
+
+    bt = arg;
+    pool = bt->pool;
+    wbt = calloc(1, sizeof(*wbt));
+    wbt->prog = bt->prog;
+    wbt->ckpt_at = ULLONG_MAX;
+    wbt->budget.check_at = ULLONG_MAX;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->head==NULL && !pool->quit)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->quit)
+            break;
+        job = pool->head;
+        if ((pool->head=job->next) == NULL)
+            pool->tail = NULL;
+        if (job->state != ALT_QUEUED)
+            continue;
+        job->state = ALT_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+        wbt->input = bt->input;
+        wbt->len = bt->len;
+        wbt->out = &job->out;
+        wbt->job = job;
+        wbt->budget.maxdepth = job->maxdepth;
+        job->status = execute_bt_spec(wbt);
+        /* not counting the ALT nor the R it stopped at, which the run executes */
+        job->icount = wbt->icount-1-(job->stop==NULL && job->status==META_OK);
+        pthread_mutex_lock(&pool->lock);
+        job->state = ALT_DONE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(wbt);
+    return NULL;
+}
+
+#define POLICY      POLICY_BACKTRACK
+#define EXECUTE     execute_bt
+#include "meta_exec.h"
+
+#define POLICY      POLICY_BACKTRACK
+#define LEXCACHE    1
+#define EXECUTE     execute_bt_lex
+#include "meta_exec.h"
+
+#define POLICY      POLICY_BACKTRACK
+#define SPEC        1
+#define EXECUTE     execute_bt_spec
+#include "meta_exec.h"
+
+#define POLICY      POLICY_BACKTRACK
+#define CHECK       1
+#define EXECUTE     execute_bt_check
+#include "meta_exec.h"
+
+#define POLICY      POLICY_BACKTRACK
+#define LEXCACHE    1
+#define CHECK       1
+#define EXECUTE     execute_bt_lex_check
+#include "meta_exec.h"
+
+#define POLICY      POLICY_MEMO
+#define EXECUTE     execute_memo
+#include "meta_exec.h"
+
+#define POLICY      POLICY_MEMO
+#define LEXCACHE    1
+#define EXECUTE     execute_memo_lex
+#include "meta_exec.h"
+
+/*
+    Backtracking machine over a copy of input. With memoize set the result
+    of every rule invocation is kept, so that runs after meta_bt_edit() only
+    execute the rules that looked at an edited part of the input. Output is
+    written out as it becomes final when out has a sink and memoize is not
+    set; otherwise it stays in out->buf.
+*/
+MetaBt *meta_bt_new(MetaProg *prog, MetaOut *out, char *input, int len, int memoize)
+{
+    MetaBt *bt;
+
+    bt = calloc(1, sizeof(*bt));
+    bt->prog = prog;
+    bt->out = out;
+    bt->len = len;
+    bt->siz = len+1;
+    bt->input = malloc(bt->siz);
+    memcpy(bt->input, input, len);
+    bt->input[len] = '\0';
+    if (memoize)
+        bt->tab = calloc(bt->siz, sizeof(Memo *));
+    bt->ckpt_at = ULLONG_MAX;
+    return bt;
+}
+
+/*
+    Keep a token cache from now on, filled as the runs go or, with prepass
+    set, now for the whole input. Return 0 if there's no room for it.
+*/
+int meta_bt_lex(MetaBt *bt, int prepass)
+{
+    enum { WHITE = 1, ALPHA = 2, DIGIT = 4, STOP = 8 };
+    int i, white, nl, alnum, digits, stop;
+    unsigned char c, cls[256];
+    unsigned short *e;
+
+    if (bt->lex==NULL && !lex_alloc(bt, bt->siz))
+        return 0;
+    if (!prepass)
+        return 1;
+    for (i = 0; i < 256; i++)
+        cls[i] = (unsigned char)((isspace(i)?WHITE:0) | (isalpha(i)?ALPHA:0) | (isdigit(i)?DIGIT:0)
+                                 | (i=='\'' || i=='\n' || i=='\0' ? STOP : 0));
+    /* length of the run of each starting at i+1 */
+    white = alnum = digits = 0;
+    nl = 0;                 /* newlines in the first LEX_MAXWHITE of white */
+    stop = bt->len;         /* first quote, newline or NUL after i */
+    for (i = bt->len-1; i >= 0; i--) {
+        c = (unsigned char)bt->input[i];
+        e = &bt->lex[i];
+        if (cls[c] & WHITE) {
+            nl += c=='\n';
+            if (white >= LEX_MAXWHITE)
+                nl -= bt->input[i+LEX_MAXWHITE]=='\n';
+            ++white;
+            *e = LEX_WHITE(white<LEX_MAXWHITE?white:LEX_MAXWHITE, nl);
+            alnum = digits = 0;
+        } else {
+            white = nl = 0;
+            if (cls[c] & (ALPHA|DIGIT)) {
+                ++alnum;
+                digits = cls[c]&DIGIT ? digits+1 : 0;
+            } else {
+                alnum = digits = 0;
+            }
+            if ((cls[c]&ALPHA) && alnum<=LEX_MAXTOKEN)
+                *e = (unsigned short)(alnum+1);
+            else if ((cls[c]&DIGIT) && digits<=LEX_MAXTOKEN)
+                *e = (unsigned short)(digits+1);
+            else if (c=='\'' && stop-i<=LEX_MAXTOKEN)
+                *e = (unsigned short)(stop-i+1);
+            else
+                *e = 0;
+        }
+        if (cls[c] & STOP)
+            stop = i;
+    }
+    return 1;
+}
+
+/*
+    Have runs try the alternatives of the body of the rule at address rule
+    after the first on nthreads-1 threads while they try the first one (see
+    alt_start()). The output is the same. The threads are started by the
+    first call. Return 0 if the body has a single alternative. Not with
+    memoize, a trace, checkpoints or meta_bt_check().
+*/
+int meta_bt_spec(MetaBt *bt, int rule, int nthreads)
+{
+    int i;
+    AltPool *pool;
+
+    if (M_OP(bt->prog->code[rule])!=OP_ALT || alt_next(bt->prog, &bt->prog->code[rule])==NULL)
+        return 0;
+    if ((pool=bt->pool) == NULL) {
+        pool = bt->pool = calloc(1, sizeof(*pool));
+        pool->marked = calloc(bt->prog->ncode, 1);
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        pool->tids = malloc(sizeof(pthread_t)*(nthreads>1?nthreads-1:1));
+        for (i = 0; i < nthreads-1; i++)
+            if (pthread_create(&pool->tids[pool->nthreads], NULL, alt_worker, bt) == 0)
+                ++pool->nthreads;
+    }
+    pool->marked[rule] = 1;
+    return 1;
+}
+
+/* record every failure in the trace file path (see trace.h) */
+int meta_bt_trace(MetaBt *bt, char *path)
+{
+    int i;
+    MetaProg *prog;
+
+    if ((bt->trace=fopen(path, "wb")) == NULL) {
+        fprintf(stderr, "%s: cannot write trace file `%s'\n", prog_name, path);
+        return 0;
+    }
+    bt->trbuf = malloc(sizeof(TraceRec)*TRACEBUFSIZ);
+    prog = bt->prog;
+    fwrite(TR_MAGIC, 1, 4, bt->trace);
+    put32(bt->trace, TR_VERSION);
+    put32(bt->trace, prog->nrules);
+    for (i = 0; i < prog->nrules; i++) {
+        put32(bt->trace, prog->rules[i].val);
+        put32(bt->trace, (int)strlen(prog->rules[i].id));
+        fwrite(prog->rules[i].id, 1, strlen(prog->rules[i].id), bt->trace);
+    }
+    return 1;
+}
+
+/*
+    Replace del chars at offset off of the input by the nins chars at ins
+    and drop the results the change may affect. Return 0 if off is out of
+    range.
+*/
+int meta_bt_edit(MetaBt *bt, int off, int del, char *ins, int nins)
+{
+    int i;
+    Memo *m, **pm;
+
+    if (off<0 || off>bt->len || del<0 || nins<0)
+        return 0;
+    if (off+del > bt->len)
+        del = bt->len-off;
+
+    if (bt->tab != NULL) {
+        /* rules started before the edit survive if they didn't look into it */
+        for (i = (off>bt->max_ext)?off-bt->max_ext:0; i < off; i++) {
+            for (pm = &bt->tab[i]; (m=*pm) != NULL; ) {
+                if (i+m->ext > off) {
+                    *pm = m->next;
+                    memo_free(m);
+                } else {
+                    pm = &m->next;
+                }
+            }
+        }
+        /* rules started inside the deleted range are gone */
+        for (i = off; i < off+del; i++) {
+            while ((m=bt->tab[i]) != NULL) {
+                bt->tab[i] = m->next;
+                memo_free(m);
+            }
+        }
+    }
+
+    lex_forget(bt, off);
+    if (bt->len-del+nins+1 > bt->siz) {
+        bt->siz = (bt->len-del+nins+1)*2;
+        bt->input = realloc(bt->input, bt->siz);
+        assert(bt->input != NULL);
+        if (bt->lex!=NULL && !lex_alloc(bt, bt->siz)) {
+            munmap(bt->lex, bt->lexsiz);
+            bt->lex = NULL;
+        }
+        if (bt->tab != NULL) {
+            bt->tab = realloc(bt->tab, sizeof(Memo *)*bt->siz);
+            assert(bt->tab != NULL);
+        }
+    }
+    if (bt->tab != NULL) {
+        memmove(&bt->tab[off+nins], &bt->tab[off+del], sizeof(Memo *)*(bt->len-off-del+1));
+        memset(&bt->tab[off], 0, sizeof(Memo *)*nins);
+    }
+    if (bt->lex != NULL) {
+        memmove(&bt->lex[off+nins], &bt->lex[off+del], sizeof(unsigned short)*(bt->len-off-del+1));
+        memset(&bt->lex[off], 0, sizeof(unsigned short)*nins);
+    }
+    memmove(bt->input+off+nins, bt->input+off+del, bt->len-off-del+1);
+    memcpy(bt->input+off, ins, nins);
+    bt->len += nins-del;
+    bt->hashed = 0;
+    return 1;
+}
+
+/* run the program over the input; the output goes after what's in out */
+int meta_bt_run(MetaBt *bt, int *line_counter)
+{
+    int status;
+
+    budget_start(&bt->budget, &bt->prog->limits, bt->out);
+    if (bt->tab != NULL)
+        status = bt->lex!=NULL ? execute_memo_lex(bt) : execute_memo(bt);
+    else
+        status = bt->lex!=NULL ? execute_bt_lex(bt) : execute_bt(bt);
+    if (bt->trace != NULL)
+        trace_record(bt, TR_END, bt->len, status!=META_OK, 0, 0, 0);
+    stats_add(ST_STEPS, bt->icount);
+    stats_add(ST_SCANNED, bt->scanned);
+    stats_add(ST_CACHED, bt->cached);
+    *line_counter = bt->line_counter;
+    return status;
+}
+
+/*
+    Run a program stripped by meta_strip() over the input, not in
+    incremental mode. Nothing is written to bt's output; the offset where
+    the run stopped is set as well as its line.
+*/
+int meta_bt_check(MetaBt *bt, int *line_counter, int *offset)
+{
+    int status;
+
+    assert(bt->prog->stripped && bt->tab==NULL);
+    budget_start(&bt->budget, &bt->prog->limits, bt->out);
+    status = bt->lex!=NULL ? execute_bt_lex_check(bt) : execute_bt_check(bt);
+    if (bt->trace != NULL)
+        trace_record(bt, TR_END, bt->len, status!=META_OK, 0, 0, 0);
+    stats_add(ST_STEPS, bt->icount);
+    stats_add(ST_SCANNED, bt->scanned);
+    stats_add(ST_CACHED, bt->cached);
+    *line_counter = bt->line_counter;
+    *offset = bt->pos;
+    return status;
+}
+
+/* return 0 if writing the trace failed */
+int meta_bt_free(MetaBt *bt)
+{
+    int i, ok;
+    Memo *m;
+    AltPool *pool;
+
+    ok = 1;
+    if (bt->trace != NULL) {
+        trace_flush(bt);
+        ok = fclose(bt->trace) == 0;
+        free(bt->trbuf);
+    }
+    if (bt->tab != NULL) {
+        for (i = 0; i <= bt->len; i++) {
+            while ((m=bt->tab[i]) != NULL) {
+                bt->tab[i] = m->next;
+                memo_free(m);
+            }
+        }
+        free(bt->tab);
+    }
+    if ((pool=bt->pool) != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->quit = 1;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->nthreads; i++)
+            pthread_join(pool->tids[i], NULL);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->work);
+        pthread_cond_destroy(&pool->done);
+        free(pool->tids);
+        free(pool->marked);
+        free(pool);
+    }
+    free(bt->marks);
+    free(bt->resume);
+    if (bt->lex != NULL)
+        munmap(bt->lex, bt->lexsiz);
+    free(bt->input);
+    free(bt);
+    return ok;
+}
+
+static int run(MetaProg *prog, char *input, MetaOut *out, int *line_counter, Spec *spec)
+{
+    int status;
+    State st;
+
+    if (SINK(out) && out->siz<OUTFLUSHSIZ) {
+        out->siz = OUTFLUSHSIZ;
+        out->buf = realloc(out->buf, out->siz);
+    }
+    st.input = st.pos = st.tok = input;
+    st.end = input+strlen(input);
+    st.toklen = 0;
+    st.labcnt = 1;
+    st.indent = 1;
+    st.line_counter = 1;
+    st.icount = 0;
+    st.ncalls = st.ntails = 0;
+    st.maxtop = 0;
+    state_start(&st, M_ARG(prog->code[0]));
+    budget_start(&st.budget, &prog->limits, out);
+    if (out->events) {
+        out_event_header(prog, out);
+        out_event(out, EV_ENTER, 2, M_ARG(prog->code[0]), 0, 0);
+    }
+    if (prog->prof != NULL)
+        status = execute_profile(prog, &st, out, spec, NULL);
+    else if (spec!=NULL || out->events || limited(&prog->limits))
+        status = execute_all(prog, &st, out, spec, NULL);
+    else
+        status = execute(prog, &st, out, NULL, NULL);
+    if (out->events)
+        out_event(out, EV_END, 2, status, st.line_counter, 0);
+    stats_add(ST_STEPS, st.icount);
+    stats_add(ST_CALLS, st.ncalls);
+    stats_add(ST_TAILCALLS, st.ntails);
+    stats_max(ST_DEPTH, (unsigned long long)st.maxtop+1);
+    *line_counter = st.line_counter;
+    return status;
+}
+
+int meta_execute(MetaProg *prog, char *input, MetaOut *out, int *line_counter)
+{
+    return run(prog, input, out, line_counter, NULL);
+}
+
+/*
+    Run a program stripped by meta_strip() over input. Return the status as
+    meta_execute() would, with the line and offset where the run stopped.
+*/
+int meta_check(MetaProg *prog, char *input, int *line_counter, int *offset)
+{
+    int status;
+    State st;
+    MetaOut out;
+
+    assert(prog->stripped);
+    memset(&out, 0, sizeof(out));
+    st.input = st.pos = st.tok = input;
+    st.end = input+strlen(input);
+    st.toklen = 0;
+    st.line_counter = 1;
+    st.icount = 0;
+    st.ncalls = st.ntails = 0;
+    st.maxtop = 0;
+    state_start(&st, M_ARG(prog->code[0]));
+    budget_start(&st.budget, &prog->limits, &out);
+    if (limited(&prog->limits))
+        status = execute_check_limits(prog, &st, &out, NULL, NULL);
+    else
+        status = execute_check(prog, &st, &out, NULL, NULL);
+    stats_add(ST_STEPS, st.icount);
+    stats_add(ST_CALLS, st.ncalls);
+    stats_add(ST_TAILCALLS, st.ntails);
+    stats_max(ST_DEPTH, (unsigned long long)st.maxtop+1);
+    *line_counter = st.line_counter;
+    *offset = (int)(st.pos-input);
+    return status;
+}
+
+/*
+    Push parser: the input is passed in pieces with meta_feed() as it
+    arrives and the machine runs as far as it can on each. The output is
+    produced as it goes: written out at the end of every call to a sink,
+    left in out->buf otherwise (the caller may take it and reset out->pos).
+    Input already consumed is dropped.
+*/
+struct MetaParser {
+    MetaProg *prog;
+    MetaOut *out;
+    State st;
+    char *buf;
+    int len, siz;
+    int status;
+};
+
+MetaParser *meta_parser_new(MetaProg *prog, MetaOut *out)
+{
+    MetaParser *p;
+
+    if (SINK(out) && out->siz<OUTFLUSHSIZ) {
+        out->siz = OUTFLUSHSIZ;
+        out->buf = realloc(out->buf, out->siz);
+    }
+    p = malloc(sizeof(*p));
+    p->prog = prog;
+    p->out = out;
+    p->siz = 256;
+    p->buf = malloc(p->siz);
+    p->buf[0] = '\0';
+    p->len = 0;
+    p->st.input = p->st.pos = p->st.tok = p->st.end = p->buf;
+    p->st.toklen = 0;
+    p->st.labcnt = 1;
+    p->st.indent = 1;
+    p->st.line_counter = 1;
+    p->st.icount = 0;
+    p->st.ncalls = p->st.ntails = 0;
+    p->st.maxtop = 0;
+    state_start(&p->st, M_ARG(prog->code[0]));
+    budget_start(&p->st.budget, &prog->limits, out);
+    p->status = META_MORE;
+    if (out->events) {
+        out_event_header(prog, out);
+        out_event(out, EV_ENTER, 2, M_ARG(prog->code[0]), 0, 0);
+    }
+    return p;
+}
+
+/* append n chars to the input, dropping what the machine is done with */
+static void parser_append(MetaParser *p, char *s, int n)
+{
+    int i, keep;
+    char *buf;
+
+    keep = (int)((p->st.tok<p->st.pos ? p->st.tok : p->st.pos)-p->buf);
+    if (keep>0 && p->len+n+1>p->siz) {
+        for (i = keep; i>0 && p->buf[i-1]!='\n'; i--)
+            ;
+        p->st.col0 = i>0 ? keep-i : p->st.col0+keep;
+        memmove(p->buf, p->buf+keep, p->len-keep);
+        p->len -= keep;
+        p->st.pos -= keep;
+        p->st.tok -= keep;
+        p->st.base += keep;
+    }
+    if (p->len+n+1 > p->siz) {
+        p->siz = (p->len+n+1)*2;
+        buf = realloc(p->buf, p->siz);
+        assert(buf != NULL);
+        p->st.pos = buf+(p->st.pos-p->buf);
+        p->st.tok = buf+(p->st.tok-p->buf);
+        p->buf = buf;
+    }
+    memcpy(p->buf+p->len, s, n);
+    p->len += n;
+    p->buf[p->len] = '\0';
+    p->st.input = p->buf;
+    p->st.end = p->buf+p->len;
+}
+
+/*
+    Parse the next n chars of input. Return META_MORE as long as the machine
+    may need more, the final status otherwise (the rest of the input is then
+    ignored). A NUL char ends the input as it does for meta_execute().
+*/
+int meta_feed(MetaParser *p, char *buf, int n)
+{
+    if (p->status != META_MORE)
+        return p->status;
+    parser_append(p, buf, n);
+    p->st.more = p->buf+p->len;
+    p->status = execute_all(p->prog, &p->st, p->out, NULL, NULL);
+    meta_flush(p->out);
+    return p->status;
+}
+
+/* signal the end of the input and return the final status */
+int meta_finish(MetaParser *p, int *line_counter)
+{
+    if (p->status == META_MORE) {
+        p->st.more = NULL;
+        p->status = execute_all(p->prog, &p->st, p->out, NULL, NULL);
+    }
+    if (p->out->events)
+        out_event(p->out, EV_END, 2, p->status, p->st.line_counter, 0);
+    meta_flush(p->out);
+    stats_add(ST_STEPS, p->st.icount);
+    stats_add(ST_CALLS, p->st.ncalls);
+    stats_add(ST_TAILCALLS, p->st.ntails);
+    stats_max(ST_DEPTH, (unsigned long long)p->st.maxtop+1);
+    *line_counter = p->st.line_counter;
+    return p->status;
+}
+
+void meta_parser_free(MetaParser *p)
+{
+    free(p->buf);
+    free(p);
+}
+
+/* address of the rule called name, -1 if there's no such rule */
+int meta_rule(MetaProg *prog, char *name)
+{
+    int i;
+
+    for (i = 0; i < prog->nrules; i++)
+        if (strcmp(prog->rules[i].id, name) == 0)
+            return prog->rules[i].val;
+    return -1;
+}
+
+/*
+    Like meta_execute() but try to split the input into nchunks pieces after
+    occurrences of sep and to run the rule at address rule over them in
+    parallel. The output is the same as meta_execute()'s.
+*/
+int meta_execute_parallel(MetaProg *prog, char *input, MetaOut *out, int *line_counter,
+                          int rule, char *sep, int nchunks)
+{
+    int i, n, len, seplen, status;
+    char *p;
+    Spec spec;
+    Chunk *ck;
+
+    len = (int)strlen(input);
+    seplen = (int)strlen(sep);
+    if (out->events || nchunks<2 || seplen==0)
+        return run(prog, input, out, line_counter, NULL);
+
+    spec.prog = prog;
+    spec.input = input;
+    spec.len = len;
+    spec.rule = rule;
+    spec.cancel = 0;
+    spec.chunks = calloc(nchunks, sizeof(Chunk));
+    pthread_mutex_init(&spec.lock, NULL);
+    pthread_cond_init(&spec.done, NULL);
+    spec.chunks[0].start = 0;
+    for (i = n = 1; i < nchunks; i++) {
+        p = input+(long)len*i/nchunks;
+        if (p < input+spec.chunks[n-1].start)
+            p = input+spec.chunks[n-1].start;
+        if ((p=strstr(p, sep)) == NULL)
+            break;
+        if (p+seplen-input > spec.chunks[n-1].start)
+            spec.chunks[n++].start = (int)(p+seplen-input);
+    }
+    spec.nchunks = n;
+    for (i = 0; i < n; i++)
+        spec.chunks[i].end = (i+1<n)?spec.chunks[i+1].start:len;
+    for (i = 1; i < n; i++) {
+        ck = &spec.chunks[i];
+        ck->spec = &spec;
+        meta_out_init(&ck->out, NULL);
+        if (pthread_create(&ck->tid, NULL, chunk_run, ck) == 0)
+            ck->started = 1;
+        else
+            ck->done = 1;
+    }
+
+    status = run(prog, input, out, line_counter, &spec);
+
+    pthread_mutex_lock(&spec.lock);
+    spec.cancel = 1;
+    pthread_mutex_unlock(&spec.lock);
+    for (i = 1; i < n; i++) {
+        ck = &spec.chunks[i];
+        if (ck->started)
+            pthread_join(ck->tid, NULL);
+        free(ck->out.buf);
+        free(ck->invs);
+        free(ck->marks);
+    }
+    free(spec.chunks);
+    pthread_mutex_destroy(&spec.lock);
+    pthread_cond_destroy(&spec.done);
+    return status;
+}
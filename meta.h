@@ -0,0 +1,138 @@
+#ifndef META_H_
+#define META_H_
+
+#include <stdio.h>
+#include "asm.h"
+#include "writer.h"
+
+enum {
+    OP_TST, OP_ID, OP_NUM,
+    OP_SR, OP_CLL, OP_R,
+    OP_SET, OP_B, OP_BT,
+    OP_BF, OP_BE, OP_CL,
+    OP_CI, OP_GN1, OP_GN2,
+    OP_LB, OP_OUT, OP_ADR,
+    OP_END, OP_SCN, OP_SCR,
+    OP_CLS, OP_ALT, OP_POS,
+    /* made by meta_inline() for the plain machine; not in code files */
+    OP_TCL, OP_INL, OP_GNI1, OP_GNI2,
+};
+
+/* execution status */
+enum {
+    META_OK,
+    META_SYNTAX_ERROR,
+    META_TOO_DEEP,      /* ran out of frames or choices, or past MetaLimits.depth */
+    META_MORE,          /* meta_feed(): waiting for more input */
+    META_STEP_LIMIT,    /* executed more than MetaLimits.steps instructions */
+    META_TIME_LIMIT,    /* ran past MetaLimits.msecs */
+    META_OUTPUT_LIMIT,  /* wrote more than MetaLimits.output bytes */
+};
+
+typedef struct MetaLimits MetaLimits;
+typedef struct MetaProg MetaProg;
+typedef struct MetaOut MetaOut;
+typedef struct MetaParser MetaParser;
+typedef struct MetaBt MetaBt;
+typedef struct MetaCount MetaCount;
+
+/*
+    Loaded instructions are packed in 32 bits: the opcode in the low 8 bits
+    and the operand in the high 24. The operand is a code address or, for TST
+    and CL, the position of the literal in the string pool or, for SCN, the
+    index of its token shape.
+*/
+typedef unsigned MInstr;
+
+#define M_OP(w)         ((int)((w)&0xFF))
+#define M_ARG(w)        ((int)((w)>>8))
+#define M_INSTR(op, a)  ((MInstr)(op)|(MInstr)(a)<<8)
+#define M_MAXARG        0xFFFFFF
+
+/*
+    Resource limits of each run of a program; 0 means no limit. All but the
+    depth are checked at CLL and backward branches (time and output only
+    every so many instructions), so a run stops a little past them.
+*/
+struct MetaLimits {
+    unsigned long long steps;   /* # of instructions executed */
+    long msecs;                 /* wall-clock time */
+    long long output;           /* # of output bytes */
+    int depth;                  /* # of nested rule invocations */
+};
+
+/* profile of an instruction (see meta_profile()) */
+struct MetaCount {
+    unsigned long long n;       /* # of times executed */
+    unsigned long long taken;   /* B, BT, BF: # of times the branch was taken */
+};
+
+struct MetaProg {
+    MInstr *code;
+    int ncode;
+    int *pool;          /* interned TST/CL strings: { id, len, chars, NUL } */
+    int poolsiz;        /* in ints */
+    int nliterals;
+    unsigned char (*shapes)[256];   /* SCN char maps; see SHAPE_FIRST in meta.c */
+    int nshapes;
+    Symbol *rules;      /* names of CLL/ADR targets, sorted by address */
+    int nrules;
+    MetaLimits limits;  /* cleared by meta_load() */
+    int stripped;       /* by meta_strip() */
+    MetaCount *prof;    /* one per instruction if meta_profile() was called */
+};
+
+/*
+    Output sink. Output is accumulated in buf; when fp is not NULL the buffer
+    is written out whenever it fills up (and by meta_flush()). When events is
+    set the machine writes a binary event stream (events.h) instead of text.
+*/
+struct MetaOut {
+    char *buf;
+    int pos, siz;
+    FILE *fp;
+    Writer *w;          /* if set, written out through w instead of fp */
+    void (*put)(void *arg, char *s, int n); /* if set, handed to put instead */
+    void *arg;
+    int events;
+    long long nout;     /* # of bytes written out so far */
+};
+
+extern IDescr meta_opcode_table[];
+
+int meta_load(MetaProg *prog, char *file_path);
+int meta_save(MetaProg *prog, char *file_path);
+int meta_open(MetaProg *prog, char *file_path, char *compiler, char *cache_dir);
+char *meta_cache_dir(void);
+void meta_free(MetaProg *prog);
+int meta_execute(MetaProg *prog, char *input, MetaOut *out, int *line_counter);
+int meta_execute_parallel(MetaProg *prog, char *input, MetaOut *out, int *line_counter,
+                          int rule, char *sep, int nchunks);
+int meta_rule(MetaProg *prog, char *name);
+int meta_inline(MetaProg *prog, int maxsize, int keep);
+void meta_strip(MetaProg *prog);
+void meta_drop_alts(MetaProg *prog);
+void meta_profile(MetaProg *prog);
+int meta_profile_save(MetaProg *prog, char *path);
+int meta_layout(char *code_path, char *profile_path, FILE *fp);
+int meta_lines(char *code_path, char *profile_path, char *src_path, FILE *fp);
+int meta_check(MetaProg *prog, char *input, int *line_counter, int *offset);
+MetaParser *meta_parser_new(MetaProg *prog, MetaOut *out);
+int meta_feed(MetaParser *p, char *buf, int len);
+int meta_finish(MetaParser *p, int *line_counter);
+void meta_parser_free(MetaParser *p);
+MetaBt *meta_bt_new(MetaProg *prog, MetaOut *out, char *input, int len, int memoize);
+int meta_bt_lex(MetaBt *bt, int prepass);
+int meta_bt_spec(MetaBt *bt, int rule, int nthreads);
+int meta_bt_trace(MetaBt *bt, char *path);
+int meta_bt_checkpoint(MetaBt *bt, char *path, long secs);
+int meta_bt_resume(MetaBt *bt, char *path);
+int meta_bt_edit(MetaBt *bt, int off, int del, char *ins, int nins);
+int meta_bt_run(MetaBt *bt, int *line_counter);
+int meta_bt_check(MetaBt *bt, int *line_counter, int *offset);
+int meta_bt_free(MetaBt *bt);
+char *meta_strerror(int status);
+void meta_out_init(MetaOut *out, FILE *fp);
+void meta_flush(MetaOut *out);
+
+#endif
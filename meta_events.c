@@ -0,0 +1,174 @@
+/*
+    Convert the binary event stream of the META II machine (meta_machine -b)
+    back to the text the machine prints, or list the events (-l).
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "events.h"
+#include "meta.h"
+
+char *prog_name;
+
+static unsigned char *read_file(char *path, unsigned *len)
+{
+    FILE *fp;
+    unsigned char *buf;
+
+    if ((fp=fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "%s: cannot read file `%s'\n", prog_name, path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(fp, 0, SEEK_END);
+    *len = (unsigned)ftell(fp);
+    rewind(fp);
+    buf = malloc(*len+1);
+    *len = (unsigned)fread(buf, 1, *len, fp);
+    buf[*len] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+static void bad_span(char *path)
+{
+    fprintf(stderr, "%s: %s: span outside of the input\n", prog_name, path);
+    exit(EXIT_FAILURE);
+}
+
+/* reproduce meta_machine's output */
+static int to_text(EvReader *r, char *input, unsigned len, char *input_path, char *events_path)
+{
+    int k, indent;
+    Event ev;
+
+    indent = 1;
+    while ((k=ev_next(r, &ev)) > 0) {
+        switch (ev.tag) {
+        case EV_CL:
+        case EV_CI:
+        case EV_GN:
+        case EV_POS:
+            if (indent)
+                putchar('\t');
+            if (ev.tag == EV_CL) {
+                fputs(r->literals[ev.a], stdout);
+            } else if (ev.tag == EV_GN) {
+                printf("L%u", ev.a);
+            } else if (ev.tag == EV_POS) {
+                printf("%u:%u", ev.a, ev.b);
+            } else {
+                if (ev.start>ev.end || ev.end>len)
+                    bad_span(events_path);
+                fwrite(input+ev.start, 1, ev.end-ev.start, stdout);
+            }
+            indent = 0;
+            break;
+        case EV_LB:
+            indent = 0;
+            break;
+        case EV_OUT:
+            putchar('\n');
+            indent = 1;
+            break;
+        case EV_END:
+            if (ev.a == META_SYNTAX_ERROR)
+                printf("%s: %s:%u: syntax error\n", prog_name, input_path, ev.b);
+            else if (ev.a == META_TOO_DEEP)
+                fprintf(stderr, "%s: %s:%u: rules nested too deeply\n", prog_name, input_path, ev.b);
+            break;
+        }
+    }
+    return k;
+}
+
+static int list(EvReader *r, char *input, unsigned len, char *events_path)
+{
+    int k, depth;
+    char *name;
+    Event ev;
+    static char *tags[] = { NULL, "ENTER", "EXIT", "TST", "ID", "NUM", "SR",
+                            "CL", "CI", "GN", "LB", "OUT", "END", "SCN", "POS" };
+
+    depth = 0;
+    while ((k=ev_next(r, &ev)) > 0) {
+        if (ev.tag == EV_EXIT)
+            --depth;
+        printf("%*s%s", 2*depth, "", tags[ev.tag]);
+        switch (ev.tag) {
+        case EV_ENTER:
+            name = ev_rule_name(r, ev.a);
+            printf(" %s @%u\n", name!=NULL?name:"?", ev.start);
+            ++depth;
+            break;
+        case EV_EXIT:
+            printf(" %u @%u\n", ev.a, ev.end);
+            break;
+        case EV_TST:
+        case EV_ID:
+        case EV_NUM:
+        case EV_SR:
+        case EV_CI:
+        case EV_SCN:
+            if (ev.start>ev.end || ev.end>len)
+                bad_span(events_path);
+            printf(" @%u `%.*s'\n", ev.start, (int)(ev.end-ev.start), input+ev.start);
+            break;
+        case EV_CL:
+            printf(" '%s'\n", r->literals[ev.a]);
+            break;
+        case EV_GN:
+            printf(" L%u\n", ev.a);
+            break;
+        case EV_END:
+            printf(" %u %u\n", ev.a, ev.b);
+            break;
+        case EV_POS:
+            printf(" %u:%u\n", ev.a, ev.b);
+            break;
+        default:
+            printf("\n");
+            break;
+        }
+    }
+    return k;
+}
+
+int main(int argc, char *argv[])
+{
+    int k, do_list;
+    unsigned len, inlen;
+    unsigned char *buf;
+    char *input;
+    EvReader r;
+
+    prog_name = argv[0];
+    do_list = 0;
+    if (argc>1 && strcmp(argv[1], "-l")==0) {
+        do_list = 1;
+        --argc;
+        ++argv;
+    }
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s [ -l ] <events> <input>\n", prog_name);
+        exit(EXIT_SUCCESS);
+    }
+    buf = read_file(argv[1], &len);
+    input = (char *)read_file(argv[2], &inlen);
+    if (!ev_open(&r, buf, len)) {
+        fprintf(stderr, "%s: `%s' is not an event stream\n", prog_name, argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    if (do_list)
+        k = list(&r, input, inlen, argv[1]);
+    else
+        k = to_text(&r, input, inlen, argv[2], argv[1]);
+    if (k < 0) {
+        fprintf(stderr, "%s: %s: malformed event stream\n", prog_name, argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    ev_close(&r);
+    free(buf);
+    free(input);
+
+    return 0;
+}
@@ -0,0 +1,946 @@
+/*
+    The machine's main loop. meta.c includes this file once for each policy,
+    with POLICY set to one of:
+
+    POLICY_NONE         no backtracking: a syntax error ends the run and the
+                        output goes straight to the sink.
+    POLICY_BACKTRACK    CLL and ALT save the state; a syntax error goes back
+                        to the innermost pending alternative or, if there's
+                        none in the current rule, makes the rule fail. Output
+                        is held back until no failure can take it back.
+    POLICY_MEMO         backtracking, and the result of every rule invocation
+                        is kept so that a run after an edit can replay it
+                        (see meta_bt_edit()).
+
+    and EXECUTE set to the name of the function to define. With a
+    backtracking policy LEXCACHE may be set to 1 to have the token scanners
+    go through bt's token cache (see meta_bt_lex()). With POLICY_NONE or
+    POLICY_BACKTRACK, CHECK may be set to 1 to run a program stripped by
+    meta_strip(): nothing is written and the registers, frames and choices
+    carry none of the state that only output depends on. With POLICY_NONE,
+    PROFILE may be set to 1 to count into prog->prof how many times each
+    instruction is executed and each branch taken (see meta_profile()).
+    With POLICY_NONE and no CHECK, FEED may be set to 1 to have the run stop
+    for more input (see meta_feed()), EVENTS to write events when out->events
+    is set and PARALLEL to record or take speculative results (see
+    meta_execute_parallel()). With POLICY_NONE, LIMITS may be set to 1 to
+    stop past prog->limits; the depth is always checked, and the
+    backtracking variants check all the limits.
+    With POLICY_BACKTRACK, SPEC may be set to 1 to run the alternative of
+    bt->job ahead of time for a worker of meta_bt_spec(); the runs of the
+    other backtracking variants without CHECK take its result.
+    What a policy doesn't need is left out by the preprocessor.
+*/
+#define BACKTRACK   (POLICY != POLICY_NONE)
+#define MEMO        (POLICY == POLICY_MEMO)
+#define SPECULATE   (POLICY == POLICY_BACKTRACK && !CHECK && !SPEC)
+
+#if POLICY == POLICY_NONE
+#define ICOUNT          icount
+#define BUDGET          st->budget
+#define EMIT(s, n)      out_write(out, s, n)
+#define COL0            st->col0
+#else
+#define ICOUNT          bt->icount
+#define BUDGET          bt->budget
+#define EMIT(s, n)      out_put(out, s, n)
+#define COL0            0
+#endif
+
+#if EVENTS
+#define WRITING_EVENTS  out->events
+#define EVENT(tag, nargs, a, b, c)  do { if (out->events) out_event(out, tag, nargs, a, b, c); } while (0)
+#else
+#define WRITING_EVENTS  0
+#define EVENT(tag, nargs, a, b, c)  do { } while (0)
+#endif
+
+#if FEED
+#define SUSPEND_AT(s)   do { if ((s) == more) goto suspend; } while (0)
+#else
+#define SUSPEND_AT(s)   do { } while (0)
+#endif
+
+#if BACKTRACK && LEXCACHE
+#define SKIP_WHITE(s)   lex_skip(bt, s, &line_counter)
+#define SCAN(s, scan)   lex_token(bt, s, scan)
+#else
+#define SKIP_WHITE(s)   skip_white(s, &line_counter)
+#define SCAN(s, scan)   scan(s)
+#endif
+
+#if MEMO
+#define TOUCH(p)        do { if ((p) > hwm) hwm = (p); } while (0)
+#define TOK_SET()       (frames[top_frame].tok_set = 1)
+#else
+#define TOUCH(p)        do { } while (0)
+#define TOK_SET()       do { } while (0)
+#endif
+
+#if PROFILE
+#define COUNT()         (++prog->prof[ip-code].n)
+#define TAKEN()         (++prog->prof[ip-code].taken)
+#else
+#define COUNT()         do { } while (0)
+#define TAKEN()         do { } while (0)
+#endif
+
+#if SPEC
+#define CANCEL_POINT()                                                      \
+    do {                                                                    \
+        if (atomic_load_explicit(&job->cancel, memory_order_relaxed)) {     \
+            status = ALT_CANCELLED;                                         \
+            goto done;                                                      \
+        }                                                                   \
+    } while (0)
+#define RUNNING()       (ip<lim && (ip!=job->stop || top_frame>0))
+#define NCHOICES        job->maxchoices
+#else
+#define CANCEL_POINT()  do { } while (0)
+#define RUNNING()       (ip < lim)
+#define NCHOICES        MAXCHOICES
+#endif
+
+/* stop if the run went past a limit; done where loops can spin */
+#if BACKTRACK || LIMITS
+#define GOVERN()                                                            \
+    do {                                                                    \
+        CANCEL_POINT();                                                     \
+        if (ICOUNT >= BUDGET.check_at                                       \
+        && (status=budget_check(&BUDGET, &prog->limits, ICOUNT, out)) != META_OK) \
+            goto done;                                                      \
+    } while (0)
+#else
+#define GOVERN()        do { } while (0)
+#endif
+#define BRANCH()                                                            \
+    do {                                                                    \
+        dest = &code[M_ARG(*ip)];                                           \
+        if (dest <= ip)                                                     \
+            GOVERN();                                                       \
+        TAKEN();                                                            \
+        ip = dest;                                                          \
+    } while (0)
+
+#if BACKTRACK && CHECK
+#define FRAME           CkFrame
+#define CHOICE          CkChoice
+#define DISCARDED(f)    0
+#define RESTORE(f)                          \
+    do {                                    \
+        pos = (f)->in_pos;                  \
+        line_counter = (f)->line_counter;   \
+    } while (0)
+#elif BACKTRACK
+#define FRAME           BtFrame
+#define CHOICE          Choice
+#define DISCARDED(f)    (out->pos-(f)->out_pos)     /* output that failing to f takes back */
+/* back to the state upon entry to frame or alternative f */
+#define RESTORE(f)                          \
+    do {                                    \
+        pos = (f)->in_pos;                  \
+        out->pos = (f)->out_pos;            \
+        tok = (f)->tok;                     \
+        toklen = (f)->toklen;               \
+        line_counter = (f)->line_counter;   \
+        labcnt = (f)->labcnt;               \
+        indent = (f)->indent;               \
+        bt->nmarks = (f)->nmarks;           \
+    } while (0)
+#endif
+
+#if BACKTRACK
+/* forget the alternatives of this invocation that execution has left */
+#define DROP_CHOICES()                                                  \
+    do {                                                                \
+        while (top_choice > frames[top_frame].nchoices                  \
+        && (ip<=choices[top_choice-1].alt || ip>=choices[top_choice-1].next)) \
+            --top_choice;                                               \
+    } while (0)
+#define RULE()  (top_frame>0 ? M_ARG(code[frames[top_frame].ret_addr-1]) : M_ARG(code[0]))
+#endif
+
+#if POLICY == POLICY_BACKTRACK && !CHECK
+#define SAVE_REGS(r)                                            \
+    do {                                                        \
+        (r).ip = (int)(ip-code);                                \
+        (r).res = res;                                          \
+        (r).labcnt = labcnt;                                    \
+        (r).indent = indent;                                    \
+        (r).line_counter = line_counter;                        \
+        (r).pos = (int)(pos-input);                             \
+        (r).tok = (int)(tok-input);                             \
+        (r).toklen = toklen;                                    \
+        (r).top_frame = top_frame;                              \
+    } while (0)
+#endif
+
+#if SPECULATE
+/* at ALT and CLL: write a checkpoint if one is due and nothing can be taken back */
+#define CHECKPOINT()                                            \
+    do {                                                        \
+        if (bt->icount>=bt->ckpt_at && top_choice==0) {         \
+            SAVE_REGS(regs);                                    \
+            bt_checkpoint(bt, &regs, frames);                   \
+        }                                                       \
+    } while (0)
+/* cancel the alternatives frame f has running ahead */
+#define STOP_ALTS(f)                                            \
+    do {                                                        \
+        if ((f)->alts != NULL) {                                \
+            alt_stop(bt, (f)->alts);                            \
+            (f)->alts = NULL;                                   \
+        }                                                       \
+    } while (0)
+#else
+#define CHECKPOINT()    do { } while (0)
+#define STOP_ALTS(f)    do { } while (0)
+#endif
+
+#if MEMO
+/* merge the bookkeeping of the returning frame into its caller */
+#define POP_FRAME()                                                     \
+    do {                                                                \
+        if (frames[top_frame].hwm > hwm)                                \
+            hwm = frames[top_frame].hwm;                                \
+        if (frames[top_frame].tok_dep && !frames[top_frame-1].tok_set)  \
+            frames[top_frame-1].tok_dep = 1;                            \
+        if (frames[top_frame].tok_set)                                  \
+            frames[top_frame-1].tok_set = 1;                            \
+        if (frames[top_frame].pos_dep)                                  \
+            frames[top_frame-1].pos_dep = 1;                            \
+        --top_frame;                                                    \
+    } while (0)
+#else
+#define POP_FRAME()     (--top_frame)
+#endif
+
+/*
+    POLICY_NONE: run from state st (see state_start()). Normally that's the
+    ADR target; when recording the speculative results of chunk ck it is the
+    split rule. If st->more is set and a token scan reaches it, return
+    META_MORE with the state left at the start of the instruction; more input
+    can then be appended and the call repeated.
+
+    Otherwise: run the program over bt->input.
+*/
+#if POLICY == POLICY_NONE
+static int EXECUTE(MetaProg *prog, State *st, MetaOut *out, Spec *spec, Chunk *ck)
+#else
+static int EXECUTE(MetaBt *bt)
+#endif
+{
+    int res, status;
+    MInstr *code, *ip, *lim, *dest;
+    char *s, *t, *pos, *tok, *end;
+#if !(POLICY == POLICY_NONE && CHECK)
+    char *input;
+#endif
+    int toklen;
+#if !CHECK
+    int labcnt;
+    int indent;
+    int *lab;
+    char posbuf[32];
+#endif
+    int line_counter;
+    int top_frame;
+    Lit *lp;
+    unsigned char *map;
+#if POLICY == POLICY_NONE
+#if FEED
+    char *more;
+#endif
+#if EVENTS
+    unsigned base;
+#endif
+#if PARALLEL
+    Chunk *sck;
+    Inv *iv;
+#endif
+    Frame *frames;
+    unsigned long long icount;
+    int tail_top, spins;    /* tail calls made at tail_pos in frame tail_top */
+    char *tail_pos;
+
+    code = prog->code;
+    ip = &code[st->ip];
+    lim = &code[prog->ncode];
+#if !CHECK
+    input = st->input;
+#endif
+    pos = st->pos;
+    end = st->end;
+    tok = st->tok;
+    toklen = st->toklen;
+#if !CHECK
+    labcnt = st->labcnt;
+    indent = st->indent;
+#endif
+    line_counter = st->line_counter;
+    res = st->res;
+    frames = st->frames;
+    top_frame = st->top_frame;
+#if FEED
+    more = st->more;
+#endif
+#if EVENTS
+    base = st->base;
+#endif
+    icount = st->icount;
+    tail_top = -1;
+    tail_pos = NULL;
+    spins = 0;
+#else
+#if POLICY == POLICY_BACKTRACK && !CHECK
+    int i, n;
+#endif
+#if SPECULATE
+    BtRegs regs;
+    Resume *rs;
+#endif
+#if POLICY == POLICY_BACKTRACK && !CHECK
+    AltJob *job;
+#endif
+    MetaProg *prog;
+    MetaOut *out;
+    FRAME frames[MAXFRAMES];
+    CHOICE choices[MAXCHOICES], *c;
+    int top_choice;
+#if MEMO
+    char *hwm;          /* one past the last input char examined */
+    Memo *m;
+#endif
+
+    prog = bt->prog;
+    out = bt->out;
+    code = prog->code;
+    ip = &code[M_ARG(code[0])];
+    lim = &code[prog->ncode];
+    input = pos = tok = bt->input;
+    end = input+bt->len;
+    toklen = 0;
+    line_counter = 1;
+    res = 1;
+    top_frame = 0;
+    frames[0].nchoices = 0;
+    top_choice = 0;
+#if !CHECK
+    labcnt = 1;
+    indent = 1;
+    frames[0].lab1 = -1;
+    frames[0].lab2 = -1;
+    bt->nmarks = 0;
+#endif
+    bt->icount = 0;
+    bt->scanned = bt->cached = 0;
+#if SPECULATE
+    frames[0].alts = NULL;
+#endif
+#if MEMO
+    frames[0].tok_set = 0;
+    frames[0].tok_dep = 0;
+    frames[0].pos_dep = 0;
+    hwm = pos;
+#endif
+#if SPEC
+    job = bt->job;
+    ip = job->alt;
+    res = 0;    /* as the BT before it leaves it */
+    pos = input+job->in.pos;
+    tok = input+job->in.tok;
+    toklen = job->in.toklen;
+    line_counter = job->in.line_counter;
+    labcnt = job->in.labcnt;
+    indent = job->in.indent;
+    frames[0].lab1 = job->lab1;
+    frames[0].lab2 = job->lab2;
+#endif
+#if SPECULATE
+    if ((rs=bt->resume) != NULL) {
+        ip = &code[rs->regs.ip];
+        res = rs->regs.res;
+        labcnt = rs->regs.labcnt;
+        indent = rs->regs.indent;
+        line_counter = rs->regs.line_counter;
+        pos = input+rs->regs.pos;
+        tok = input+rs->regs.tok;
+        toklen = rs->regs.toklen;
+        top_frame = rs->regs.top_frame;
+        memcpy(frames, rs->frames, sizeof(frames[0])*(top_frame+1));
+        bt->icount = rs->icount;
+        bt->resume = NULL;
+        free(rs);
+    }
+#endif
+#endif
+    status = META_OK;
+
+    while (RUNNING()) {
+        ++ICOUNT;
+        COUNT();
+        switch (M_OP(*ip)) {
+        case OP_TST:
+            tok = pos = SKIP_WHITE(pos);
+            TOUCH(pos+1);
+            lp = LIT(prog, *ip);
+            if (*pos==lp->s[0] && end-pos>=lp->len && memcmp(pos, lp->s, lp->len)==0) {
+                s = pos+lp->len;
+                t = lp->s+lp->len;
+            } else {
+                for (s=pos, t=lp->s; *t!='\0' && *s==*t; s++, t++)
+                    ;
+                if (*t != '\0')
+                    SUSPEND_AT(s);
+            }
+            toklen = (int)(s-pos);
+            if (*t == '\0') {
+                TOUCH(s);
+                EVENT(EV_TST, 3, lp->id, OFF(pos), OFF(s));
+                pos = s;
+                res = 1;
+            } else {
+                TOUCH(s+1);
+                res = 0;
+            }
+            TOK_SET();
+            break;
+        case OP_ID:
+            tok = s = pos = SKIP_WHITE(pos);
+            if (isalpha(*s))
+                s = SCAN(s, scan_id);
+            SUSPEND_AT(s);
+            TOUCH(s+1);
+            if (s > pos) {
+                EVENT(EV_ID, 2, OFF(pos), OFF(s), 0);
+                pos = s;
+                res = 1;
+            } else {
+                res = 0;
+            }
+            toklen = (int)(s-tok);
+            TOK_SET();
+            break;
+        case OP_NUM:
+            tok = s = pos = SKIP_WHITE(pos);
+            if (isdigit(*s))
+                s = SCAN(s, scan_num);
+            SUSPEND_AT(s);
+            TOUCH(s+1);
+            if (s > pos) {
+                EVENT(EV_NUM, 2, OFF(pos), OFF(s), 0);
+                pos = s;
+                res = 1;
+            } else {
+                res = 0;
+            }
+            toklen = (int)(s-tok);
+            TOK_SET();
+            break;
+        case OP_SR:
+            tok = s = pos = SKIP_WHITE(pos);
+            if (*s == '\'')
+                s = SCAN(s, scan_sr);
+            SUSPEND_AT(s);
+            TOUCH(s+1);
+            if (*s == '\'') {
+                ++s;
+                EVENT(EV_SR, 2, OFF(pos), OFF(s), 0);
+                pos = s;
+                res = 1;
+            } else {
+                res = 0;
+            }
+            toklen = (int)(s-tok);
+            TOK_SET();
+            break;
+        case OP_SCN:
+            tok = s = pos = SKIP_WHITE(pos);
+            map = prog->shapes[M_ARG(*ip)];
+            if (map[(unsigned char)*s] & SHAPE_FIRST) {
+                ++s;
+                while (map[(unsigned char)*s] & SHAPE_REST)
+                    ++s;
+            }
+            SUSPEND_AT(s);
+            TOUCH(s+1);
+            if (s > pos) {
+                EVENT(EV_SCN, 2, OFF(pos), OFF(s), 0);
+                pos = s;
+                res = 1;
+            } else {
+                res = 0;
+            }
+            toklen = (int)(s-tok);
+            TOK_SET();
+            break;
+        case OP_SCR:    /* done by SCN */
+            break;
+        case OP_ALT:
+#if BACKTRACK
+            DROP_CHOICES();
+            CHECKPOINT();
+#if SPECULATE
+            if (bt->pool != NULL) {
+                SAVE_REGS(regs);
+                if (frames[top_frame].alts == NULL) {
+                    if (bt->pool->marked[ip-code])
+                        frames[top_frame].alts = alt_start(bt, ip, &regs, &frames[top_frame], top_choice);
+                } else if ((job=alt_take(bt, frames[top_frame].alts, ip, &regs, &frames[top_frame])) != NULL) {
+                    /* take the result of the alternative run ahead */
+                    bt->icount += job->icount;
+                    if (job->status == META_SYNTAX_ERROR) {
+                        res = 0;
+                        goto fail;
+                    }
+                    out_put(out, job->out.buf, job->out.pos);
+                    res = job->regs.res;
+                    labcnt = job->regs.labcnt;
+                    indent = job->regs.indent;
+                    line_counter = job->regs.line_counter;
+                    pos = input+job->regs.pos;
+                    tok = input+job->regs.tok;
+                    toklen = job->regs.toklen;
+                    frames[top_frame].lab1 = job->lab1_out;
+                    frames[top_frame].lab2 = job->lab2_out;
+                    ip = &code[job->regs.ip];
+                    continue;
+                }
+            }
+#endif
+            if (M_ARG(*ip) != ALT_NONE) {
+                if (top_choice == NCHOICES) {
+                    status = META_TOO_DEEP;
+                    goto done;
+                }
+                c = &choices[top_choice++];
+                c->alt = ip;
+                c->next = &code[M_ARG(*ip)];
+                c->in_pos = pos;
+                c->line_counter = line_counter;
+#if !CHECK
+                c->out_pos = out->pos;
+                c->tok = tok;
+                c->toklen = toklen;
+                c->labcnt = labcnt;
+                c->indent = indent;
+                c->lab1 = frames[top_frame].lab1;
+                c->lab2 = frames[top_frame].lab2;
+                c->nmarks = bt->nmarks;
+#endif
+#if MEMO
+                c->tok_set = frames[top_frame].tok_set;
+#endif
+                c->t0 = bt->icount;
+            }
+#endif
+            break;
+        case OP_CLL:
+            GOVERN();
+#if PARALLEL
+            if (spec!=NULL && M_ARG(*ip)==spec->rule
+            && (iv=spec_lookup(spec, (int)(pos-input), &sck))!=NULL
+            && iv->indent_in==indent && !iv->tok_dep && top_frame+iv->depth<BUDGET.maxdepth) {
+                spec_replay(sck, iv, out, labcnt);
+                pos = input+iv->end;
+                res = iv->res;
+                indent = iv->indent_out;
+                labcnt += iv->nlab;
+                line_counter += iv->lines;
+                if (iv->tok != -1) {
+                    tok = input+iv->tok;
+                    toklen = iv->toklen;
+                }
+                break;
+            }
+#endif
+#if MEMO
+            if ((m=memo_lookup(bt, M_ARG(*ip), pos, indent, tok, toklen)) != NULL) {
+                TOUCH(pos+m->ext);
+                if (m->tok_in!=NULL && !frames[top_frame].tok_set)
+                    frames[top_frame].tok_dep = 1;
+                if (m->tok_out != -1) {
+                    tok = pos+m->tok_out;
+                    toklen = m->tok_outlen;
+                    frames[top_frame].tok_set = 1;
+                }
+                memo_replay(bt, m, labcnt, top_frame!=0);
+                pos += m->len;
+                line_counter += m->lines;
+                labcnt += m->nlab;
+                indent = m->indent_out;
+                res = m->res;
+                break;
+            }
+#endif
+            if (top_frame == BUDGET.maxdepth) {
+                status = META_TOO_DEEP;
+                goto done;
+            }
+#if BACKTRACK
+            DROP_CHOICES();
+            CHECKPOINT();
+#endif
+            ++top_frame;
+#if PARALLEL
+            if (ck!=NULL && top_frame>ck->depth)
+                ck->depth = top_frame;
+#endif
+            frames[top_frame].ret_addr = (int)(ip-code)+1;
+#if !CHECK
+            frames[top_frame].lab1 = -1;
+            frames[top_frame].lab2 = -1;
+#endif
+#if POLICY == POLICY_NONE
+            ++st->ncalls;
+            if (top_frame > st->maxtop)
+                st->maxtop = top_frame;
+#endif
+#if BACKTRACK
+            frames[top_frame].nchoices = top_choice;
+            frames[top_frame].in_pos = pos;
+            frames[top_frame].line_counter = line_counter;
+            frames[top_frame].t0 = bt->icount;
+#if !CHECK
+            frames[top_frame].out_pos = out->pos;
+            frames[top_frame].tok = tok;
+            frames[top_frame].toklen = toklen;
+            frames[top_frame].labcnt = labcnt;
+            frames[top_frame].indent = indent;
+            frames[top_frame].nmarks = bt->nmarks;
+#endif
+#endif
+#if SPECULATE
+            frames[top_frame].alts = NULL;
+#endif
+#if MEMO
+            frames[top_frame].hwm = hwm;
+            frames[top_frame].tok_set = 0;
+            frames[top_frame].tok_dep = 0;
+            frames[top_frame].pos_dep = 0;
+            hwm = pos;
+#endif
+            ip = &code[M_ARG(*ip)];
+            EVENT(EV_ENTER, 2, (unsigned)(ip-code), OFF(pos), 0);
+            continue;
+        case OP_R:
+            EVENT(EV_EXIT, 2, res, OFF(pos), 0);
+            if (top_frame == 0)
+                goto done;
+#if POLICY == POLICY_NONE
+            if (top_frame <= tail_top)
+                tail_top = -1;
+#endif
+            ip = &code[frames[top_frame].ret_addr];
+            STOP_ALTS(&frames[top_frame]);
+#if MEMO
+            memo_store(bt, &frames[top_frame], M_ARG(ip[-1]), res, pos, tok, toklen,
+                       line_counter, labcnt, indent, hwm);
+#endif
+#if BACKTRACK
+            top_choice = frames[top_frame].nchoices;
+#endif
+            POP_FRAME();
+            continue;
+#if POLICY == POLICY_NONE
+        case OP_TCL:
+            GOVERN();
+            /*
+                Tail calls that make no progress count against the depth
+                limit as the calls they replace would have: left recursion
+                still ends with META_TOO_DEEP.
+            */
+            if (top_frame!=tail_top || pos!=tail_pos) {
+                tail_top = top_frame;
+                tail_pos = pos;
+                spins = 0;
+            }
+            if (top_frame+spins >= BUDGET.maxdepth) {
+                status = META_TOO_DEEP;
+                goto done;
+            }
+            ++spins;
+            ++st->ntails;
+#if !CHECK
+            frames[top_frame].lab1 = -1;
+            frames[top_frame].lab2 = -1;
+#endif
+            ip = &code[M_ARG(*ip)];
+            continue;
+#endif
+        case OP_SET:
+            res = 1;
+            break;
+        case OP_B:
+            BRANCH();
+            continue;
+        case OP_BT:
+            if (res) {
+                BRANCH();
+                continue;
+            }
+            break;
+        case OP_BF:
+            if (!res) {
+                BRANCH();
+                continue;
+            }
+            break;
+        case OP_BE:
+            if (!res) {
+#if SPECULATE
+            fail:
+#endif
+#if BACKTRACK
+                DROP_CHOICES();
+                if (top_choice > frames[top_frame].nchoices) {
+                    /* try the next alternative */
+                    c = &choices[--top_choice];
+                    if (bt->trace != NULL)
+                        trace_record(bt, (unsigned)RULE(), (int)(c->in_pos-input), (int)(pos-input),
+                                     DISCARDED(c), top_frame, c->t0);
+                    RESTORE(c);
+#if !CHECK
+                    frames[top_frame].lab1 = c->lab1;
+                    frames[top_frame].lab2 = c->lab2;
+#endif
+#if MEMO
+                    frames[top_frame].tok_set = c->tok_set;
+#endif
+                    ip = c->next;
+                    continue;
+                }
+                if (top_frame > 0) {
+                    /* fail the rule */
+                    if (bt->trace != NULL)
+                        trace_record(bt, (unsigned)RULE(), (int)(frames[top_frame].in_pos-input),
+                                     (int)(pos-input), DISCARDED(&frames[top_frame]), top_frame,
+                                     frames[top_frame].t0);
+                    RESTORE(&frames[top_frame]);
+                    ip = &code[frames[top_frame].ret_addr];
+                    STOP_ALTS(&frames[top_frame]);
+#if MEMO
+                    frames[top_frame].tok_set = 0;
+                    frames[top_frame].tok_dep = 0;
+                    frames[top_frame].pos_dep = 0;
+                    memo_store(bt, &frames[top_frame], M_ARG(ip[-1]), 0, pos, tok, toklen,
+                               line_counter, labcnt, indent, hwm);
+#endif
+                    top_choice = frames[top_frame].nchoices;
+                    POP_FRAME();
+                    continue;
+                }
+#endif
+                status = META_SYNTAX_ERROR;
+                goto done;
+            }
+            break;
+#if !CHECK
+        case OP_CL:
+            if (WRITING_EVENTS) {
+                out_event(out, EV_CL, 1, LIT(prog, *ip)->id, 0, 0);
+                break;
+            }
+            if (indent)
+                EMIT("\t", 1);
+            EMIT(LIT(prog, *ip)->s, LIT(prog, *ip)->len);
+            indent = 0;
+            break;
+        case OP_CI:
+#if PARALLEL
+            if (tok == NULL) {  /* only when speculating */
+                ck->tok_dep = 1;
+                break;
+            }
+#endif
+#if EVENTS
+            if (out->events) {
+                out_event(out, EV_CI, 2, OFF(tok), OFF(tok)+toklen, 0);
+                break;
+            }
+#endif
+#if MEMO
+            if (!frames[top_frame].tok_set)
+                frames[top_frame].tok_dep = 1;
+#endif
+            if (indent)
+                EMIT("\t", 1);
+            EMIT(tok, toklen);
+            indent = 0;
+            break;
+        case OP_GN1:
+            lab = &frames[top_frame].lab1;
+            goto label;
+#if POLICY == POLICY_NONE
+        case OP_INL:
+            frames[top_frame].ilab1 = -1;
+            frames[top_frame].ilab2 = -1;
+            break;
+        case OP_GNI1:
+            lab = &frames[top_frame].ilab1;
+            goto label;
+        case OP_GNI2:
+            lab = &frames[top_frame].ilab2;
+            goto label;
+#endif
+        case OP_GN2:
+            lab = &frames[top_frame].lab2;
+        label:
+            if (*lab == -1)
+                *lab = labcnt++;
+            if (WRITING_EVENTS) {
+                out_event(out, EV_GN, 1, *lab, 0, 0);
+                break;
+            }
+            if (indent)
+                EMIT("\t", 1);
+#if POLICY == POLICY_NONE
+#if PARALLEL
+            if (ck != NULL)
+                chunk_mark(ck, out->pos, *lab);
+#endif
+            out_label(out, *lab);
+#else
+            bt_label(bt, *lab, MEMO);
+#endif
+            indent = 0;
+            break;
+        case OP_POS:    /* line:column of the next token */
+            pos = SKIP_WHITE(pos);
+            SUSPEND_AT(pos);
+            TOUCH(pos+1);
+#if PARALLEL
+            if (ck != NULL)     /* a chunk counts lines from its start */
+                ck->tok_dep = 1;
+#endif
+#if MEMO
+            frames[top_frame].pos_dep = 1;
+#endif
+            if (WRITING_EVENTS) {
+                out_event(out, EV_POS, 2, line_counter, column(input, pos, COL0), 0);
+                break;
+            }
+            if (indent)
+                EMIT("\t", 1);
+            EMIT(posbuf, sprintf(posbuf, "%d:%d", line_counter, column(input, pos, COL0)));
+            indent = 0;
+            break;
+        case OP_LB:
+            EVENT(EV_LB, 0, 0, 0, 0);
+            indent = 0;
+            break;
+        case OP_OUT:
+            if (WRITING_EVENTS) {
+                out_event(out, EV_OUT, 0, 0, 0, 0);
+                break;
+            }
+            EMIT("\n", 1);
+            indent = 1;
+#if POLICY == POLICY_BACKTRACK
+            if (out->pos>=OUTFLUSHSIZ && SINK(out)) {
+                /*
+                    a failure can only take back output from frames[1].out_pos
+                    or from the first pending alternative on
+                */
+                DROP_CHOICES();
+                n = top_frame>0 ? frames[1].out_pos : out->pos;
+                if (top_choice>0 && choices[0].out_pos<n)
+                    n = choices[0].out_pos;
+                if (n > 0) {
+                    out_commit(out, n);
+                    for (i = 1; i <= top_frame; i++)
+                        frames[i].out_pos -= n;
+                    for (i = 0; i < top_choice; i++)
+                        choices[i].out_pos -= n;
+                }
+            }
+#endif
+            break;
+#endif
+        case OP_END:
+        case OP_ADR:
+        default:
+            assert(0);
+        }
+        ++ip;
+    }
+#if POLICY == POLICY_NONE
+    goto done;
+#if FEED
+suspend:
+    status = META_MORE;
+#endif
+done:
+    st->ip = (int)(ip-code);
+    st->top_frame = top_frame;
+    st->pos = pos;
+    st->tok = tok;
+    st->toklen = toklen;
+    st->res = res;
+#if !CHECK
+    st->labcnt = labcnt;
+    st->indent = indent;
+#endif
+    st->line_counter = line_counter;
+    st->icount = icount;
+#else
+done:
+#if SPECULATE
+    for (; top_frame >= 0; top_frame--)
+        STOP_ALTS(&frames[top_frame]);
+#endif
+#if SPEC
+    SAVE_REGS(job->regs);
+    job->lab1_out = frames[0].lab1;
+    job->lab2_out = frames[0].lab2;
+#endif
+    bt->line_counter = line_counter;
+    bt->pos = (int)(pos-input);
+#if CHECK
+    (void)toklen;   /* only CI needs it */
+#endif
+#endif
+    return status;
+}
+
+#undef BACKTRACK
+#undef MEMO
+#undef ICOUNT
+#undef BUDGET
+#undef GOVERN
+#undef BRANCH
+#undef EMIT
+#undef COL0
+#undef WRITING_EVENTS
+#undef EVENT
+#undef SUSPEND_AT
+#undef SKIP_WHITE
+#undef SCAN
+#undef TOUCH
+#undef TOK_SET
+#undef RESTORE
+#undef FRAME
+#undef CHOICE
+#undef DISCARDED
+#undef DROP_CHOICES
+#undef RULE
+#undef CHECKPOINT
+#undef SAVE_REGS
+#undef STOP_ALTS
+#undef SPECULATE
+#undef CANCEL_POINT
+#undef RUNNING
+#undef NCHOICES
+#undef POP_FRAME
+#undef POLICY
+#undef LEXCACHE
+#undef CHECK
+#undef SPEC
+#undef PROFILE
+#undef FEED
+#undef EVENTS
+#undef PARALLEL
+#undef LIMITS
+#undef COUNT
+#undef TAKEN
+#undef EXECUTE
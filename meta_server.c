@@ -0,0 +1,643 @@
+/*
+    META II parse server.
+    Keep compiled META II programs loaded and run them on request.
+
+    Requests and responses are frames:
+
+        <length:4> <id:4> <type:1> <body:length-5>
+
+    (integers are big-endian). Request types:
+
+        'P' <grammar> NUL <input>   parse input with grammar
+        'R' <grammar> NUL <path>    (re)load grammar from a .m2a file
+        'S'                         report counters
+
+    A response carries the id of its request and a status type ('K' done,
+    'X' syntax error, 'E' failure). The body of a parse response is the line
+    reached by the machine (4 bytes) followed by the output; the body of a
+    failure is a message.
+
+    Requests are read from stdin (responses go to stdout) or from the
+    connections to a Unix domain socket (-s), and handed to a pool of worker
+    threads. A reload swaps the program atomically: requests already running
+    finish with the old program, which is freed when the last one is done.
+
+    -I, -T, -O and -D limit every parse as for meta_machine; a parse stopped
+    by a limit gets a failure response.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "meta.h"
+
+#define MAXGRAMMARS 64
+#define MAXTHREADS  64
+#define MAXFRAMESIZ (256*1024*1024)
+#define LATWINDOW   4096    /* # of latest requests used for percentiles */
+
+typedef struct Program Program;
+typedef struct Conn Conn;
+typedef struct Job Job;
+
+struct Program {
+    MetaProg mp;
+    int refs;
+};
+
+struct Conn {
+    int in, out;
+    int refs;               /* reader + queued/running jobs */
+    pthread_mutex_t lock;   /* protects refs */
+    pthread_mutex_t wlock;  /* serializes writes to out */
+};
+
+struct Job {
+    Conn *conn;
+    unsigned id;
+    int type;
+    char *body;
+    int len;
+    struct timespec start;
+    Job *next;
+};
+
+char *prog_name;
+
+static struct {
+    char *name;
+    Program *prog;
+} grammars[MAXGRAMMARS];
+static int ngrammars;
+static MetaLimits limits;   /* of every loaded grammar */
+static pthread_mutex_t grammars_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    Job *head, *tail;
+    int pending;        /* queued or running */
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty, idle;
+} queue = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static struct {
+    unsigned long requests, errors;
+    unsigned long bytes_in, bytes_out;
+    long lat[LATWINDOW];    /* microseconds */
+    unsigned long nlat;
+    pthread_mutex_t lock;
+} stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void put32(unsigned char *p, unsigned v)
+{
+    p[0] = (unsigned char)(v>>24);
+    p[1] = (unsigned char)(v>>16);
+    p[2] = (unsigned char)(v>>8);
+    p[3] = (unsigned char)v;
+}
+
+static unsigned get32(unsigned char *p)
+{
+    return (unsigned)p[0]<<24 | (unsigned)p[1]<<16 | (unsigned)p[2]<<8 | p[3];
+}
+
+static int read_full(int fd, void *buf, size_t n)
+{
+    ssize_t r;
+    char *p;
+
+    for (p = buf; n > 0; p += r, n -= r)
+        if ((r=read(fd, p, n)) <= 0) {
+            if (r<0 && errno==EINTR) {
+                r = 0;
+                continue;
+            }
+            return 0;
+        }
+    return 1;
+}
+
+static int write_full(int fd, void *buf, size_t n)
+{
+    ssize_t r;
+    char *p;
+
+    for (p = buf; n > 0; p += r, n -= r)
+        if ((r=write(fd, p, n)) < 0) {
+            if (errno == EINTR) {
+                r = 0;
+                continue;
+            }
+            return 0;
+        }
+    return 1;
+}
+
+/* read a frame; the body is NUL-terminated */
+static int read_frame(int fd, unsigned *id, int *type, char **body, int *len)
+{
+    unsigned n;
+    unsigned char hdr[9];
+
+    if (!read_full(fd, hdr, 4))
+        return 0;
+    if ((n=get32(hdr))<5 || n>MAXFRAMESIZ)
+        return 0;
+    if (!read_full(fd, hdr+4, 5))
+        return 0;
+    *id = get32(hdr+4);
+    *type = hdr[8];
+    *len = (int)n-5;
+    *body = malloc(*len+1);
+    if (!read_full(fd, *body, *len)) {
+        free(*body);
+        return 0;
+    }
+    (*body)[*len] = '\0';
+    return 1;
+}
+
+static int write_frame(int fd, unsigned id, int type, char *pre, int npre, char *body, int len)
+{
+    unsigned char hdr[9];
+
+    put32(hdr, (unsigned)(5+npre+len));
+    put32(hdr+4, id);
+    hdr[8] = (unsigned char)type;
+    return write_full(fd, hdr, 9) && write_full(fd, pre, npre) && write_full(fd, body, len);
+}
+
+static void conn_release(Conn *c)
+{
+    int refs;
+
+    pthread_mutex_lock(&c->lock);
+    refs = --c->refs;
+    pthread_mutex_unlock(&c->lock);
+    if (refs == 0) {
+        if (c->in != 0)
+            close(c->in);
+        if (c->out!=1 && c->out!=c->in)
+            close(c->out);
+        pthread_mutex_destroy(&c->lock);
+        pthread_mutex_destroy(&c->wlock);
+        free(c);
+    }
+}
+
+/* grammar registry */
+
+static Program *grammar_acquire(char *name)
+{
+    int i;
+    Program *p;
+
+    p = NULL;
+    pthread_mutex_lock(&grammars_lock);
+    for (i = 0; i < ngrammars; i++)
+        if (strcmp(grammars[i].name, name) == 0) {
+            p = grammars[i].prog;
+            ++p->refs;
+            break;
+        }
+    pthread_mutex_unlock(&grammars_lock);
+    return p;
+}
+
+static void grammar_release(Program *p)
+{
+    int refs;
+
+    pthread_mutex_lock(&grammars_lock);
+    refs = --p->refs;
+    pthread_mutex_unlock(&grammars_lock);
+    if (refs == 0) {
+        meta_free(&p->mp);
+        free(p);
+    }
+}
+
+/* load a program and make it the current one for name */
+static int grammar_load(char *name, char *path)
+{
+    int i;
+    Program *p, *old;
+
+    p = malloc(sizeof(*p));
+    if (!meta_load(&p->mp, path)) {
+        free(p);
+        return 0;
+    }
+    meta_drop_alts(&p->mp);
+    p->mp.limits = limits;
+    p->refs = 1;    /* the registry's */
+    old = NULL;
+    pthread_mutex_lock(&grammars_lock);
+    for (i = 0; i < ngrammars; i++)
+        if (strcmp(grammars[i].name, name) == 0)
+            break;
+    if (i == ngrammars) {
+        if (ngrammars == MAXGRAMMARS) {
+            pthread_mutex_unlock(&grammars_lock);
+            meta_free(&p->mp);
+            free(p);
+            return 0;
+        }
+        grammars[ngrammars].name = strdup(name);
+        grammars[ngrammars++].prog = NULL;
+    }
+    old = grammars[i].prog;
+    grammars[i].prog = p;
+    pthread_mutex_unlock(&grammars_lock);
+    if (old != NULL)
+        grammar_release(old);
+    return 1;
+}
+
+/* request processing */
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(long *)a, y = *(long *)b;
+
+    return (x>y)-(x<y);
+}
+
+static int stats_report(char *buf, int siz)
+{
+    int i, n;
+    long lat[LATWINDOW], p50, p99;
+    unsigned long nlat;
+
+    pthread_mutex_lock(&stats.lock);
+    nlat = stats.nlat<LATWINDOW?stats.nlat:LATWINDOW;
+    memcpy(lat, stats.lat, sizeof(long)*nlat);
+    n = snprintf(buf, siz,
+        "requests %lu\nerrors %lu\nbytes_in %lu\nbytes_out %lu\n",
+        stats.requests, stats.errors, stats.bytes_in, stats.bytes_out);
+    pthread_mutex_unlock(&stats.lock);
+    p50 = p99 = 0;
+    if (nlat > 0) {
+        qsort(lat, nlat, sizeof(long), cmp_long);
+        p50 = lat[(nlat-1)*50/100];
+        p99 = lat[(nlat-1)*99/100];
+    }
+    n += snprintf(buf+n, siz-n, "latency_p50_us %ld\nlatency_p99_us %ld\ngrammars", p50, p99);
+    pthread_mutex_lock(&grammars_lock);
+    for (i = 0; i<ngrammars && n<siz; i++)
+        n += snprintf(buf+n, siz-n, " %s", grammars[i].name);
+    pthread_mutex_unlock(&grammars_lock);
+    if (n < siz)
+        n += snprintf(buf+n, siz-n, "\n");
+    return n<siz?n:siz-1;
+}
+
+static void process(Job *j)
+{
+    int type, nout, status, line_counter;
+    char *name, *arg, *msg;
+    char buf[1024];
+    unsigned char lbuf[4];
+    Program *p;
+    MetaOut out;
+    struct timespec end;
+
+    type = 'E';
+    msg = NULL;
+    out.buf = NULL;
+    nout = 0;
+    name = j->body;
+    arg = memchr(j->body, '\0', j->len+1);  /* always found: read_frame() ends the body with one */
+    ++arg;
+    switch (j->type) {
+    case 'P':
+        if (arg > j->body+j->len) {
+            msg = "malformed request";
+        } else if ((p=grammar_acquire(name)) == NULL) {
+            msg = "unknown grammar";
+        } else {
+            meta_out_init(&out, NULL);
+            status = meta_execute(&p->mp, arg, &out, &line_counter);
+            grammar_release(p);
+            if (status!=META_OK && status!=META_SYNTAX_ERROR) {
+                msg = meta_strerror(status);
+            } else {
+                type = (status==META_OK)?'K':'X';
+                put32(lbuf, (unsigned)line_counter);
+                nout = out.pos;
+            }
+        }
+        break;
+    case 'R':
+        if (arg > j->body+j->len)
+            msg = "malformed request";
+        else if (!grammar_load(name, arg))
+            msg = "cannot load grammar";
+        else
+            type = 'K';
+        break;
+    case 'S':
+        nout = stats_report(buf, sizeof(buf));
+        type = 'K';
+        break;
+    default:
+        msg = "unknown request";
+        break;
+    }
+    pthread_mutex_lock(&j->conn->wlock);
+    if (msg != NULL)
+        write_frame(j->conn->out, j->id, type, NULL, 0, msg, (int)strlen(msg));
+    else if (j->type == 'P')
+        write_frame(j->conn->out, j->id, type, (char *)lbuf, 4, out.buf, nout);
+    else if (j->type == 'S')
+        write_frame(j->conn->out, j->id, type, NULL, 0, buf, nout);
+    else
+        write_frame(j->conn->out, j->id, type, NULL, 0, NULL, 0);
+    pthread_mutex_unlock(&j->conn->wlock);
+    free(out.buf);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_lock(&stats.lock);
+    ++stats.requests;
+    if (type != 'K')
+        ++stats.errors;
+    stats.bytes_in += (unsigned long)j->len;
+    stats.bytes_out += (unsigned long)nout;
+    stats.lat[stats.nlat++%LATWINDOW] = (end.tv_sec-j->start.tv_sec)*1000000
+                                      + (end.tv_nsec-j->start.tv_nsec)/1000;
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static void *worker(void *arg)
+{
+    Job *j;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.head == NULL)
+            pthread_cond_wait(&queue.nonempty, &queue.lock);
+        j = queue.head;
+        if ((queue.head=j->next) == NULL)
+            queue.tail = NULL;
+        pthread_mutex_unlock(&queue.lock);
+
+        process(j);
+        conn_release(j->conn);
+        free(j->body);
+        free(j);
+
+        pthread_mutex_lock(&queue.lock);
+        if (--queue.pending == 0)
+            pthread_cond_broadcast(&queue.idle);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    return NULL;
+}
+
+static void submit(Job *j)
+{
+    j->next = NULL;
+    pthread_mutex_lock(&queue.lock);
+    if (queue.tail != NULL)
+        queue.tail->next = j;
+    else
+        queue.head = j;
+    queue.tail = j;
+    ++queue.pending;
+    pthread_cond_signal(&queue.nonempty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/* read requests from a connection until it is closed */
+static void *reader(void *arg)
+{
+    Conn *c;
+    Job *j;
+
+    c = arg;
+    for (;;) {
+        j = malloc(sizeof(*j));
+        if (!read_frame(c->in, &j->id, &j->type, &j->body, &j->len)) {
+            free(j);
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &j->start);
+        j->conn = c;
+        pthread_mutex_lock(&c->lock);
+        ++c->refs;
+        pthread_mutex_unlock(&c->lock);
+        submit(j);
+    }
+    conn_release(c);
+    return NULL;
+}
+
+static Conn *new_conn(int in, int out)
+{
+    Conn *c;
+
+    c = malloc(sizeof(*c));
+    c->in = in;
+    c->out = out;
+    c->refs = 1;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_mutex_init(&c->wlock, NULL);
+    return c;
+}
+
+static int serve_socket(char *path)
+{
+    int fd, cfd;
+    pthread_t tid;
+    struct sockaddr_un addr;
+
+    if ((fd=socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "%s: cannot create socket\n", prog_name);
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))<0 || listen(fd, 64)<0) {
+        fprintf(stderr, "%s: cannot listen on `%s'\n", prog_name, path);
+        close(fd);
+        return 0;
+    }
+    for (;;) {
+        if ((cfd=accept(fd, NULL, NULL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pthread_create(&tid, NULL, reader, new_conn(cfd, cfd)) == 0)
+            pthread_detach(tid);
+        else
+            close(cfd);
+    }
+    close(fd);
+    return 0;
+}
+
+static void serve_stdio(void)
+{
+    reader(new_conn(0, 1));
+    pthread_mutex_lock(&queue.lock);
+    while (queue.pending > 0)
+        pthread_cond_wait(&queue.idle, &queue.lock);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+    Client side, for scripts and tests:
+        -c <socket> parse <grammar> <input>
+        -c <socket> reload <grammar> <code>
+        -c <socket> stats
+*/
+static int client(int argc, char *argv[])
+{
+    int fd, type, len, tries, status;
+    unsigned id;
+    char *body, *req, *input_path;
+    size_t nname, nreq;
+    FILE *fp;
+    struct sockaddr_un addr;
+
+    if (argc<2 || strcmp(argv[1], "stats")!=0 && argc<4) {
+        fprintf(stderr, "usage: %s -c <socket> parse|reload <grammar> <file> | stats\n", prog_name);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "stats") == 0) {
+        type = 'S';
+        req = NULL;
+        nreq = 0;
+    } else if (strcmp(argv[1], "reload") == 0) {
+        type = 'R';
+        nname = strlen(argv[2])+1;
+        nreq = nname+strlen(argv[3]);
+        req = malloc(nreq+1);
+        strcpy(req, argv[2]);
+        strcpy(req+nname, argv[3]);
+    } else if (strcmp(argv[1], "parse") == 0) {
+        type = 'P';
+        input_path = argv[3];
+        if ((fp=fopen(input_path, "rb")) == NULL) {
+            fprintf(stderr, "%s: cannot read input file `%s'\n", prog_name, input_path);
+            return EXIT_FAILURE;
+        }
+        fseek(fp, 0, SEEK_END);
+        len = (int)ftell(fp);
+        rewind(fp);
+        nname = strlen(argv[2])+1;
+        req = malloc(nname+len);
+        strcpy(req, argv[2]);
+        nreq = nname+fread(req+nname, 1, len, fp);
+        fclose(fp);
+    } else {
+        fprintf(stderr, "%s: unknown request `%s'\n", prog_name, argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[0], sizeof(addr.sun_path)-1);
+    for (tries = 0; ; tries++) {    /* the server may be starting up */
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            break;
+        close(fd);
+        if (tries == 50) {
+            fprintf(stderr, "%s: cannot connect to `%s'\n", prog_name, argv[0]);
+            return EXIT_FAILURE;
+        }
+        usleep(100000);
+    }
+    if (!write_frame(fd, 1, type, NULL, 0, req, (int)nreq)
+    || !read_frame(fd, &id, &type, &body, &len)) {
+        fprintf(stderr, "%s: connection to `%s' lost\n", prog_name, argv[0]);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    free(req);
+
+    status = EXIT_SUCCESS;
+    if (type == 'E') {
+        fprintf(stderr, "%s: %s\n", prog_name, body);
+        status = EXIT_FAILURE;
+    } else if (argv[1][0] == 'p') {
+        fwrite(body+4, 1, len-4, stdout);
+        if (type == 'X')
+            printf("%s: %s:%u: syntax error\n", prog_name, input_path, get32((unsigned char *)body));
+    } else {
+        fwrite(body, 1, len, stdout);
+    }
+    free(body);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, nthreads;
+    char *socket_path, *p;
+    pthread_t tid;
+
+    prog_name = argv[0];
+    signal(SIGPIPE, SIG_IGN);
+    if (argc>2 && strcmp(argv[1], "-c")==0)
+        return client(argc-2, argv+2);
+
+    nthreads = 4;
+    socket_path = NULL;
+    for (i = 1; i<argc && argv[i][0]=='-'; i++) {
+        if (strcmp(argv[i], "-t")==0 && i+1<argc) {
+            nthreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s")==0 && i+1<argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "-I")==0 && i+1<argc) {
+            limits.steps = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-T")==0 && i+1<argc) {
+            limits.msecs = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-O")==0 && i+1<argc) {
+            limits.output = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "-D")==0 && i+1<argc) {
+            limits.depth = atoi(argv[++i]);
+        } else {
+            i = argc;
+            break;
+        }
+    }
+    if (i>=argc || nthreads<1 || nthreads>MAXTHREADS) {
+        fprintf(stderr, "usage: %s [ -t <threads> ] [ -s <socket> ]\n"
+                        "           [ -I <instructions> ] [ -T <msecs> ] [ -O <bytes> ] [ -D <depth> ] <grammar>=<code> ...\n"
+                        "       %s -c <socket> parse|reload <grammar> <file> | stats\n",
+                        prog_name, prog_name);
+        exit(EXIT_SUCCESS);
+    }
+    for (; i < argc; i++) {
+        if ((p=strchr(argv[i], '=')) == NULL) {
+            fprintf(stderr, "%s: expecting <grammar>=<code>, got `%s'\n", prog_name, argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        *p = '\0';
+        if (!grammar_load(argv[i], p+1))
+            exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nthreads; i++)
+        if (pthread_create(&tid, NULL, worker, NULL) != 0) {
+            fprintf(stderr, "%s: cannot create worker thread\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+    if (socket_path != NULL)
+        serve_socket(socket_path);
+    else
+        serve_stdio();
+
+    return 0;
+}
@@ -0,0 +1,322 @@
+/*
+    Report where the backtracking META II machine wastes its time, from the
+    trace it writes with -t (see trace.h).
+
+    Totals: input chars scanned again because a rule or an alternative failed
+    after consuming them, output thrown away, and the share of the
+    instructions executed in rule invocations and alternatives that
+    eventually failed (nested failures counted once).
+
+    Then the rules and the rule/position pairs with the most waste. The hint
+    column says what would likely help:
+        memo    the rule fails repeatedly at the same position; memoizing
+                its result (meta_machine_bt -e keeps such a table) avoids
+                re-running it
+        factor  the rule consumes a lot before failing; the alternatives
+                that call it probably share a prefix that should be factored
+                out, or the failure is better reported as an error right away
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "trace.h"
+
+#define FACTOR_MIN  16  /* avg # of re-scanned chars per failure for "factor" */
+
+typedef struct {
+    unsigned addr;
+    char *name;
+} RuleName;
+
+typedef struct {
+    unsigned rule;
+    unsigned long n;
+    unsigned long long rescanned, discarded, wasted;
+    unsigned long repeats;  /* failures at a position where it failed before */
+} RuleStat;
+
+typedef struct {
+    unsigned rule, start;
+    unsigned long n;
+    unsigned long long rescanned, wasted;
+} PosStat;
+
+char *prog_name;
+
+static unsigned char *buf, *p, *lim;
+static RuleName *names;
+static int nnames;
+static TraceRec *recs;
+static int nrecs;
+
+static void corrupt(char *path)
+{
+    fprintf(stderr, "%s: %s: malformed trace\n", prog_name, path);
+    exit(EXIT_FAILURE);
+}
+
+static int get32(unsigned *v)
+{
+    if (lim-p < 4)
+        return 0;
+    *v = (unsigned)p[0] | (unsigned)p[1]<<8 | (unsigned)p[2]<<16 | (unsigned)p[3]<<24;
+    p += 4;
+    return 1;
+}
+
+static int get64(unsigned long long *v)
+{
+    unsigned lo, hi;
+
+    if (!get32(&lo) || !get32(&hi))
+        return 0;
+    *v = (unsigned long long)hi<<32 | lo;
+    return 1;
+}
+
+static int is_generated_label(char *s)
+{
+    if (*s++ != 'L' || !isdigit(*s))
+        return 0;
+    while (isdigit(*s))
+        ++s;
+    return *s == '\0';
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+    const RuleName *x = a, *y = b;
+
+    if (x->addr != y->addr)
+        return x->addr<y->addr ? -1 : 1;
+    return is_generated_label(x->name)-is_generated_label(y->name);
+}
+
+static char *rule_name(unsigned addr)
+{
+    int lo, hi, mid;
+    static char buf[32];
+
+    for (lo = 0, hi = nnames-1; lo <= hi; ) {
+        mid = (lo+hi)/2;
+        if (names[mid].addr < addr) {
+            lo = mid+1;
+        } else if (names[mid].addr > addr) {
+            hi = mid-1;
+        } else {
+            while (mid>0 && names[mid-1].addr==addr)
+                --mid;
+            return names[mid].name;
+        }
+    }
+    sprintf(buf, "@%u", addr);
+    return buf;
+}
+
+static void read_trace(char *path)
+{
+    unsigned i, n, len, version;
+    long siz;
+    FILE *fp;
+    TraceRec *r;
+
+    if ((fp=fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "%s: cannot read file `%s'\n", prog_name, path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(fp, 0, SEEK_END);
+    siz = ftell(fp);
+    rewind(fp);
+    buf = malloc(siz+1);
+    siz = (long)fread(buf, 1, siz, fp);
+    fclose(fp);
+    p = buf;
+    lim = buf+siz;
+
+    if (siz<4 || memcmp(p, TR_MAGIC, 4)!=0)
+        corrupt(path);
+    p += 4;
+    if (!get32(&version) || version!=TR_VERSION || !get32(&n) || n>(unsigned)(lim-p)/8)
+        corrupt(path);
+    names = malloc(sizeof(RuleName)*(n?n:1));
+    for (i = 0; i < n; i++) {
+        if (!get32(&names[i].addr) || !get32(&len) || len>(unsigned)(lim-p))
+            corrupt(path);
+        names[i].name = malloc(len+1);
+        memcpy(names[i].name, p, len);
+        names[i].name[len] = '\0';
+        p += len;
+    }
+    nnames = (int)n;
+    qsort(names, nnames, sizeof(RuleName), cmp_names);
+
+    if ((lim-p)%TR_RECSIZ != 0)
+        corrupt(path);
+    nrecs = (int)((lim-p)/TR_RECSIZ);
+    recs = malloc(sizeof(TraceRec)*(nrecs?nrecs:1));
+    for (r = recs; p < lim; r++)
+        if (!get32(&r->rule) || !get32(&r->start) || !get32(&r->fail) || !get32(&r->discarded)
+        || !get32(&r->depth) || !get64(&r->t0) || !get64(&r->t1)
+        || r->rule!=TR_END && (r->fail<r->start || r->t1<r->t0))
+            corrupt(path);
+}
+
+static int cmp_pos(const void *a, const void *b)
+{
+    const TraceRec *x = a, *y = b;
+
+    if (x->rule != y->rule)
+        return x->rule<y->rule ? -1 : 1;
+    if (x->start != y->start)
+        return x->start<y->start ? -1 : 1;
+    return 0;
+}
+
+static int cmp_rule_stats(const void *a, const void *b)
+{
+    const RuleStat *x = a, *y = b;
+
+    if (x->wasted != y->wasted)
+        return x->wasted>y->wasted ? -1 : 1;
+    return x->rescanned>y->rescanned ? -1 : x->rescanned<y->rescanned;
+}
+
+static int cmp_pos_stats(const void *a, const void *b)
+{
+    const PosStat *x = a, *y = b;
+
+    if (x->rescanned != y->rescanned)
+        return x->rescanned>y->rescanned ? -1 : 1;
+    return x->wasted>y->wasted ? -1 : x->wasted<y->wasted;
+}
+
+static char *hint(RuleStat *rs)
+{
+    if (rs->repeats*2 >= rs->n)
+        return "memo";
+    if (rs->rescanned >= FACTOR_MIN*(unsigned long long)rs->n)
+        return "factor";
+    return "-";
+}
+
+static double percent(unsigned long long a, unsigned long long b)
+{
+    return b ? 100.0*(double)a/(double)b : 0.0;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, j, top, nruns, nfails, nrules, npos, sp, limit;
+    unsigned long long input_len, instrs, rescanned, discarded, wasted;
+    unsigned long long *stack_t0, *stack_t1;
+    TraceRec *r;
+    RuleStat *rules;
+    PosStat *pos;
+
+    prog_name = argv[0];
+    limit = 20;
+    if (argc>2 && strcmp(argv[1], "-n")==0) {
+        limit = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s [ -n <# of rows> ] <trace>\n", prog_name);
+        exit(EXIT_SUCCESS);
+    }
+    read_trace(argv[1]);
+
+    /*
+        Failures come in order of t1. A failure contains the ones that
+        happened since its t0; keep a stack of the outermost ones so far.
+    */
+    stack_t0 = malloc(sizeof(unsigned long long)*(nrecs?nrecs:1));
+    stack_t1 = malloc(sizeof(unsigned long long)*(nrecs?nrecs:1));
+    input_len = instrs = rescanned = discarded = wasted = 0;
+    nruns = nfails = sp = 0;
+    for (i = 0, r = recs; i < nrecs; i++, r++) {
+        if (r->rule == TR_END) {
+            while (sp > 0) {
+                --sp;
+                wasted += stack_t1[sp]-stack_t0[sp];
+            }
+            input_len += r->start;
+            instrs += r->t1;
+            ++nruns;
+            continue;
+        }
+        while (sp>0 && stack_t0[sp-1]>=r->t0)
+            --sp;
+        stack_t0[sp] = r->t0;
+        stack_t1[sp++] = r->t1;
+        rescanned += r->fail-r->start;
+        discarded += r->discarded;
+        ++nfails;
+    }
+    while (sp > 0) {    /* the run was cut short */
+        --sp;
+        wasted += stack_t1[sp]-stack_t0[sp];
+    }
+
+    printf("runs              %d\n", nruns);
+    printf("input             %llu chars\n", input_len);
+    printf("instructions      %llu\n", instrs);
+    printf("failures          %d\n", nfails);
+    printf("re-scanned        %llu chars (%.1f%% of input)\n", rescanned, percent(rescanned, input_len));
+    printf("discarded output  %llu bytes\n", discarded);
+    printf("wasted            %llu instructions (%.1f%% of run)\n", wasted, percent(wasted, instrs));
+
+    /* group by rule/position, then by rule */
+    for (i = j = 0; i < nrecs; i++)
+        if (recs[i].rule != TR_END)
+            recs[j++] = recs[i];
+    nrecs = j;
+    qsort(recs, nrecs, sizeof(TraceRec), cmp_pos);
+    rules = calloc(nrecs?nrecs:1, sizeof(RuleStat));
+    pos = calloc(nrecs?nrecs:1, sizeof(PosStat));
+    nrules = npos = 0;
+    for (i = 0, r = recs; i < nrecs; i++, r++) {
+        if (nrules==0 || rules[nrules-1].rule!=r->rule)
+            rules[nrules++].rule = r->rule;
+        if (npos==0 || pos[npos-1].rule!=r->rule || pos[npos-1].start!=r->start) {
+            pos[npos].rule = r->rule;
+            pos[npos++].start = r->start;
+        } else {
+            ++rules[nrules-1].repeats;
+        }
+        ++rules[nrules-1].n;
+        rules[nrules-1].rescanned += r->fail-r->start;
+        rules[nrules-1].discarded += r->discarded;
+        rules[nrules-1].wasted += r->t1-r->t0;
+        ++pos[npos-1].n;
+        pos[npos-1].rescanned += r->fail-r->start;
+        pos[npos-1].wasted += r->t1-r->t0;
+    }
+    qsort(rules, nrules, sizeof(RuleStat), cmp_rule_stats);
+    qsort(pos, npos, sizeof(PosStat), cmp_pos_stats);
+
+    if (nrules > 0) {
+        printf("\n%-24s %10s %12s %12s %14s %s\n", "rule", "failures", "re-scanned", "discarded",
+               "instructions", "hint");
+        for (i = 0, top = nrules<limit?nrules:limit; i < top; i++)
+            printf("%-24s %10lu %12llu %12llu %14llu %s\n", rule_name(rules[i].rule), rules[i].n,
+                   rules[i].rescanned, rules[i].discarded, rules[i].wasted, hint(&rules[i]));
+        printf("\n%-24s %10s %10s %12s %14s\n", "rule", "offset", "failures", "re-scanned",
+               "instructions");
+        for (i = 0, top = npos<limit?npos:limit; i < top; i++)
+            printf("%-24s %10u %10lu %12llu %14llu\n", rule_name(pos[i].rule), pos[i].start,
+                   pos[i].n, pos[i].rescanned, pos[i].wasted);
+    }
+
+    for (i = 0; i < nnames; i++)
+        free(names[i].name);
+    free(names);
+    free(recs);
+    free(rules);
+    free(pos);
+    free(stack_t0);
+    free(stack_t1);
+    free(buf);
+    return 0;
+}
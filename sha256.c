@@ -0,0 +1,97 @@
+/*
+    SHA-256; see sha256.h.
+*/
+#include <string.h>
+#include "sha256.h"
+
+static const unsigned k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)   ((x)>>(n) | (x)<<(32-(n)))
+
+static void block(Sha256 *c, unsigned char *p)
+{
+    int i;
+    unsigned w[64], a, b, d, e, f, g, h, cc, t1, t2;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (unsigned)p[4*i]<<24 | (unsigned)p[4*i+1]<<16 | (unsigned)p[4*i+2]<<8 | p[4*i+3];
+    for (i = 16; i < 64; i++)
+        w[i] = w[i-16] + (ROR(w[i-15], 7)^ROR(w[i-15], 18)^w[i-15]>>3)
+             + w[i-7] + (ROR(w[i-2], 17)^ROR(w[i-2], 19)^w[i-2]>>10);
+    a = c->h[0], b = c->h[1], cc = c->h[2], d = c->h[3];
+    e = c->h[4], f = c->h[5], g = c->h[6], h = c->h[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROR(e, 6)^ROR(e, 11)^ROR(e, 25)) + (e&f^~e&g) + k[i] + w[i];
+        t2 = (ROR(a, 2)^ROR(a, 13)^ROR(a, 22)) + (a&b^a&cc^b&cc);
+        h = g, g = f, f = e, e = d+t1;
+        d = cc, cc = b, b = a, a = t1+t2;
+    }
+    c->h[0] += a, c->h[1] += b, c->h[2] += cc, c->h[3] += d;
+    c->h[4] += e, c->h[5] += f, c->h[6] += g, c->h[7] += h;
+}
+
+void sha256_init(Sha256 *c)
+{
+    static const unsigned h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(c->h, h0, sizeof(h0));
+    c->nbuf = 0;
+    c->len = 0;
+}
+
+void sha256_feed(Sha256 *c, void *data, long n)
+{
+    int m;
+    unsigned char *p;
+
+    p = data;
+    c->len += (unsigned long long)n;
+    while (n > 0) {
+        if (c->nbuf==0 && n>=64) {
+            block(c, p);
+            p += 64, n -= 64;
+            continue;
+        }
+        m = 64-c->nbuf;
+        if (m > n)
+            m = (int)n;
+        memcpy(c->buf+c->nbuf, p, m);
+        c->nbuf += m;
+        p += m, n -= m;
+        if (c->nbuf == 64) {
+            block(c, c->buf);
+            c->nbuf = 0;
+        }
+    }
+}
+
+void sha256_end(Sha256 *c, unsigned char digest[32])
+{
+    int i;
+    unsigned long long bits;
+
+    bits = c->len*8;
+    c->buf[c->nbuf++] = 0x80;
+    if (c->nbuf > 56) {
+        memset(c->buf+c->nbuf, 0, 64-c->nbuf);
+        block(c, c->buf);
+        c->nbuf = 0;
+    }
+    memset(c->buf+c->nbuf, 0, 56-c->nbuf);
+    for (i = 0; i < 8; i++)
+        c->buf[56+i] = (unsigned char)(bits>>(56-8*i));
+    block(c, c->buf);
+    for (i = 0; i < 32; i++)
+        digest[i] = (unsigned char)(c->h[i/4]>>(24-8*(i%4)));
+}
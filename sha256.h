@@ -0,0 +1,18 @@
+#ifndef SHA256_H_
+#define SHA256_H_
+
+/* SHA-256 (FIPS 180-4), fed in pieces */
+typedef struct Sha256 Sha256;
+
+struct Sha256 {
+    unsigned h[8];
+    unsigned char buf[64];
+    int nbuf;
+    unsigned long long len;     /* # of bytes fed */
+};
+
+void sha256_init(Sha256 *c);
+void sha256_feed(Sha256 *c, void *data, long n);
+void sha256_end(Sha256 *c, unsigned char digest[32]);
+
+#endif
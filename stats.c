@@ -0,0 +1,299 @@
+/*
+    Run statistics; see stats.h.
+
+    On every phase switch the time and the counters are read and what went
+    by since the previous switch is added to the phase being left. The
+    hardware counters are one perf event group so that they're read with a
+    single read(); a counter the CPU or the kernel doesn't have is left out
+    of the group, and if the group can't be opened at all (no PMU, no
+    permission) only times are reported.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "stats.h"
+
+#define NHW 4
+
+static char *phase_names[PH_NPHASES] = { "load", "input", "compile", "execute", "output" };
+static char *hw_names[NHW] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+static unsigned long long hw_config[NHW] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static struct {
+    int mode;                   /* 0: off, 1: text, 2: JSON */
+    int on;
+    int phase;
+    int fd;                     /* group leader, -1 if no counters */
+    int nhw, hw[NHW];           /* counters in the group, in read order */
+    int hw_err;                 /* why there are no counters */
+    unsigned long long wall, cpu, hwv[NHW];     /* at the last switch */
+    unsigned long long wall_ns[PH_NPHASES], cpu_ns[PH_NPHASES];
+    unsigned long long hw_sum[PH_NPHASES][NHW];
+    int used[PH_NPHASES];
+} st;
+
+static atomic_ullong counts[ST_NCOUNTS];
+static atomic_ullong nallocs, nreallocs, nfrees, nbytes;
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t siz);
+void *__real_realloc(void *p, size_t n);
+void __real_free(void *p);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t n)
+{
+    atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&nbytes, n, memory_order_relaxed);
+    return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t siz)
+{
+    atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&nbytes, n*siz, memory_order_relaxed);
+    return __real_calloc(n, siz);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+    atomic_fetch_add_explicit(p!=NULL?&nreallocs:&nallocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&nbytes, n, memory_order_relaxed);
+    return __real_realloc(p, n);
+}
+
+char *__wrap_strdup(const char *s)
+{
+    atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&nbytes, strlen(s)+1, memory_order_relaxed);
+    return __real_strdup(s);
+}
+
+void __wrap_free(void *p)
+{
+    if (p != NULL)
+        atomic_fetch_add_explicit(&nfrees, 1, memory_order_relaxed);
+    __real_free(p);
+}
+
+/* recognize --stats and --stats=json */
+int stats_option(char *arg)
+{
+    if (strcmp(arg, "--stats") == 0)
+        st.mode = 1;
+    else if (strcmp(arg, "--stats=json") == 0)
+        st.mode = 2;
+    else
+        return 0;
+    return 1;
+}
+
+static int perf_open(unsigned long long config, int group)
+{
+    struct perf_event_attr a;
+
+    memset(&a, 0, sizeof(a));
+    a.type = PERF_TYPE_HARDWARE;
+    a.size = sizeof(a);
+    a.config = config;
+    a.read_format = PERF_FORMAT_GROUP;
+    a.exclude_kernel = 1;
+    a.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &a, 0, -1, group, 0);
+}
+
+static unsigned long long ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return (unsigned long long)ts.tv_sec*1000000000+(unsigned long long)ts.tv_nsec;
+}
+
+/* add what went by since the last switch to the current phase */
+static void account(void)
+{
+    int i;
+    unsigned long long t, buf[1+NHW];
+
+    t = ns(CLOCK_MONOTONIC);
+    st.wall_ns[st.phase] += t-st.wall;
+    st.wall = t;
+    t = ns(CLOCK_PROCESS_CPUTIME_ID);
+    st.cpu_ns[st.phase] += t-st.cpu;
+    st.cpu = t;
+    if (st.fd!=-1 && read(st.fd, buf, sizeof(buf))>0) {
+        for (i = 0; i<st.nhw && i<(int)buf[0]; i++) {
+            st.hw_sum[st.phase][st.hw[i]] += buf[1+i]-st.hwv[i];
+            st.hwv[i] = buf[1+i];
+        }
+    }
+    st.used[st.phase] = 1;
+}
+
+/* start counting in phase if --stats was given */
+void stats_start(int phase)
+{
+    int i, fd;
+
+    if (st.mode==0 || st.on)
+        return;
+    st.fd = -1;
+    for (i = 0; i < NHW; i++) {
+        if ((fd=perf_open(hw_config[i], st.fd)) == -1) {
+            if (st.fd == -1) {
+                st.hw_err = errno;
+                break;
+            }
+            continue;
+        }
+        if (st.fd == -1)
+            st.fd = fd;
+        st.hw[st.nhw++] = i;
+    }
+    st.wall = ns(CLOCK_MONOTONIC);
+    st.cpu = ns(CLOCK_PROCESS_CPUTIME_ID);
+    st.phase = phase;
+    st.on = 1;
+}
+
+/* switch to phase and return the previous one */
+int stats_phase(int phase)
+{
+    int prev;
+
+    if (!st.on)
+        return phase;
+    account();
+    prev = st.phase;
+    st.phase = phase;
+    return prev;
+}
+
+void stats_add(int counter, unsigned long long n)
+{
+    atomic_fetch_add_explicit(&counts[counter], n, memory_order_relaxed);
+}
+
+void stats_max(int counter, unsigned long long n)
+{
+    unsigned long long v;
+
+    v = atomic_load_explicit(&counts[counter], memory_order_relaxed);
+    while (v<n && !atomic_compare_exchange_weak_explicit(&counts[counter], &v, n,
+                                                         memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static double ms(unsigned long long t)
+{
+    return (double)t/1e6;
+}
+
+/* write the report to stderr and stop counting */
+void stats_report(void)
+{
+    int i, j, first;
+    unsigned long long wall, cpu, hw[NHW];
+    struct rusage ru;
+
+    if (!st.on)
+        return;
+    account();
+    st.on = 0;
+    if (st.fd != -1)
+        close(st.fd);
+    getrusage(RUSAGE_SELF, &ru);
+    wall = cpu = 0;
+    memset(hw, 0, sizeof(hw));
+    for (i = 0; i < PH_NPHASES; i++) {
+        wall += st.wall_ns[i];
+        cpu += st.cpu_ns[i];
+        for (j = 0; j < NHW; j++)
+            hw[j] += st.hw_sum[i][j];
+    }
+
+    if (st.mode == 2) {
+        fprintf(stderr, "{\"phases\":{");
+        for (i = 0, first = 1; i < PH_NPHASES; i++) {
+            if (!st.used[i])
+                continue;
+            fprintf(stderr, "%s\"%s\":{\"wall_ns\":%llu,\"cpu_ns\":%llu", first?"":",",
+                    phase_names[i], st.wall_ns[i], st.cpu_ns[i]);
+            for (j = 0; j < st.nhw; j++)
+                fprintf(stderr, ",\"%s\":%llu", hw_names[st.hw[j]], st.hw_sum[i][st.hw[j]]);
+            fprintf(stderr, "}");
+            first = 0;
+        }
+        fprintf(stderr, "},\"wall_ns\":%llu,\"cpu_ns\":%llu", wall, cpu);
+        for (j = 0; j < st.nhw; j++)
+            fprintf(stderr, ",\"%s\":%llu", hw_names[st.hw[j]], hw[st.hw[j]]);
+        if (st.fd == -1)
+            fprintf(stderr, ",\"counters_unavailable\":\"%s\"", strerror(st.hw_err));
+        fprintf(stderr, ",\"bytes_in\":%llu,\"bytes_out\":%llu,\"machine_instructions\":%llu",
+                (unsigned long long)counts[ST_BYTES_IN], (unsigned long long)counts[ST_BYTES_OUT],
+                (unsigned long long)counts[ST_STEPS]);
+        if (counts[ST_SCANNED]+counts[ST_CACHED] > 0)
+            fprintf(stderr, ",\"scanned_bytes\":%llu,\"cached_bytes\":%llu",
+                    (unsigned long long)counts[ST_SCANNED], (unsigned long long)counts[ST_CACHED]);
+        if (counts[ST_DEPTH] > 0)
+            fprintf(stderr, ",\"rule_calls\":%llu,\"tail_calls\":%llu,\"max_depth\":%llu",
+                    (unsigned long long)counts[ST_CALLS], (unsigned long long)counts[ST_TAILCALLS],
+                    (unsigned long long)counts[ST_DEPTH]);
+        if (counts[ST_AHEAD] > 0)
+            fprintf(stderr, ",\"alternatives_ahead\":%llu,\"alternatives_taken\":%llu",
+                    (unsigned long long)counts[ST_AHEAD], (unsigned long long)counts[ST_TAKEN]);
+        fprintf(stderr, ",\"peak_rss_kb\":%ld,\"page_faults\":%ld", ru.ru_maxrss, ru.ru_minflt+ru.ru_majflt);
+        fprintf(stderr, ",\"allocations\":%llu,\"reallocations\":%llu,\"frees\":%llu,\"allocated_bytes\":%llu}\n",
+                (unsigned long long)nallocs, (unsigned long long)nreallocs,
+                (unsigned long long)nfrees, (unsigned long long)nbytes);
+        return;
+    }
+
+    fprintf(stderr, "%-10s %10s %10s", "phase", "wall ms", "cpu ms");
+    for (j = 0; j < st.nhw; j++)
+        fprintf(stderr, " %14s", hw_names[st.hw[j]]);
+    fprintf(stderr, "\n");
+    for (i = 0; i <= PH_NPHASES; i++) {
+        if (i<PH_NPHASES && !st.used[i])
+            continue;
+        fprintf(stderr, "%-10s %10.3f %10.3f", i<PH_NPHASES?phase_names[i]:"total",
+                ms(i<PH_NPHASES?st.wall_ns[i]:wall), ms(i<PH_NPHASES?st.cpu_ns[i]:cpu));
+        for (j = 0; j < st.nhw; j++)
+            fprintf(stderr, " %14llu", i<PH_NPHASES?st.hw_sum[i][st.hw[j]]:hw[st.hw[j]]);
+        fprintf(stderr, "\n");
+    }
+    if (st.fd == -1)
+        fprintf(stderr, "hardware counters unavailable: %s\n", strerror(st.hw_err));
+    fprintf(stderr, "bytes in              %llu\n", (unsigned long long)counts[ST_BYTES_IN]);
+    fprintf(stderr, "bytes out             %llu\n", (unsigned long long)counts[ST_BYTES_OUT]);
+    if (counts[ST_STEPS] > 0)
+        fprintf(stderr, "machine instructions  %llu\n", (unsigned long long)counts[ST_STEPS]);
+    if (counts[ST_SCANNED]+counts[ST_CACHED] > 0)
+        fprintf(stderr, "scanned               %llu chars (%llu more from the token cache)\n",
+                (unsigned long long)counts[ST_SCANNED], (unsigned long long)counts[ST_CACHED]);
+    if (counts[ST_DEPTH] > 0)
+        fprintf(stderr, "rule calls            %llu (%llu more as tail calls), max depth %llu\n",
+                (unsigned long long)counts[ST_CALLS], (unsigned long long)counts[ST_TAILCALLS],
+                (unsigned long long)counts[ST_DEPTH]);
+    if (counts[ST_AHEAD] > 0)
+        fprintf(stderr, "run ahead             %llu alternatives (%llu taken)\n",
+                (unsigned long long)counts[ST_AHEAD], (unsigned long long)counts[ST_TAKEN]);
+    fprintf(stderr, "peak RSS              %ld KB\n", ru.ru_maxrss);
+    fprintf(stderr, "page faults           %ld\n", ru.ru_minflt+ru.ru_majflt);
+    fprintf(stderr, "allocations           %llu (%llu reallocations, %llu frees, %llu bytes)\n",
+            (unsigned long long)nallocs, (unsigned long long)nreallocs,
+            (unsigned long long)nfrees, (unsigned long long)nbytes);
+}
@@ -0,0 +1,46 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+/*
+    Run statistics (--stats). Wall time, CPU time and, when the kernel lets
+    perf_event_open() count them, cycles, instructions, cache misses and
+    branch misses of the main thread are split by phase: the program says
+    which phase it's in with stats_phase(). The report goes to stderr, as
+    text or JSON, with the byte and instruction counts, the peak RSS and
+    the # of allocations.
+
+    Allocations are counted by wrapping malloc() and co. at link time
+    (-Wl,--wrap=malloc,... see the makefile), so programs that link this
+    file must be linked with those options.
+*/
+enum {
+    PH_LOAD,        /* reading the code */
+    PH_INPUT,       /* reading the input */
+    PH_COMPILE,     /* turning it into code to execute, if that's a step */
+    PH_EXEC,
+    PH_OUTPUT,      /* writing the output out */
+    PH_NPHASES
+};
+
+enum {
+    ST_BYTES_IN,
+    ST_BYTES_OUT,
+    ST_STEPS,       /* machine instructions executed */
+    ST_SCANNED,     /* input chars looked at by the token scanners */
+    ST_CACHED,      /* input chars skipped over by the token cache */
+    ST_CALLS,       /* rule calls */
+    ST_TAILCALLS,   /* rule calls that reused the caller's frame */
+    ST_DEPTH,       /* max # of active rules; see stats_max() */
+    ST_AHEAD,       /* alternatives run ahead on other threads */
+    ST_TAKEN,       /* ... whose result was taken */
+    ST_NCOUNTS
+};
+
+int stats_option(char *arg);
+void stats_start(int phase);
+int stats_phase(int phase);
+void stats_add(int counter, unsigned long long n);
+void stats_max(int counter, unsigned long long n);
+void stats_report(void);
+
+#endif
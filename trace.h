@@ -0,0 +1,38 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*
+    Backtrack trace written by the backtracking META II machine (-t) and
+    read by meta_trace.
+
+    trace   = header { record }
+    header  = "M2BT" version nrules { addr len bytes }
+    record  = rule start fail discarded depth t0 t1
+
+    A record is written each time BE makes a rule or an alternative fail:
+    rule is the rule's address, start and fail the input offsets where the
+    rule or alternative was entered and where the error was found, discarded
+    the # of output bytes thrown away and depth the # of active rules. t0 and t1 are the # of instructions executed
+    since the start of the run upon entry and at the failure.
+
+    A record with rule TR_END closes a run: start is the length of the input,
+    fail is 1 if the run failed and t1 is the # of instructions executed.
+
+    Numbers are 32-bit little-endian except t0 and t1 which are 64-bit.
+*/
+#define TR_MAGIC    "M2BT"
+#define TR_VERSION  1
+#define TR_END      0xFFFFFFFFu
+#define TR_RECSIZ   36
+
+typedef struct TraceRec TraceRec;
+
+struct TraceRec {
+    unsigned rule;
+    unsigned start, fail;
+    unsigned discarded;
+    unsigned depth;
+    unsigned long long t0, t1;
+};
+
+#endif
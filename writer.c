@@ -0,0 +1,145 @@
+/*
+    Double-buffered writer thread.
+
+    Each buffer's length word says who owns it: 0, the producer (empty);
+    > 0, the writer thread (that many bytes to write); -1, the writer thread
+    must stop. The two sides hand the buffers over in the same order, so
+    each knows which word to wait on next. Waiting is done with a futex on
+    that word; nothing else is shared.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "writer.h"
+
+typedef struct {
+    char buf[WRITERBUFSIZ];
+    atomic_int len;
+} WBuf;
+
+struct Writer {
+    WBuf b[2];
+    int cur, pos;       /* producer: buffer being filled, # of bytes in it */
+    int fd;
+    int err;            /* set by the writer thread, read after the join */
+    pthread_t tid;
+};
+
+static void futex_wait(atomic_int *p, int val)
+{
+    syscall(SYS_futex, p, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_int *p)
+{
+    syscall(SYS_futex, p, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* wait until *p is not val */
+static int wait_change(atomic_int *p, int val)
+{
+    int v;
+
+    while ((v=atomic_load_explicit(p, memory_order_acquire)) == val)
+        futex_wait(p, val);
+    return v;
+}
+
+/* wait until *p is val */
+static void wait_for(atomic_int *p, int val)
+{
+    int v;
+
+    while ((v=atomic_load_explicit(p, memory_order_acquire)) != val)
+        futex_wait(p, v);
+}
+
+static void *writer_run(void *arg)
+{
+    int i, len;
+    ssize_t n;
+    char *s;
+    Writer *w;
+
+    w = arg;
+    for (i = 0; ; i ^= 1) {
+        if ((len=wait_change(&w->b[i].len, 0)) == -1)
+            break;
+        for (s = w->b[i].buf; len>0 && !w->err; s += n, len -= (int)n) {
+            if ((n=write(w->fd, s, len)) < 0) {
+                if (errno == EINTR)
+                    n = 0;
+                else
+                    w->err = 1;     /* drop the rest of the output */
+            }
+        }
+        atomic_store_explicit(&w->b[i].len, 0, memory_order_release);
+        futex_wake(&w->b[i].len);
+    }
+    return NULL;
+}
+
+Writer *writer_open(int fd)
+{
+    Writer *w;
+
+    if ((w=malloc(sizeof(*w))) == NULL)
+        return NULL;
+    atomic_init(&w->b[0].len, 0);
+    atomic_init(&w->b[1].len, 0);
+    w->cur = w->pos = 0;
+    w->fd = fd;
+    w->err = 0;
+    if (pthread_create(&w->tid, NULL, writer_run, w) != 0) {
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* give the current buffer to the writer thread and take the other one */
+static void hand_over(Writer *w, int len)
+{
+    atomic_store_explicit(&w->b[w->cur].len, len, memory_order_release);
+    futex_wake(&w->b[w->cur].len);
+    w->cur ^= 1;
+    w->pos = 0;
+    wait_for(&w->b[w->cur].len, 0);
+}
+
+void writer_write(Writer *w, char *s, int n)
+{
+    int k;
+
+    while (n > 0) {
+        k = WRITERBUFSIZ-w->pos;
+        if (k > n)
+            k = n;
+        memcpy(w->b[w->cur].buf+w->pos, s, k);
+        w->pos += k;
+        s += k;
+        n -= k;
+        if (w->pos == WRITERBUFSIZ)
+            hand_over(w, w->pos);
+    }
+}
+
+/* write out what's left and stop the thread; return 0 if a write failed */
+int writer_close(Writer *w)
+{
+    int ok;
+
+    if (w->pos > 0)
+        hand_over(w, w->pos);
+    atomic_store_explicit(&w->b[w->cur].len, -1, memory_order_release);
+    futex_wake(&w->b[w->cur].len);
+    pthread_join(w->tid, NULL);
+    ok = !w->err;
+    free(w);
+    return ok;
+}
@@ -0,0 +1,17 @@
+#ifndef WRITER_H_
+#define WRITER_H_
+
+/*
+    Asynchronous output. The caller fills one buffer while a thread writes
+    the other to a file descriptor; the caller only waits when the thread
+    is still busy with the other buffer once its own is full.
+*/
+#define WRITERBUFSIZ    65536
+
+typedef struct Writer Writer;
+
+Writer *writer_open(int fd);
+void writer_write(Writer *w, char *s, int n);
+int writer_close(Writer *w);
+
+#endif